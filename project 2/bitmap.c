@@ -7,6 +7,10 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #include "bitmap.h"
 
 #define nth_bit_mask(n) (1 << (n))
@@ -34,6 +38,116 @@ void bitmap_put(void *bm, int i, int v) {
   }
 }
 
+// Set or clear count bits starting at start, returning how many changed.
+int bitmap_put_range(void *bm, int start, int count, int v) {
+  uint64_t *words = (uint64_t *) bm;
+  int changed = 0;
+  int i = start, end = start + count;
+
+  while (i < end) {
+    int bit = i % 64;
+    int n = (end - i < 64 - bit) ? end - i : 64 - bit;
+    uint64_t mask = (n == 64) ? ~0ull : ((1ull << n) - 1) << bit;
+    uint64_t *word = &words[i / 64];
+
+    if (v) {
+      changed += __builtin_popcountll(~*word & mask);
+      *word |= mask;
+    } else {
+      changed += __builtin_popcountll(*word & mask);
+      *word &= ~mask;
+    }
+    i += n;
+  }
+
+  return changed;
+}
+
+// Find the first bit in [start, end) that equals value.
+static int find_bit(void *bm, int start, int end, int value) {
+  if (start >= end) {
+    return -1;
+  }
+
+  uint64_t *words = (uint64_t *) bm;
+  uint64_t flip = value ? 0 : ~0ull; // turns the bits we want into ones
+  int wi = start / 64;
+  int last = (end - 1) / 64;
+
+  // ignore the bits before start in the first word
+  uint64_t x = (words[wi] ^ flip) & (~0ull << (start % 64));
+
+  while (x == 0) {
+    if (++wi > last) {
+      return -1;
+    }
+
+#ifdef __AVX2__
+    // skip four words at a time while none of them has a matching bit
+    __m256i skip = value ? _mm256_setzero_si256() : _mm256_set1_epi64x(-1);
+    while (wi % 4 == 0 && wi + 3 <= last) {
+      __m256i v = _mm256_loadu_si256((const __m256i *) &words[wi]);
+      __m256i eq = _mm256_cmpeq_epi64(v, skip);
+      if (_mm256_movemask_epi8(eq) != -1) {
+        break;
+      }
+      wi += 4;
+    }
+    if (wi > last) {
+      return -1;
+    }
+#endif
+
+    x = words[wi] ^ flip;
+  }
+
+  int bit = wi * 64 + __builtin_ctzll(x);
+
+  return bit < end ? bit : -1;
+}
+
+// Find the first clear bit in [start, end).
+int bitmap_find_zero(void *bm, int start, int end) {
+  return find_bit(bm, start, end, 0);
+}
+
+// Find the first set bit in [start, end).
+int bitmap_find_one(void *bm, int start, int end) {
+  return find_bit(bm, start, end, 1);
+}
+
+// Find the first run of count clear bits in [start, end).
+int bitmap_find_zero_run(void *bm, int start, int end, int count) {
+  int pos = bitmap_find_zero(bm, start, end);
+
+  while (pos >= 0 && pos + count <= end) {
+    // the run is long enough unless a set bit shows up before its end
+    int one = bitmap_find_one(bm, pos, pos + count);
+    if (one < 0) {
+      return pos;
+    }
+    pos = bitmap_find_zero(bm, one, end);
+  }
+
+  return -1;
+}
+
+// Count the set bits in [0, size).
+int bitmap_count(void *bm, int size) {
+  uint64_t *words = (uint64_t *) bm;
+  int count = 0;
+
+  for (int i = 0; i < size / 64; i++) {
+    count += __builtin_popcountll(words[i]);
+  }
+  if (size % 64) {
+    count += __builtin_popcountll(words[size / 64] &
+                                  ((1ull << (size % 64)) - 1));
+  }
+
+  return count;
+}
+
 // Pretty-print the bitmap (with the given no. of bits).
 void bitmap_print(void *bm, int size) {
 
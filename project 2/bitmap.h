@@ -26,6 +26,65 @@ int bitmap_get(void *bm, int i);
  */
 void bitmap_put(void *bm, int i, int v);
 
+/**
+ * Set or clear a range of bits.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param start Index of the first bit.
+ * @param count Number of bits.
+ * @param v Value the bits should be set to (0 or 1).
+ *
+ * @return The number of bits that changed.
+ */
+int bitmap_put_range(void *bm, int start, int count, int v);
+
+/**
+ * Find the first clear bit in [start, end).
+ *
+ * The bitmap is scanned a 64-bit word at a time (four words at a time when
+ * built with AVX2), so the bitmap must be 8-byte aligned.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param start Index of the first bit to look at.
+ * @param end Index one past the last bit to look at.
+ *
+ * @return The index of the bit, or -1 if every bit in the range is set.
+ */
+int bitmap_find_zero(void *bm, int start, int end);
+
+/**
+ * Find the first set bit in [start, end).
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param start Index of the first bit to look at.
+ * @param end Index one past the last bit to look at.
+ *
+ * @return The index of the bit, or -1 if every bit in the range is clear.
+ */
+int bitmap_find_one(void *bm, int start, int end);
+
+/**
+ * Find the first run of count clear bits in [start, end).
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param start Index of the first bit to look at.
+ * @param end Index one past the last bit to look at.
+ * @param count Length of the run.
+ *
+ * @return The index of the first bit of the run, or -1 if there is none.
+ */
+int bitmap_find_zero_run(void *bm, int start, int end, int count);
+
+/**
+ * Count the set bits in [0, size).
+ *
+ * @param bm Pointer to the bitmap.
+ * @param size The number of bits to count.
+ *
+ * @return The number of set bits.
+ */
+int bitmap_count(void *bm, int size);
+
 /**
  * Pretty-print a bitmap. 
  *
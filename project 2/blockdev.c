@@ -0,0 +1,785 @@
+// Block devices with mmap, buffer cache and io_uring backends. See
+// blockdev.h.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "blockdev.h"
+
+// <linux/io_uring.h> defines a BLOCK_SIZE of its own, so blocks.h can't be
+// included here; this matches NUFS_DEFAULT_BLOCK_SIZE.
+#define DEFAULT_BLOCK_SIZE 4096
+#define DEFAULT_CACHE_BLOCKS 4096 // 16 MB of 4K blocks
+#define DEFAULT_SHARDS 16
+#define DEFAULT_QUEUE_DEPTH 64
+
+// A block in the cache. Buffers being read are in their shard's table but
+// not yet valid; unpinned valid buffers are also on the shard's LRU list.
+typedef struct buf {
+  uint32_t bnum;
+  int refs;
+  int dirty;
+  int valid;
+  struct buf *hnext; // next in the hash chain
+  struct buf *prev;  // LRU list, most recently used first
+  struct buf *next;
+  char *data;
+} buf_t;
+
+typedef struct shard {
+  pthread_mutex_t lock;
+  pthread_cond_t loaded; // a buffer finished reading
+  buf_t **table;
+  uint32_t table_mask;
+  buf_t lru; // list head
+  size_t count;
+  size_t cap;
+  blockdev_stats_t stats;
+} shard_t;
+
+// An io_uring instance, with its rings mapped
+typedef struct ring {
+  int fd;
+  pthread_mutex_t lock;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+} ring_t;
+
+struct blockdev {
+  blockdev_kind_t kind;
+  int fd;
+  int block_size;
+  int readonly;
+  uint32_t count;
+
+  char *base; // BLOCKDEV_MMAP
+  size_t length;
+
+  shard_t *shards; // BLOCKDEV_CACHE and BLOCKDEV_URING
+  int nshards;
+  ring_t *ring; // BLOCKDEV_URING
+};
+
+static const char *kind_names[] = {"mmap", "cache", "uring"};
+
+void blockdev_default_options(blockdev_options_t *opts) {
+  memset(opts, 0, sizeof(*opts));
+  opts->kind = BLOCKDEV_MMAP;
+  opts->block_size = DEFAULT_BLOCK_SIZE;
+}
+
+int blockdev_parse_kind(const char *name) {
+  for (int i = 0; i < 3; i++) {
+    if (strcmp(name, kind_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+const char *blockdev_kind_name(blockdev_kind_t kind) {
+  return kind_names[kind];
+}
+
+// io_uring ------------------------------------------------------------------
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static void ring_free(ring_t *ring) {
+  if (ring->sqes) {
+    munmap(ring->sqes, ring->sqes_len);
+  }
+  if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) {
+    munmap(ring->cq_ptr, ring->cq_len);
+  }
+  if (ring->sq_ptr) {
+    munmap(ring->sq_ptr, ring->sq_len);
+  }
+  if (ring->fd >= 0) {
+    close(ring->fd);
+  }
+  pthread_mutex_destroy(&ring->lock);
+  free(ring);
+}
+
+// Set up a ring and map its queues. Returns NULL with errno set if the
+// kernel doesn't have io_uring or won't let us use it.
+static ring_t *ring_new(unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+
+  ring_t *ring = calloc(1, sizeof(ring_t));
+  pthread_mutex_init(&ring->lock, NULL);
+  ring->fd = uring_setup(entries, &p);
+  if (ring->fd < 0) {
+    int err = errno;
+    ring_free(ring);
+    errno = err == EPERM || err == EINVAL ? ENOSYS : err;
+    return NULL;
+  }
+  ring->entries = p.sq_entries;
+
+  ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->sq_len = ring->cq_len = ring->sq_len > ring->cq_len ? ring->sq_len
+                                                              : ring->cq_len;
+  }
+  ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) {
+    ring->sq_ptr = NULL;
+    goto fail;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ptr = ring->sq_ptr;
+  }
+  else {
+    ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) {
+      ring->cq_ptr = NULL;
+      goto fail;
+    }
+  }
+  ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto fail;
+  }
+
+  char *sq = ring->sq_ptr;
+  char *cq = ring->cq_ptr;
+  ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+  ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return ring;
+
+fail:;
+  int err = errno;
+  ring_free(ring);
+  errno = err;
+  return NULL;
+}
+
+// Block I/O -----------------------------------------------------------------
+
+// Read or write one block with pread or pwrite. Reads past the end of the
+// file come back as zeros. Returns 0 or a negative errno.
+static int io_sync(blockdev_t *dev, buf_t *b, int write, int done) {
+  off_t pos = (off_t) b->bnum * dev->block_size;
+
+  while (done < dev->block_size) {
+    ssize_t n = write ? pwrite(dev->fd, b->data + done, dev->block_size - done,
+                               pos + done)
+                      : pread(dev->fd, b->data + done, dev->block_size - done,
+                              pos + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -errno;
+    }
+    if (n == 0 && write) {
+      return -EIO;
+    }
+    if (n == 0) {
+      memset(b->data + done, 0, dev->block_size - done);
+      break;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+// Submit up to ring->entries operations and wait for all of them. Short
+// transfers are finished with pread or pwrite.
+static void ring_batch(blockdev_t *dev, buf_t **bufs, int *rv, int count,
+                       int write) {
+  ring_t *ring = dev->ring;
+
+  unsigned tail = *ring->sq_tail;
+  for (int i = 0; i < count; i++) {
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = dev->fd;
+    sqe->addr = (uintptr_t) bufs[i]->data;
+    sqe->len = dev->block_size;
+    sqe->off = (uint64_t) bufs[i]->bnum * dev->block_size;
+    sqe->user_data = i;
+    ring->sq_array[idx] = idx;
+    tail++;
+  }
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+  int submitted = 0;
+  int reaped = 0;
+  while (reaped < count) {
+    int n = uring_enter(ring->fd, count - submitted, 1, IORING_ENTER_GETEVENTS);
+    if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      // Give up on the ring and finish what wasn't submitted ourselves
+      break;
+    }
+    if (n > 0) {
+      submitted += n;
+    }
+
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      int i = cqe->user_data;
+      rv[i] = cqe->res;
+      head++;
+      reaped++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (rv[i] < 0 && rv[i] != -EINTR && rv[i] != -EAGAIN) {
+      continue;
+    }
+    int done = rv[i] > 0 ? rv[i] : 0;
+    rv[i] = done < dev->block_size ? io_sync(dev, bufs[i], write, done) : 0;
+  }
+}
+
+// Read or write a batch of blocks, all at once through the ring if there is
+// one. Puts 0 or a negative errno for each block in rv.
+static void io_batch(blockdev_t *dev, buf_t **bufs, int *rv, int count,
+                     int write) {
+  if (!dev->ring) {
+    for (int i = 0; i < count; i++) {
+      rv[i] = io_sync(dev, bufs[i], write, 0);
+    }
+    return;
+  }
+
+  for (int i = 0; i < count; i++) {
+    rv[i] = -EINTR; // not completed yet
+  }
+  pthread_mutex_lock(&dev->ring->lock);
+  for (int i = 0; i < count; i += dev->ring->entries) {
+    int n = count - i < (int) dev->ring->entries ? count - i
+                                                 : (int) dev->ring->entries;
+    ring_batch(dev, bufs + i, rv + i, n, write);
+  }
+  pthread_mutex_unlock(&dev->ring->lock);
+}
+
+// A single block isn't worth the ring: one pread or pwrite is one system
+// call either way, and doesn't wait for the ring's lock.
+static int io_one(blockdev_t *dev, buf_t *b, int write) {
+  return io_sync(dev, b, write, 0);
+}
+
+// Buffer cache --------------------------------------------------------------
+
+static shard_t *shard_of(blockdev_t *dev, uint32_t bnum) {
+  return &dev->shards[bnum % dev->nshards];
+}
+
+static uint32_t bucket(shard_t *s, uint32_t bnum) {
+  return (bnum * 2654435761u) & s->table_mask;
+}
+
+static buf_t *table_find(shard_t *s, uint32_t bnum) {
+  buf_t *b = s->table[bucket(s, bnum)];
+  while (b && b->bnum != bnum) {
+    b = b->hnext;
+  }
+  return b;
+}
+
+static void table_insert(shard_t *s, buf_t *b) {
+  uint32_t i = bucket(s, b->bnum);
+  b->hnext = s->table[i];
+  s->table[i] = b;
+}
+
+static void table_remove(shard_t *s, buf_t *b) {
+  buf_t **p = &s->table[bucket(s, b->bnum)];
+  while (*p != b) {
+    p = &(*p)->hnext;
+  }
+  *p = b->hnext;
+}
+
+static void lru_unlink(buf_t *b) {
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  b->prev = b->next = NULL;
+}
+
+static void lru_push(shard_t *s, buf_t *b) {
+  b->next = s->lru.next;
+  b->prev = &s->lru;
+  s->lru.next->prev = b;
+  s->lru.next = b;
+}
+
+static void buf_free(buf_t *b) {
+  free(b->data);
+  free(b);
+}
+
+// Get a buffer for bnum and put it in the table, not valid yet. Reuses the
+// least recently used unpinned buffer once the shard is full, writing it
+// back first if it's dirty; if every buffer is pinned the shard grows past
+// its size. Called with the shard locked.
+static buf_t *buf_take(blockdev_t *dev, shard_t *s, uint32_t bnum) {
+  buf_t *b = NULL;
+
+  for (buf_t *v = s->lru.prev; s->count >= s->cap && v != &s->lru;
+       v = v->prev) {
+    if (v->dirty) {
+      s->stats.writes++;
+      if (io_one(dev, v, 1) != 0) {
+        continue; // keep it rather than lose the data
+      }
+      v->dirty = 0;
+    }
+    b = v;
+    break;
+  }
+
+  if (b) {
+    lru_unlink(b);
+    table_remove(s, b);
+    s->stats.evictions++;
+  }
+  else {
+    b = calloc(1, sizeof(buf_t));
+    if (!b || posix_memalign((void **) &b->data, 4096, dev->block_size) != 0) {
+      free(b);
+      return NULL;
+    }
+    s->count++;
+  }
+  b->bnum = bnum;
+  b->refs = 0;
+  b->dirty = 0;
+  b->valid = 0;
+  table_insert(s, b);
+  return b;
+}
+
+// Drop a buffer that couldn't be read. Called with the shard locked.
+static void buf_discard(shard_t *s, buf_t *b) {
+  table_remove(s, b);
+  s->count--;
+  buf_free(b);
+  pthread_cond_broadcast(&s->loaded);
+}
+
+static void *cache_get(blockdev_t *dev, uint32_t bnum) {
+  shard_t *s = shard_of(dev, bnum);
+
+  pthread_mutex_lock(&s->lock);
+  buf_t *b;
+  while ((b = table_find(s, bnum)) && !b->valid) {
+    pthread_cond_wait(&s->loaded, &s->lock);
+  }
+  if (b) {
+    if (b->refs++ == 0) {
+      lru_unlink(b);
+    }
+    s->stats.hits++;
+    pthread_mutex_unlock(&s->lock);
+    return b->data;
+  }
+
+  s->stats.misses++;
+  b = buf_take(dev, s, bnum);
+  if (!b) {
+    pthread_mutex_unlock(&s->lock);
+    errno = ENOMEM;
+    return NULL;
+  }
+  b->refs = 1;
+  s->stats.reads++;
+  pthread_mutex_unlock(&s->lock);
+
+  // Others asking for it wait until it's read
+  int rv = io_one(dev, b, 0);
+
+  pthread_mutex_lock(&s->lock);
+  if (rv < 0) {
+    buf_discard(s, b);
+    pthread_mutex_unlock(&s->lock);
+    errno = -rv;
+    return NULL;
+  }
+  b->valid = 1;
+  pthread_cond_broadcast(&s->loaded);
+  pthread_mutex_unlock(&s->lock);
+  return b->data;
+}
+
+// Find a pinned buffer. Called with the shard locked.
+static buf_t *pinned(shard_t *s, uint32_t bnum) {
+  buf_t *b = table_find(s, bnum);
+  return b && b->valid && b->refs > 0 ? b : NULL;
+}
+
+static void cache_put(blockdev_t *dev, uint32_t bnum) {
+  shard_t *s = shard_of(dev, bnum);
+
+  pthread_mutex_lock(&s->lock);
+  buf_t *b = pinned(s, bnum);
+  if (b && --b->refs == 0) {
+    lru_push(s, b);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void cache_dirty(blockdev_t *dev, uint32_t bnum) {
+  shard_t *s = shard_of(dev, bnum);
+
+  pthread_mutex_lock(&s->lock);
+  buf_t *b = pinned(s, bnum);
+  if (b) {
+    b->dirty = 1;
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+// Read blocks that aren't cached yet into the cache, as one batch
+static int cache_prefetch(blockdev_t *dev, const uint32_t *bnums, int count) {
+  buf_t **bufs = malloc(count * sizeof(buf_t *));
+  int *rv = malloc(count * sizeof(int));
+  int n = 0;
+
+  for (int i = 0; i < count; i++) {
+    if (bnums[i] >= dev->count) {
+      continue;
+    }
+    shard_t *s = shard_of(dev, bnums[i]);
+    pthread_mutex_lock(&s->lock);
+    if (!table_find(s, bnums[i])) {
+      // Pinned while it's read, so the rest of the batch can't evict it
+      buf_t *b = buf_take(dev, s, bnums[i]);
+      if (b) {
+        b->refs = 1;
+        bufs[n++] = b;
+        s->stats.reads++;
+      }
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+
+  io_batch(dev, bufs, rv, n, 0);
+
+  for (int i = 0; i < n; i++) {
+    shard_t *s = shard_of(dev, bufs[i]->bnum);
+    pthread_mutex_lock(&s->lock);
+    if (rv[i] < 0) {
+      buf_discard(s, bufs[i]);
+    }
+    else {
+      bufs[i]->valid = 1;
+      bufs[i]->refs = 0;
+      lru_push(s, bufs[i]);
+      pthread_cond_broadcast(&s->loaded);
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+
+  free(rv);
+  free(bufs);
+  return n;
+}
+
+// Write back every dirty buffer, as one batch. The buffers stay pinned
+// while they're written so they can't be evicted meanwhile.
+static int cache_flush(blockdev_t *dev) {
+  size_t cap = 0;
+  int n = 0;
+  buf_t **bufs = NULL;
+
+  for (int i = 0; i < dev->nshards; i++) {
+    shard_t *s = &dev->shards[i];
+    int first = n;
+    pthread_mutex_lock(&s->lock);
+    for (uint32_t k = 0; k <= s->table_mask; k++) {
+      for (buf_t *b = s->table[k]; b; b = b->hnext) {
+        if (!b->valid || !b->dirty) {
+          continue;
+        }
+        if ((size_t) n == cap) {
+          cap = cap ? cap * 2 : 256;
+          bufs = realloc(bufs, cap * sizeof(buf_t *));
+        }
+        if (b->refs++ == 0) {
+          lru_unlink(b);
+        }
+        b->dirty = 0;
+        bufs[n++] = b;
+      }
+    }
+    s->stats.writes += n - first;
+    pthread_mutex_unlock(&s->lock);
+  }
+
+  int *rv = malloc((n ? n : 1) * sizeof(int));
+  io_batch(dev, bufs, rv, n, 1);
+
+  int err = 0;
+  for (int i = 0; i < n; i++) {
+    shard_t *s = shard_of(dev, bufs[i]->bnum);
+    pthread_mutex_lock(&s->lock);
+    if (rv[i] < 0) {
+      bufs[i]->dirty = 1;
+      err = rv[i];
+    }
+    if (--bufs[i]->refs == 0) {
+      lru_push(s, bufs[i]);
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+
+  free(rv);
+  free(bufs);
+  return err;
+}
+
+static void cache_free(blockdev_t *dev) {
+  for (int i = 0; i < dev->nshards; i++) {
+    shard_t *s = &dev->shards[i];
+    for (uint32_t k = 0; k <= s->table_mask; k++) {
+      buf_t *b = s->table[k];
+      while (b) {
+        buf_t *next = b->hnext;
+        buf_free(b);
+        b = next;
+      }
+    }
+    free(s->table);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->loaded);
+  }
+  free(dev->shards);
+}
+
+static void cache_init(blockdev_t *dev, const blockdev_options_t *opts) {
+  size_t blocks = opts->cache_blocks ? opts->cache_blocks : DEFAULT_CACHE_BLOCKS;
+  dev->nshards = opts->shards > 0 ? opts->shards : DEFAULT_SHARDS;
+  dev->shards = calloc(dev->nshards, sizeof(shard_t));
+
+  for (int i = 0; i < dev->nshards; i++) {
+    shard_t *s = &dev->shards[i];
+    s->cap = (blocks + dev->nshards - 1) / dev->nshards;
+    uint32_t buckets = 16;
+    while (buckets < s->cap) {
+      buckets *= 2;
+    }
+    s->table = calloc(buckets, sizeof(buf_t *));
+    s->table_mask = buckets - 1;
+    s->lru.next = s->lru.prev = &s->lru;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->loaded, NULL);
+  }
+}
+
+// Devices -------------------------------------------------------------------
+
+blockdev_t *blockdev_open(const char *path, const blockdev_options_t *opts) {
+  int bs = opts->block_size;
+  if (bs < 512 || (bs & (bs - 1)) != 0 || opts->kind < BLOCKDEV_MMAP ||
+      opts->kind > BLOCKDEV_URING) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  int flags = opts->readonly ? O_RDONLY : O_RDWR;
+  if (opts->direct && opts->kind != BLOCKDEV_MMAP) {
+    flags |= O_DIRECT;
+  }
+  int fd = open(path, flags);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  blockdev_t *dev = calloc(1, sizeof(blockdev_t));
+  dev->kind = opts->kind;
+  dev->fd = fd;
+  dev->block_size = bs;
+  dev->readonly = opts->readonly;
+  dev->count = st.st_size / bs;
+
+  if (dev->kind == BLOCKDEV_MMAP) {
+    dev->length = (size_t) dev->count * bs;
+    int prot = PROT_READ | (dev->readonly ? 0 : PROT_WRITE);
+    dev->base = dev->length ? mmap(NULL, dev->length, prot, MAP_SHARED, fd, 0)
+                            : NULL;
+    if (dev->base == MAP_FAILED) {
+      int err = errno;
+      close(fd);
+      free(dev);
+      errno = err;
+      return NULL;
+    }
+    return dev;
+  }
+
+  if (dev->kind == BLOCKDEV_URING) {
+    int depth = opts->queue_depth > 0 ? opts->queue_depth : DEFAULT_QUEUE_DEPTH;
+    dev->ring = ring_new(depth);
+    if (!dev->ring) {
+      int err = errno;
+      close(fd);
+      free(dev);
+      errno = err;
+      return NULL;
+    }
+  }
+  cache_init(dev, opts);
+  return dev;
+}
+
+int blockdev_close(blockdev_t *dev) {
+  int rv = dev->readonly ? 0 : blockdev_sync(dev);
+
+  if (dev->kind == BLOCKDEV_MMAP) {
+    if (dev->base) {
+      munmap(dev->base, dev->length);
+    }
+  }
+  else {
+    cache_free(dev);
+  }
+  if (dev->ring) {
+    ring_free(dev->ring);
+  }
+  close(dev->fd);
+  free(dev);
+  return rv;
+}
+
+uint32_t blockdev_count(blockdev_t *dev) {
+  return dev->count;
+}
+
+void *blockdev_get(blockdev_t *dev, uint32_t bnum) {
+  if (bnum >= dev->count) {
+    errno = ERANGE;
+    return NULL;
+  }
+
+  if (dev->kind == BLOCKDEV_MMAP) {
+    return dev->base + (size_t) bnum * dev->block_size;
+  }
+  return cache_get(dev, bnum);
+}
+
+void blockdev_dirty(blockdev_t *dev, uint32_t bnum) {
+  // Shared mappings write themselves back
+  if (dev->kind != BLOCKDEV_MMAP && bnum < dev->count) {
+    cache_dirty(dev, bnum);
+  }
+}
+
+void blockdev_put(blockdev_t *dev, uint32_t bnum) {
+  if (dev->kind != BLOCKDEV_MMAP && bnum < dev->count) {
+    cache_put(dev, bnum);
+  }
+}
+
+int blockdev_prefetch(blockdev_t *dev, const uint32_t *bnums, int count) {
+  if (dev->kind == BLOCKDEV_URING) {
+    return cache_prefetch(dev, bnums, count);
+  }
+
+  // Otherwise let the kernel read ahead, a run of adjacent blocks at a time
+  int started = 0;
+  for (int i = 0; i < count;) {
+    int n = 1;
+    while (i + n < count && bnums[i + n] == bnums[i] + n) {
+      n++;
+    }
+    if (bnums[i] < dev->count) {
+      uint32_t end = bnums[i] + n < dev->count ? bnums[i] + n : dev->count;
+      off_t pos = (off_t) bnums[i] * dev->block_size;
+      size_t len = (size_t) (end - bnums[i]) * dev->block_size;
+      if (dev->kind == BLOCKDEV_MMAP) {
+        madvise(dev->base + pos, len, MADV_WILLNEED);
+      }
+      else {
+        posix_fadvise(dev->fd, pos, len, POSIX_FADV_WILLNEED);
+      }
+      started += end - bnums[i];
+    }
+    i += n;
+  }
+  return started;
+}
+
+int blockdev_sync(blockdev_t *dev) {
+  if (dev->readonly) {
+    return 0;
+  }
+
+  int rv = 0;
+  if (dev->kind == BLOCKDEV_MMAP) {
+    if (dev->base && msync(dev->base, dev->length, MS_SYNC) != 0) {
+      rv = -errno;
+    }
+  }
+  else {
+    rv = cache_flush(dev);
+  }
+
+  if (fsync(dev->fd) != 0 && rv == 0) {
+    rv = -errno;
+  }
+  return rv;
+}
+
+void blockdev_get_stats(blockdev_t *dev, blockdev_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  for (int i = 0; dev->kind != BLOCKDEV_MMAP && i < dev->nshards; i++) {
+    shard_t *s = &dev->shards[i];
+    pthread_mutex_lock(&s->lock);
+    stats->hits += s->stats.hits;
+    stats->misses += s->stats.misses;
+    stats->reads += s->stats.reads;
+    stats->writes += s->stats.writes;
+    stats->evictions += s->stats.evictions;
+    pthread_mutex_unlock(&s->lock);
+  }
+}
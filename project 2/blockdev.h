@@ -0,0 +1,99 @@
+// Block devices: reading and writing an image a block at a time, through
+// one of several backends.
+//
+// blocks.c maps the whole image and hands out plain pointers, which the
+// mounted filesystem relies on: code keeps block pointers across calls, and
+// the journal remaps blocks privately to keep uncommitted metadata out of
+// the file. Code that walks an image on its own, like the offline tools,
+// goes through a blockdev instead, and gets to pick how blocks are cached:
+//
+//  - BLOCKDEV_MMAP maps the image, like blocks.c. Fastest while the image
+//    fits the address space comfortably; the kernel does the caching.
+//  - BLOCKDEV_CACHE reads and writes blocks with pread and pwrite into a
+//    buffer cache of our own, of a fixed size, split into shards that each
+//    have their own lock and LRU list. Images can be larger than memory and
+//    can be opened with O_DIRECT.
+//  - BLOCKDEV_URING is the same cache, doing its I/O through io_uring. A
+//    single miss costs about what pread does, but blockdev_prefetch and
+//    blockdev_sync submit a whole batch of reads or writes at once.
+//
+// A block is pinned by blockdev_get and stays at the same address until the
+// matching blockdev_put. Changes have to be reported with blockdev_dirty
+// before the put; the cache writes dirty blocks back when it evicts them
+// and at blockdev_sync. All functions are safe to call from several threads
+// at once, but a block's contents are only as safe as its users make them.
+
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum blockdev_kind {
+  BLOCKDEV_MMAP,
+  BLOCKDEV_CACHE,
+  BLOCKDEV_URING,
+} blockdev_kind_t;
+
+typedef struct blockdev_options {
+  blockdev_kind_t kind;
+  int block_size;
+  int readonly;
+  int direct;          // open with O_DIRECT (cache and io_uring only)
+  size_t cache_blocks; // buffers in the cache, 0 for a default
+  int shards;          // cache shards, 0 for a default
+  int queue_depth;     // io_uring submission queue entries, 0 for a default
+} blockdev_options_t;
+
+typedef struct blockdev blockdev_t;
+
+// Fill in the defaults: the mmap backend and 4K blocks.
+void blockdev_default_options(blockdev_options_t *opts);
+
+// Parse a backend name ("mmap", "cache" or "uring"). Returns -1 if it is
+// none of those.
+int blockdev_parse_kind(const char *name);
+
+// Name of a backend, the other way round.
+const char *blockdev_kind_name(blockdev_kind_t kind);
+
+// Open an image file. Returns NULL with errno set on failure, e.g. ENOSYS
+// if io_uring isn't available.
+blockdev_t *blockdev_open(const char *path, const blockdev_options_t *opts);
+
+// Write back everything dirty and close the image.
+int blockdev_close(blockdev_t *dev);
+
+// Number of whole blocks in the image.
+uint32_t blockdev_count(blockdev_t *dev);
+
+// Pin block bnum and return its contents. Returns NULL with errno set if it
+// is out of range or can't be read.
+void *blockdev_get(blockdev_t *dev, uint32_t bnum);
+
+// Note that a pinned block has been changed.
+void blockdev_dirty(blockdev_t *dev, uint32_t bnum);
+
+// Unpin a block.
+void blockdev_put(blockdev_t *dev, uint32_t bnum);
+
+// Start reading blocks that will be wanted soon, so later gets find them
+// cached. Only a hint; returns how many reads were started.
+int blockdev_prefetch(blockdev_t *dev, const uint32_t *bnums, int count);
+
+// Write back every dirty block and wait for the file to be durable.
+// Returns 0 or a negative errno.
+int blockdev_sync(blockdev_t *dev);
+
+// Cache statistics, all zero for the mmap backend.
+typedef struct blockdev_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t reads;      // blocks read from the file
+  uint64_t writes;     // blocks written to it
+  uint64_t evictions;
+} blockdev_stats_t;
+
+void blockdev_get_stats(blockdev_t *dev, blockdev_stats_t *stats);
+
+#endif
@@ -10,8 +10,10 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -19,16 +21,45 @@
 
 #include "bitmap.h"
 #include "blocks.h"
+#include "dedup.h"
+#include "flush.h"
+#include "inode.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
 
-const int BLOCK_COUNT = 256; // we split the "disk" into 256 blocks
-const int BLOCK_SIZE = 4096; // = 4K
-const int NUFS_SIZE = BLOCK_SIZE * BLOCK_COUNT; // = 1MB
+int BLOCK_COUNT = 0;
+int BLOCK_SIZE = 0;
+long NUFS_SIZE = 0;
 
-const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8;
-// Note: assumes block count is divisible by 8
+int BLOCK_BITMAP_SIZE = 0;
 
 static int blocks_fd = -1;
 static void *blocks_base = 0;
+static size_t blocks_reserved = 0; // bytes of address space set aside
+static int block_cursor = 0;       // where the next allocation search starts
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static int data_advice = MADV_NORMAL; // for the shared part of the mapping
+
+// blocks left free after a new run so its file can grow in place
+#define ALLOC_WINDOW 16
+
+typedef struct block_run {
+  int bnum;
+  int count;
+} block_run_t;
+
+struct blocks_pin {
+  struct blocks_pin *next;
+  int runs;
+  block_run_t run[];
+};
+
+// Pinned runs, and runs freed while pinned, under alloc_lock
+static blocks_pin_t *pins = NULL;
+static block_run_t *parked = NULL;
+static int parked_count = 0;
+static int parked_cap = 0;
 
 // Get the number of blocks needed to store the given number of bytes.
 int bytes_to_blocks(int bytes) {
@@ -41,64 +72,535 @@ int bytes_to_blocks(int bytes) {
   }
 }
 
+// Number of blocks of the given size needed to hold the given byte count.
+static uint32_t region_blocks(uint64_t bytes, uint32_t block_size) {
+  return (bytes + block_size - 1) / block_size;
+}
+
+// Fill in the geometry used for images created without an explicit one.
+void blocks_default_geometry(nufs_geometry_t *geo) {
+  geo->block_size = NUFS_DEFAULT_BLOCK_SIZE;
+  geo->block_count = NUFS_DEFAULT_BLOCK_COUNT;
+  geo->max_blocks = NUFS_DEFAULT_MAX_BLOCKS;
+  geo->inode_count = NUFS_DEFAULT_INODE_COUNT;
+  geo->journal_blocks = NUFS_DEFAULT_JOURNAL_BLOCKS;
+  geo->reserved_blocks = 0;
+}
+
+// Lay out the regions of an image with the given geometry.
+int blocks_layout(const nufs_geometry_t *geo, superblock_t *sb) {
+  uint32_t bs = geo->block_size;
+  if (bs < 512 || (bs & (bs - 1)) != 0 || geo->max_blocks % 8 != 0 ||
+      geo->inode_count % 8 != 0 || geo->block_count < 0 ||
+      geo->reserved_blocks < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(sb, 0, sizeof(*sb));
+  sb->magic = NUFS_MAGIC;
+  sb->version = NUFS_VERSION;
+  sb->block_size = bs;
+  sb->max_blocks = geo->max_blocks;
+  sb->inode_count = geo->inode_count;
+
+  // Lay the regions out back to back after the superblock
+  sb->block_bitmap_start = 1;
+  sb->block_bitmap_blocks = region_blocks(sb->max_blocks / 8, bs);
+  sb->inode_bitmap_start = sb->block_bitmap_start + sb->block_bitmap_blocks;
+  sb->inode_bitmap_blocks = region_blocks(sb->inode_count / 8, bs);
+  sb->inode_table_start = sb->inode_bitmap_start + sb->inode_bitmap_blocks;
+  sb->inode_table_blocks =
+      region_blocks((uint64_t) sb->inode_count * sizeof(inode_t), bs);
+  sb->journal_start = sb->inode_table_start + sb->inode_table_blocks;
+  if (bs % sysconf(_SC_PAGESIZE) == 0) {
+    sb->journal_blocks = geo->journal_blocks;
+  }
+  sb->data_start = sb->journal_start + sb->journal_blocks;
+  sb->block_count = sb->data_start + geo->block_count;
+  sb->free_blocks = geo->block_count;
+  sb->free_inodes = sb->inode_count;
+  sb->reserved_blocks = geo->reserved_blocks;
+
+  if ((uint64_t) sb->data_start + geo->block_count > sb->max_blocks ||
+      sb->reserved_blocks >= sb->max_blocks - sb->data_start) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+// Write a superblock and empty bitmaps for the given geometry.
+int blocks_format(int fd, const nufs_geometry_t *geo) {
+  superblock_t sb;
+  if (blocks_layout(geo, &sb) != 0) {
+    return -1;
+  }
+  uint32_t bs = sb.block_size;
+
+  // Everything starts out zeroed, so only the superblock and the bits for
+  // the metadata regions have to be written.
+  if (ftruncate(fd, 0) != 0 ||
+      ftruncate(fd, (off_t) sb.block_count * bs) != 0) {
+    return -1;
+  }
+
+  if (pwrite(fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+    return -1;
+  }
+
+  size_t used_bytes = (sb.data_start + 7) / 8;
+  uint8_t *used = calloc(used_bytes, 1);
+  for (uint32_t ii = 0; ii < sb.data_start; ++ii) {
+    bitmap_put(used, ii, 1);
+  }
+  ssize_t rv = pwrite(fd, used, used_bytes, (off_t) sb.block_bitmap_start * bs);
+  free(used);
+
+  return rv == (ssize_t) used_bytes ? 0 : -1;
+}
+
+// Map blocks [from, to) of the image file into the reserved address range,
+// with MAP_SHARED or MAP_PRIVATE.
+static void map_range(int from, int to, int share) {
+  void *addr = (uint8_t *) blocks_base + (size_t) from * BLOCK_SIZE;
+  void *rv = mmap(addr, (size_t) (to - from) * BLOCK_SIZE,
+                  PROT_READ | PROT_WRITE, share | MAP_FIXED, blocks_fd,
+                  (off_t) from * BLOCK_SIZE);
+  assert(rv == addr);
+
+  // A new mapping starts out with the default advice
+  int advice = __atomic_load_n(&data_advice, __ATOMIC_RELAXED);
+  if (share == MAP_SHARED && advice != MADV_NORMAL) {
+    madvise(addr, (size_t) (to - from) * BLOCK_SIZE, advice);
+  }
+}
+
 // Load and initialize the given disk image.
 void blocks_init(const char *image_path) {
   blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
   assert(blocks_fd != -1);
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
+  // a new (empty) image gets the default geometry
+  struct stat st;
+  int rv = fstat(blocks_fd, &st);
   assert(rv == 0);
+  if (st.st_size == 0) {
+    nufs_geometry_t geo;
+    blocks_default_geometry(&geo);
+    rv = blocks_format(blocks_fd, &geo);
+    assert(rv == 0);
+  }
 
-  // map the image to memory
-  blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
+  superblock_t sb;
+  rv = pread(blocks_fd, &sb, sizeof(sb), 0);
+  assert(rv == sizeof(sb));
+  if (sb.magic != NUFS_MAGIC || sb.version != NUFS_VERSION) {
+    fprintf(stderr, "%s: not a nufs image\n", image_path);
+    abort();
+  }
+
+  // Finish the last commit if a crash interrupted it; that may change the
+  // superblock too
+  rv = journal_replay(blocks_fd, &sb);
+  assert(rv >= 0);
+  if (rv > 0) {
+    rv = pread(blocks_fd, &sb, sizeof(sb), 0);
+    assert(rv == sizeof(sb));
+    rv = fstat(blocks_fd, &st);
+    assert(rv == 0);
+  }
+
+  BLOCK_SIZE = sb.block_size;
+  BLOCK_COUNT = sb.block_count;
+  NUFS_SIZE = (long) BLOCK_COUNT * BLOCK_SIZE;
+  BLOCK_BITMAP_SIZE = sb.max_blocks / 8;
+
+  // make sure the image file backs every block the superblock describes
+  if (st.st_size < NUFS_SIZE) {
+    rv = ftruncate(blocks_fd, NUFS_SIZE);
+    assert(rv == 0);
+  }
+
+  // Reserve address space for the largest image this file may grow into,
+  // so that growing never moves the mapping and block pointers stay valid.
+  blocks_reserved = (size_t) sb.max_blocks * BLOCK_SIZE;
+  blocks_base = mmap(0, blocks_reserved, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
   assert(blocks_base != MAP_FAILED);
 
-  // block 0 stores the block bitmap and the inode bitmap
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, 0, 1);
+  // map the image to memory. With a journal, metadata changes must only
+  // reach the file through it, so the metadata region is mapped privately.
+  if (sb.journal_blocks > 0) {
+    map_range(0, sb.data_start, MAP_PRIVATE);
+    map_range(sb.data_start, BLOCK_COUNT, MAP_SHARED);
+  } else {
+    map_range(0, BLOCK_COUNT, MAP_SHARED);
+  }
+
+  // Recount free blocks and inodes rather than trusting the stored counts,
+  // which may be stale after a crash
+  superblock_t *msb = blocks_get_superblock();
+  msb->free_blocks = BLOCK_COUNT - bitmap_count(get_blocks_bitmap(), BLOCK_COUNT);
+  msb->free_inodes =
+      msb->inode_count - bitmap_count(get_inode_bitmap(), msb->inode_count);
+  block_cursor = msb->data_start;
+  data_advice = MADV_NORMAL;
+
+  flush_init(msb->max_blocks);
+  journal_init(blocks_fd);
 }
 
 // Close the disk image.
 void blocks_free() {
-  int rv = munmap(blocks_base, NUFS_SIZE);
+  // File data first, so the last commit doesn't point at blocks that never
+  // got written
+  flush_free();
+  int rv = msync(blocks_base, (size_t) BLOCK_COUNT * BLOCK_SIZE, MS_SYNC);
+  assert(rv == 0);
+  // FUSE has stopped reading by now, so pins still held don't matter
+  pthread_mutex_lock(&alloc_lock);
+  while (pins != NULL) {
+    blocks_pin_t *next = pins->next;
+    free(pins);
+    pins = next;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  blocks_unpin(NULL);
+
+  journal_stop();
+  free(parked);
+  parked = NULL;
+  parked_count = parked_cap = 0;
+  rv = munmap(blocks_base, blocks_reserved);
   assert(rv == 0);
+  close(blocks_fd);
+  blocks_fd = -1;
+  blocks_base = 0;
 }
 
+// Return the superblock of the loaded image.
+superblock_t *blocks_get_superblock() { return blocks_base; }
+
+// Grow the image to hold at least min_blocks blocks.
+int blocks_grow(int min_blocks) {
+  superblock_t *sb = blocks_get_superblock();
+  if (min_blocks <= BLOCK_COUNT) {
+    return 0;
+  }
+  if ((uint32_t) min_blocks > sb->max_blocks) {
+    return -1;
+  }
+
+  // grow geometrically so repeated allocations don't each pay for a remap
+  long count = (long) BLOCK_COUNT * 2;
+  if (count < min_blocks) {
+    count = min_blocks;
+  }
+  if (count > sb->max_blocks) {
+    count = sb->max_blocks;
+  }
+
+  if (ftruncate(blocks_fd, count * BLOCK_SIZE) != 0) {
+    return -1;
+  }
+  map_range(BLOCK_COUNT, count, MAP_SHARED);
+
+  journal_dirty(sb, sizeof(superblock_t));
+  sb->free_blocks += count - BLOCK_COUNT;
+  // the flusher reads this without taking alloc_lock
+  __atomic_store_n(&BLOCK_COUNT, count, __ATOMIC_RELAXED);
+  NUFS_SIZE = count * BLOCK_SIZE;
+  sb->block_count = count;
+  stats_count(STATS_IMAGE_GROWS, 1);
+
+  return 0;
+}
+
+// Map blocks privately or shared again.
+void blocks_set_private(int bnum, int count, int private) {
+  map_range(bnum, bnum + count, private ? MAP_PRIVATE : MAP_SHARED);
+}
+
+// Give the kernel advice about how blocks will be used.
+void blocks_advise(int bnum, int count, int advice) {
+  // madvise wants whole pages, which may hold several blocks
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t) blocks_get_block(bnum) & ~(page - 1);
+  uintptr_t end = (uintptr_t) blocks_get_block(bnum + count);
+  madvise((void *) start, end - start, advice);
+}
+
+// Set the advice for all of the data region.
+void blocks_set_data_advice(int advice) {
+  pthread_mutex_lock(&alloc_lock);
+  if (data_advice != advice) {
+    __atomic_store_n(&data_advice, advice, __ATOMIC_RELAXED);
+    int start = blocks_get_superblock()->data_start;
+    blocks_advise(start, BLOCK_COUNT - start, advice);
+  }
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+// Make the metadata changed so far durable.
+int blocks_sync_metadata() {
+  superblock_t *sb = blocks_get_superblock();
+  if (sb->journal_blocks > 0) {
+    journal_commit();
+    return 0;
+  }
+
+  return flush_blocks(0, sb->data_start);
+}
+
+// Return the image file's descriptor.
+int blocks_image_fd() { return blocks_fd; }
+
 // Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+void *blocks_get_block(int bnum) {
+  return (uint8_t *) blocks_base + (size_t) BLOCK_SIZE * bnum;
+}
 
 // Return a pointer to the beginning of the block bitmap.
 // The size is BLOCK_BITMAP_SIZE bytes.
-void *get_blocks_bitmap() { return blocks_get_block(0); }
+void *get_blocks_bitmap() {
+  return blocks_get_block(blocks_get_superblock()->block_bitmap_start);
+}
 
 // Return a pointer to the beginning of the inode table bitmap.
 void *get_inode_bitmap() {
-  uint8_t *block = blocks_get_block(0);
+  return blocks_get_block(blocks_get_superblock()->inode_bitmap_start);
+}
+
+// Return a pointer to the beginning of the inode table.
+void *get_inode_table() {
+  return blocks_get_block(blocks_get_superblock()->inode_table_start);
+}
 
-  // The inode bitmap is stored immediately after the block bitmap
-  return (void *) (block + BLOCK_BITMAP_SIZE);
+// Find count free blocks in a row, searching from the cursor to the end of the
+// image and then from the start of the data region
+static int find_free_run(void *bbm, int cursor, int count) {
+  int first = bitmap_find_zero_run(bbm, cursor, BLOCK_COUNT, count);
+  if (first < 0) {
+    // also catches runs that straddle the cursor
+    int end = cursor + count - 1;
+    first = bitmap_find_zero_run(bbm, blocks_get_superblock()->data_start,
+                                 end < BLOCK_COUNT ? end : BLOCK_COUNT, count);
+  }
+  return first;
 }
 
 // Allocate a new block and return its index.
 int alloc_block() {
+  int got;
+  return alloc_blocks(1, 0, &got);
+}
+
+// Allocate up to count contiguous blocks, preferring to start at goal, as
+// long as that leaves at least keep blocks for later.
+static int alloc_run(int count, int goal, int *got, uint32_t keep) {
+  superblock_t *sb = blocks_get_superblock();
   void *bbm = get_blocks_bitmap();
+  int first = -1;
+  int end;
+  int reserve = 0; // blocks after first kept out of the cursor's way
 
-  for (int ii = 1; ii < BLOCK_COUNT; ++ii) {
-    if (!bitmap_get(bbm, ii)) {
-      bitmap_put(bbm, ii, 1);
-      printf("+ alloc_block() -> %d\n", ii);
-      return ii;
+  pthread_mutex_lock(&alloc_lock);
+  // Counting the blocks the image can still grow by
+  long left = (long) sb->free_blocks + sb->max_blocks - BLOCK_COUNT - keep;
+  if (left <= 0) {
+    pthread_mutex_unlock(&alloc_lock);
+    stats_count(STATS_ALLOC_FAILURES, 1);
+    TRACE(TRACE_ALLOC, ALLOC_BLOCKS, -1, count, -ENOSPC);
+    return -1;
+  }
+  if (count > left) {
+    count = left;
+  }
+
+  if (sb->free_blocks > 0) {
+    // Extend right where the caller left off if that block is free
+    if (goal >= (int) sb->data_start && goal < BLOCK_COUNT &&
+        !bitmap_get(bbm, goal)) {
+      first = goal;
+    }
+
+    // Otherwise start a new run at the next-fit cursor. File data gets
+    // some room after it so the file can keep growing in place while other
+    // files allocate too.
+    if (first < 0 && goal != 0 && count < ALLOC_WINDOW) {
+      first = find_free_run(bbm, block_cursor, ALLOC_WINDOW);
+      if (first >= 0) {
+        reserve = ALLOC_WINDOW;
+      }
+    }
+    if (first < 0) {
+      first = find_free_run(bbm, block_cursor, count);
+    }
+
+    // Settle for the next free block, however short its run
+    if (first < 0) {
+      first = find_free_run(bbm, block_cursor, 1);
     }
   }
 
-  return -1;
+  if (first >= 0) {
+    // take the free blocks from first up to count
+    end = first + count < BLOCK_COUNT ? first + count : BLOCK_COUNT;
+    int used = bitmap_find_one(bbm, first, end);
+    if (used >= 0) {
+      end = used;
+    }
+  } else {
+    // every block is in use, so extend the image and take the new tail
+    first = BLOCK_COUNT;
+    if (blocks_grow(first + 1) != 0) {
+      pthread_mutex_unlock(&alloc_lock);
+      stats_count(STATS_ALLOC_FAILURES, 1);
+      TRACE(TRACE_ALLOC, ALLOC_BLOCKS, -1, count, -ENOSPC);
+      return -1;
+    }
+    end = first + count < BLOCK_COUNT ? first + count : BLOCK_COUNT;
+  }
+
+  journal_dirty(sb, sizeof(superblock_t));
+  journal_dirty((uint8_t *) bbm + first / 8, (end - 1) / 8 - first / 8 + 1);
+  bitmap_put_range(bbm, first, end - first, 1);
+  sb->free_blocks -= end - first;
+  block_cursor = end > first + reserve ? end : first + reserve;
+  *got = end - first;
+  pthread_mutex_unlock(&alloc_lock);
+  stats_count(STATS_BLOCK_ALLOCS, 1);
+  stats_count(STATS_BLOCKS_ALLOCATED, *got);
+  TRACE(TRACE_ALLOC, ALLOC_BLOCKS, -1, *got, first);
+
+  return first;
+}
+
+// Allocate up to count contiguous blocks, preferring to start at goal.
+int alloc_blocks(int count, int goal, int *got) {
+  return alloc_run(count, goal, got, 0);
+}
+
+// Allocate blocks for file data, leaving the reserved blocks alone.
+int alloc_data_blocks(int count, int goal, int *got) {
+  return alloc_run(count, goal, got, blocks_get_superblock()->reserved_blocks);
 }
 
 // Deallocate the block with the given index.
 void free_block(int bnum) {
-  printf("+ free_block(%d)\n", bnum);
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, bnum, 0);
+  free_blocks(bnum, 1);
+}
+
+// Deallocate count blocks starting at the given index, once the journal
+// lets us. Blocks shared by deduplication only lose a reference.
+void free_blocks(int bnum, int count) {
+  while (count > 0) {
+    int n = dedup_release(bnum, count);
+    if (n > 0 && !journal_defer_free(bnum, n)) {
+      blocks_release(bnum, n);
+    }
+    n = n > 0 ? n : 1;
+    bnum += n;
+    count -= n;
+  }
+}
+
+// Whether any of count blocks starting at bnum is pinned. Called with
+// alloc_lock held.
+static int is_pinned(int bnum, int count) {
+  for (blocks_pin_t *pin = pins; pin != NULL; pin = pin->next) {
+    for (int i = 0; i < pin->runs; i++) {
+      if (bnum < pin->run[i].bnum + pin->run[i].count &&
+          pin->run[i].bnum < bnum + count) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Deallocate count blocks starting at the given index right away, or once
+// they are unpinned.
+void blocks_release(int bnum, int count) {
+  superblock_t *sb = blocks_get_superblock();
+  uint8_t *bbm = get_blocks_bitmap();
+  pthread_mutex_lock(&alloc_lock);
+  if (is_pinned(bnum, count)) {
+    if (parked_count == parked_cap) {
+      parked_cap = parked_cap ? parked_cap * 2 : 16;
+      parked = realloc(parked, parked_cap * sizeof(block_run_t));
+      assert(parked != NULL);
+    }
+    parked[parked_count].bnum = bnum;
+    parked[parked_count].count = count;
+    parked_count++;
+    pthread_mutex_unlock(&alloc_lock);
+    return;
+  }
+  journal_dirty(sb, sizeof(superblock_t));
+  journal_dirty(bbm + bnum / 8, (bnum + count - 1) / 8 - bnum / 8 + 1);
+  sb->free_blocks += bitmap_put_range(bbm, bnum, count, 0);
+  pthread_mutex_unlock(&alloc_lock);
+  stats_count(STATS_BLOCK_FREES, 1);
+  stats_count(STATS_BLOCKS_FREED, count);
+  TRACE(TRACE_ALLOC, FREE_BLOCKS, -1, count, bnum);
+}
+
+// Pin runs of blocks, so freeing them is put off until they're unpinned.
+blocks_pin_t *blocks_pin(const int *bnum, const int *count, int runs) {
+  if (runs <= 0) {
+    return NULL;
+  }
+  blocks_pin_t *pin = malloc(sizeof(blocks_pin_t) + runs * sizeof(block_run_t));
+  assert(pin != NULL);
+  pin->runs = runs;
+  for (int i = 0; i < runs; i++) {
+    pin->run[i].bnum = bnum[i];
+    pin->run[i].count = count[i];
+  }
+
+  pthread_mutex_lock(&alloc_lock);
+  pin->next = pins;
+  pins = pin;
+  pthread_mutex_unlock(&alloc_lock);
+  return pin;
+}
+
+// Drop a pin and free the runs freed under it that nothing else pins.
+void blocks_unpin(blocks_pin_t *pin) {
+  pthread_mutex_lock(&alloc_lock);
+  for (blocks_pin_t **p = &pins; pin != NULL && *p != NULL; p = &(*p)->next) {
+    if (*p == pin) {
+      *p = pin->next;
+      break;
+    }
+  }
+  free(pin);
+
+  // Take out the parked runs nothing pins any more
+  int count = 0;
+  block_run_t *runs = NULL;
+  for (int i = 0; i < parked_count;) {
+    if (is_pinned(parked[i].bnum, parked[i].count)) {
+      i++;
+      continue;
+    }
+    if (runs == NULL) {
+      runs = malloc(parked_count * sizeof(block_run_t));
+      assert(runs != NULL);
+    }
+    runs[count++] = parked[i];
+    parked[i] = parked[--parked_count];
+  }
+  pthread_mutex_unlock(&alloc_lock);
+
+  if (count > 0) {
+    journal_begin();
+    for (int i = 0; i < count; i++) {
+      blocks_release(runs[i].bnum, runs[i].count);
+    }
+    journal_end();
+  }
+  free(runs);
 }
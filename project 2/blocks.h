@@ -5,19 +5,67 @@
  * A block-based abstraction over a disk image file.
  *
  * The disk image is mmapped, so block data is accessed using pointers.
+ *
+ * Block 0 of every image holds a superblock describing the geometry of the
+ * rest of the image: the block bitmap, the inode bitmap, the inode table and
+ * the metadata journal each live in their own region, followed by the data
+ * blocks.
  */
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stdint.h>
 #include <stdio.h>
 
-extern const int BLOCK_COUNT; // we split the "disk" into blocks (default = 256)
-extern const int BLOCK_SIZE;  // default = 4K
-extern const int NUFS_SIZE;   // default = 1MB
+#define NUFS_MAGIC 0x5346554e // "NUFS" in little-endian
+#define NUFS_VERSION 1
+
+// Geometry used when a fresh image is created by blocks_init
+#define NUFS_DEFAULT_BLOCK_SIZE 4096
+#define NUFS_DEFAULT_BLOCK_COUNT 256          // data blocks in a new image
+#define NUFS_DEFAULT_MAX_BLOCKS (1 << 24)     // 64GB with 4K blocks
+#define NUFS_DEFAULT_INODE_COUNT 16384
+#define NUFS_DEFAULT_JOURNAL_BLOCKS 1024      // 4MB with 4K blocks
+
+typedef struct superblock {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t block_size;          // bytes per block
+  uint32_t block_count;         // blocks currently backed by the image file
+  uint32_t max_blocks;          // blocks the image may grow to
+  uint32_t inode_count;         // entries in the inode table
+  uint32_t block_bitmap_start;  // region offsets and lengths, in blocks
+  uint32_t block_bitmap_blocks;
+  uint32_t inode_bitmap_start;
+  uint32_t inode_bitmap_blocks;
+  uint32_t inode_table_start;
+  uint32_t inode_table_blocks;
+  uint32_t data_start;          // first block available for file data
+  uint32_t free_blocks;         // unallocated blocks below block_count
+  uint32_t free_inodes;         // unallocated inodes
+  uint32_t journal_start;       // see journal.h; 0 blocks if there is none
+  uint32_t journal_blocks;
+  uint32_t reserved_blocks;     // kept back from file data for metadata
+  uint32_t orphans;             // open inodes with no names left, see inode.h
+} superblock_t;
 
-extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
+typedef struct nufs_geometry {
+  int block_size;
+  int block_count; // initial size of the image, in blocks
+  int max_blocks;
+  int inode_count;
+  int journal_blocks; // 0 for no journal
+  int reserved_blocks;
+} nufs_geometry_t;
 
-/** 
+// The following are loaded from the superblock by blocks_init.
+extern int BLOCK_COUNT; // blocks currently in the image
+extern int BLOCK_SIZE;  // default = 4K
+extern long NUFS_SIZE;  // BLOCK_COUNT * BLOCK_SIZE
+
+extern int BLOCK_BITMAP_SIZE; // bytes in the block bitmap (max_blocks / 8)
+
+/**
  * Compute the number of blocks needed to store the given number of bytes.
  *
  * @param bytes Size of data to store in bytes.
@@ -26,18 +74,119 @@ extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
  */
 int bytes_to_blocks(int bytes);
 
+/**
+ * Fill in the geometry used for images created without an explicit one.
+ *
+ * @param geo Geometry to fill in.
+ */
+void blocks_default_geometry(nufs_geometry_t *geo);
+
+/**
+ * Work out where the regions of an image with the given geometry go, without
+ * writing anything. Regions start on block boundaries, so the inode table is
+ * aligned at least as well as a block.
+ *
+ * @param geo The geometry.
+ * @param sb Filled in with the superblock such an image would have.
+ *
+ * @return 0 on success, -1 with errno set to EINVAL if the geometry is
+ *         impossible.
+ */
+int blocks_layout(const nufs_geometry_t *geo, superblock_t *sb);
+
+/**
+ * Write a superblock and empty bitmaps for the given geometry to an open
+ * image file. The file is extended with ftruncate, so it stays sparse.
+ *
+ * The journal is left out if blocks are smaller than a memory page, since
+ * metadata blocks then can't be mapped separately from data.
+ *
+ * @param fd Descriptor of the image file, open for reading and writing.
+ * @param geo Geometry of the new image.
+ *
+ * @return 0 on success, -1 on error (with errno set).
+ */
+int blocks_format(int fd, const nufs_geometry_t *geo);
+
 /**
  * Load and initialize the given disk image.
  *
+ * An empty or missing image is formatted with the default geometry first.
+ *
  * @param image_path Path to the disk image file.
  */
 void blocks_init(const char *image_path);
 
 /**
- * Close the disk image.
+ * Write everything back and close the disk image.
  */
 void blocks_free();
 
+/**
+ * Return the superblock of the currently loaded image.
+ *
+ * @return Pointer to the superblock (block 0).
+ */
+superblock_t *blocks_get_superblock();
+
+/**
+ * Grow the image so that it holds at least the given number of blocks.
+ *
+ * Block pointers handed out before the call stay valid.
+ *
+ * @param min_blocks The number of blocks the image must hold.
+ *
+ * @return 0 on success, -1 if the image cannot grow that far.
+ */
+int blocks_grow(int min_blocks);
+
+/**
+ * Map blocks privately, so changes to them stay in memory, or shared again,
+ * so changes go straight to the image file. Used by the journal.
+ *
+ * @param bnum The first block to remap.
+ * @param count The number of blocks to remap.
+ * @param private 1 to map the blocks privately, 0 to share them.
+ */
+void blocks_set_private(int bnum, int count, int private);
+
+/**
+ * Pass madvise advice for some blocks of the image mapping on to the kernel,
+ * e.g. MADV_WILLNEED to start reading them in. The range is widened to
+ * whole pages.
+ *
+ * @param bnum The first block.
+ * @param count The number of blocks.
+ * @param advice The madvise advice.
+ */
+void blocks_advise(int bnum, int count, int advice);
+
+/**
+ * Set the madvise advice for the whole data region, MADV_NORMAL or
+ * MADV_RANDOM. It also applies to blocks the image grows by later.
+ *
+ * @param advice The madvise advice.
+ */
+void blocks_set_data_advice(int advice);
+
+/**
+ * Make the metadata changed so far durable: commit the journal, or write
+ * back the metadata region on images without one.
+ *
+ * @return 0 on success, a negative errno on failure.
+ */
+int blocks_sync_metadata();
+
+/**
+ * Return the file descriptor of the image file, open for reading and
+ * writing. Block n starts at byte n * BLOCK_SIZE of it, and reads and writes
+ * through it see the same data as the block pointers (except for blocks the
+ * journal has mapped privately, which never hold file data).
+ *
+ * @return The descriptor, valid until blocks_free.
+ */
+int blocks_image_fd();
+
 /**
  * Get the block with the given index, returning a pointer to its start.
  *
@@ -61,15 +210,55 @@ void *get_blocks_bitmap();
  */
 void *get_inode_bitmap();
 
+/**
+ * Return a pointer to the beginning of the inode table.
+ *
+ * @return A pointer to the first inode.
+ */
+void *get_inode_table();
+
 /**
  * Allocate a new block and return its number.
  *
- * Grabs the first unused block and marks it as allocated.
+ * Grabs the next unused block after the previous allocation (wrapping around
+ * to the start of the data region) and marks it as allocated, growing the
+ * image if every block is in use.
  *
- * @return The index of the newly allocated block.
+ * @return The index of the newly allocated block, or -1 if the image is full.
  */
 int alloc_block();
 
+/**
+ * Allocate a run of contiguous blocks.
+ *
+ * Starts at goal if that block is free (pass the block after a file's last
+ * one to keep the file contiguous). Otherwise starts a new run at the next
+ * free stretch with some slack after it, so files growing at the same time
+ * don't interleave, falling back to the next free block. The run may be
+ * shorter than requested; call again for the rest.
+ *
+ * @param count The number of blocks wanted.
+ * @param goal The preferred first block, or 0 for no preference.
+ * @param got Set to the number of blocks allocated, between 1 and count.
+ *
+ * @return The first block of the run, or -1 if the image is full.
+ */
+int alloc_blocks(int count, int goal, int *got);
+
+/**
+ * Allocate a run of contiguous blocks for file data, like alloc_blocks, but
+ * fail rather than dip into the superblock's reserved blocks. Those are left
+ * for metadata (directories and extent tree nodes), so a full image can
+ * still be cleaned up.
+ *
+ * @param count The number of blocks wanted.
+ * @param goal The preferred first block, or 0 for no preference.
+ * @param got Set to the number of blocks allocated, between 1 and count.
+ *
+ * @return The first block of the run, or -1 if only reserved blocks are left.
+ */
+int alloc_data_blocks(int count, int goal, int *got);
+
 /**
  * Deallocate the block with the given number.
  *
@@ -77,4 +266,51 @@ int alloc_block();
  */
 void free_block(int bnum);
 
+/**
+ * Deallocate a run of consecutive blocks.
+ *
+ * With a journal, the blocks only become free once the transaction freeing
+ * them has committed, so they can't be reused while a crash could still
+ * bring back the metadata pointing at them.
+ *
+ * @param bnum The first block of the run.
+ * @param count The number of blocks in the run.
+ */
+void free_blocks(int bnum, int count);
+
+/**
+ * Mark a run of blocks free right away, for the journal to call once a
+ * transaction freeing them has committed.
+ *
+ * @param bnum The first block of the run.
+ * @param count The number of blocks in the run.
+ */
+void blocks_release(int bnum, int count);
+
+/**
+ * Blocks pinned by blocks_pin.
+ */
+typedef struct blocks_pin blocks_pin_t;
+
+/**
+ * Pin runs of blocks, so that they stay allocated, even if freed, until
+ * blocks_unpin. For data FUSE reads straight from the image file after the
+ * inode lock protecting it has been dropped.
+ *
+ * @param bnum The first block of each run.
+ * @param count The number of blocks in each run.
+ * @param runs The number of runs.
+ *
+ * @return The pin, or NULL if there are no runs.
+ */
+blocks_pin_t *blocks_pin(const int *bnum, const int *count, int runs);
+
+/**
+ * Drop a pin, freeing what was freed while it was held. Takes a journal
+ * handle, so it must not be called with any lock held.
+ *
+ * @param pin The pin from blocks_pin, or NULL.
+ */
+void blocks_unpin(blocks_pin_t *pin);
+
 #endif
@@ -0,0 +1,349 @@
+// Compressed file data. See chunk.h.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "flush.h"
+#include "journal.h"
+#include "lz.h"
+#include "stats.h"
+
+#define CHUNK_MAGIC 0x5a4c
+#define CHUNK_STORED 0 // the data follows the header as it is
+#define CHUNK_LZ 1     // the data follows the header compressed
+
+#define CACHE_SLOTS 256
+
+typedef struct chunk_header {
+  uint16_t magic;
+  uint16_t method; // CHUNK_STORED or CHUNK_LZ
+  uint32_t stored; // bytes following the header
+  uint32_t len;    // bytes of file data they hold
+  uint32_t unused;
+} chunk_header_t;
+
+#define CHUNK_ROOM (CHUNK_SPAN * BLOCK_SIZE - (int) sizeof(chunk_header_t))
+
+// The cache is direct mapped: each chunk can only be in the slot it hashes
+// to, so a lookup takes one lock and no search.
+typedef struct cache_slot {
+  pthread_mutex_t lock;
+  int inum; // -1 if empty
+  int chunk;
+  int len;
+  char *data; // CHUNK_SIZE bytes, allocated on first use
+} cache_slot_t;
+
+static cache_slot_t cache[CACHE_SLOTS];
+static int cache_ready = 0;
+static int enabled = 0;
+
+static int node_inum(inode_t *node) {
+  return node - get_inode(0);
+}
+
+static int min(int a, int b) {
+  return a < b ? a : b;
+}
+
+void chunk_init() {
+  const char *compress = getenv("NUFS_COMPRESS");
+  enabled = compress && atoi(compress) > 0;
+
+  for (int i = 0; i < CACHE_SLOTS; i++) {
+    if (!cache_ready) {
+      pthread_mutex_init(&cache[i].lock, NULL);
+    }
+    cache[i].inum = -1;
+  }
+  cache_ready = 1;
+}
+
+int chunk_enabled() {
+  return enabled;
+}
+
+static cache_slot_t *cache_slot(int inum, int n) {
+  return &cache[((unsigned) inum * 2654435761u + n) % CACHE_SLOTS];
+}
+
+// Copy count bytes from offset from of chunk n of inum, if cached, into buf.
+// Returns the length of the chunk, or -1 if it isn't cached.
+static int cache_get(int inum, int n, char *buf, int from, int count) {
+  cache_slot_t *slot = cache_slot(inum, n);
+  int len = -1;
+
+  pthread_mutex_lock(&slot->lock);
+  if (slot->inum == inum && slot->chunk == n) {
+    len = slot->len;
+    int have = len > from ? min(len - from, count) : 0;
+    memcpy(buf, slot->data + from, have);
+    memset(buf + have, 0, count - have);
+  }
+  pthread_mutex_unlock(&slot->lock);
+
+  stats_count(len < 0 ? STATS_CHUNK_MISSES : STATS_CHUNK_HITS, 1);
+  return len;
+}
+
+static void cache_put(int inum, int n, const char *data, int len) {
+  cache_slot_t *slot = cache_slot(inum, n);
+
+  pthread_mutex_lock(&slot->lock);
+  if (slot->data == NULL) {
+    slot->data = malloc(CHUNK_SIZE);
+  }
+  if (slot->data != NULL) {
+    memcpy(slot->data, data, len);
+    slot->inum = inum;
+    slot->chunk = n;
+    slot->len = len;
+  }
+  pthread_mutex_unlock(&slot->lock);
+}
+
+// Drop the cached chunks of inum from chunk n on
+static void cache_drop(int inum, int n) {
+  for (int i = 0; i < CACHE_SLOTS; i++) {
+    pthread_mutex_lock(&cache[i].lock);
+    if (cache[i].inum == inum && cache[i].chunk >= n) {
+      cache[i].inum = -1;
+    }
+    pthread_mutex_unlock(&cache[i].lock);
+  }
+}
+
+void chunk_forget(int inum) {
+  cache_drop(inum, 0);
+}
+
+// Copy len bytes from the blocks mapped from lblk on into dst. Returns 0, or
+// -EIO if they run into a hole.
+static int get_bytes(inode_t *node, int lblk, char *dst, int len) {
+  while (len > 0) {
+    int pnum;
+    int run = inode_map_blocks(node, lblk, &pnum);
+    if (pnum == 0) {
+      return -EIO;
+    }
+    int n = min(run * BLOCK_SIZE, len);
+    memcpy(dst, blocks_get_block(pnum), n);
+    dst += n;
+    len -= n;
+    lblk += run;
+  }
+
+  return 0;
+}
+
+// Copy len bytes of src into the blocks mapped from lblk on
+static void put_bytes(inode_t *node, int lblk, const char *src, int len) {
+  while (len > 0) {
+    int pnum;
+    int run = inode_map_blocks(node, lblk, &pnum);
+    int n = min(run * BLOCK_SIZE, len);
+    memcpy(blocks_get_block(pnum), src, n);
+    flush_mark(pnum, bytes_to_blocks(n));
+    src += n;
+    len -= n;
+    lblk += run;
+  }
+}
+
+// Decompress chunk n into data, zeroing the rest of its CHUNK_SIZE bytes,
+// and cache it. Returns its length (0 for a hole) or -EIO if it is corrupt.
+static int unpack(inode_t *node, int n, char *data) {
+  int len = -1;
+  int lblk = n * CHUNK_SPAN;
+  int pnum;
+  int run = inode_map_blocks(node, lblk, &pnum);
+  if (pnum == 0) {
+    memset(data, 0, CHUNK_SIZE);
+    return 0;
+  }
+
+  chunk_header_t *hdr = blocks_get_block(pnum);
+  if (hdr->magic != CHUNK_MAGIC || hdr->len > CHUNK_SIZE ||
+      hdr->stored > CHUNK_ROOM) {
+    return -EIO;
+  }
+
+  // Chunks are usually in consecutive blocks and can be read in place
+  char packed[CHUNK_SPAN * BLOCK_SIZE];
+  int total = sizeof(chunk_header_t) + hdr->stored;
+  const char *src = (const char *) (hdr + 1);
+  if (run * BLOCK_SIZE < total) {
+    if (get_bytes(node, lblk, packed, total) != 0) {
+      return -EIO;
+    }
+    src = packed + sizeof(chunk_header_t);
+  }
+
+  if (hdr->method == CHUNK_LZ) {
+    len = lz_decompress(src, hdr->stored, data, CHUNK_SIZE);
+  }
+  else if (hdr->method == CHUNK_STORED && hdr->stored == hdr->len) {
+    memcpy(data, src, hdr->stored);
+    len = hdr->stored;
+  }
+  if (len < 0 || len != (int) hdr->len) {
+    return -EIO;
+  }
+
+  memset(data + len, 0, CHUNK_SIZE - len);
+  cache_put(node_inum(node), n, data, len);
+  return len;
+}
+
+// Get chunk n into data from the cache, or else by unpacking it
+static int load(inode_t *node, int n, char *data) {
+  int len = cache_get(node_inum(node), n, data, 0, CHUNK_SIZE);
+
+  return len >= 0 ? len : unpack(node, n, data);
+}
+
+int chunk_store(inode_t *node, int n, const char *data, int len) {
+  char packed[CHUNK_SPAN * BLOCK_SIZE];
+  chunk_header_t *hdr = (chunk_header_t *) packed;
+
+  // Compressing only pays if it saves a block
+  int plainBlocks = bytes_to_blocks(sizeof(chunk_header_t) + len);
+  int room = (plainBlocks - 1) * BLOCK_SIZE - (int) sizeof(chunk_header_t);
+  int stored = room > 0 ? lz_compress(data, len, hdr + 1, room) : 0;
+  if (stored > 0) {
+    hdr->method = CHUNK_LZ;
+  }
+  else {
+    hdr->method = CHUNK_STORED;
+    memcpy(hdr + 1, data, len);
+    stored = len;
+  }
+  hdr->magic = CHUNK_MAGIC;
+  hdr->stored = stored;
+  hdr->len = len;
+  hdr->unused = 0;
+
+  int total = sizeof(chunk_header_t) + stored;
+  int count = bytes_to_blocks(total);
+  int lblk = n * CHUNK_SPAN;
+  int rv = inode_alloc_range(node, lblk, lblk + count);
+  if (rv < 0) {
+    return rv;
+  }
+  put_bytes(node, lblk, packed, total);
+
+  // Blocks the chunk needed before it shrank go back
+  if (count < CHUNK_SPAN &&
+      extent_punch(&node->extents, lblk + count, CHUNK_SPAN - count) != 0) {
+    return -ENOSPC;
+  }
+
+  stats_count(STATS_CHUNK_BYTES, len);
+  stats_count(STATS_CHUNK_STORED, total);
+  return count;
+}
+
+int chunk_read(inode_t *node, char *buf, int size, int offset) {
+  int inum = node_inum(node);
+  char data[CHUNK_SIZE];
+
+  for (int done = 0; done < size;) {
+    int pos = offset + done;
+    int n = pos / CHUNK_SIZE;
+    int from = pos % CHUNK_SIZE;
+    int count = min(size - done, CHUNK_SIZE - from);
+
+    if (cache_get(inum, n, buf + done, from, count) < 0) {
+      int rv = unpack(node, n, data);
+      if (rv < 0) {
+        return rv;
+      }
+      memcpy(buf + done, data + from, count);
+    }
+    done += count;
+  }
+
+  return size;
+}
+
+int chunk_write(inode_t *node, const char *buf, int size, off_t offset) {
+  if (offset < 0 || offset + size > INODE_MAX_SIZE) {
+    return -EFBIG;
+  }
+  int inum = node_inum(node);
+  char data[CHUNK_SIZE];
+
+  // Inline data becomes chunk 0
+  int rv = inode_promote(node);
+  if (rv < 0) {
+    return rv;
+  }
+
+  int newSize = node->size > offset + size ? node->size : offset + size;
+  for (int done = 0; done < size;) {
+    int pos = offset + done;
+    int n = pos / CHUNK_SIZE;
+    int start = n * CHUNK_SIZE;
+    int from = pos - start;
+    int count = min(size - done, CHUNK_SIZE - from);
+    int oldLen = node->size > start ? min(node->size - start, CHUNK_SIZE) : 0;
+    int len = min(newSize - start, CHUNK_SIZE);
+
+    // Only chunks partly left as they were have to be read back
+    if (from > 0 || from + count < oldLen) {
+      rv = load(node, n, data);
+      if (rv < 0) {
+        return rv;
+      }
+    }
+    memcpy(data + from, buf + done, count);
+
+    rv = chunk_store(node, n, data, len);
+    if (rv < 0) {
+      return rv;
+    }
+    cache_put(inum, n, data, len);
+    done += count;
+  }
+
+  if (node->size < newSize) {
+    journal_dirty(node, sizeof(inode_t));
+    node->size = newSize;
+  }
+
+  return size;
+}
+
+int chunk_truncate(inode_t *node, int size) {
+  int inum = node_inum(node);
+  int n = size / CHUNK_SIZE;
+  int keep = size % CHUNK_SIZE;
+  int end = n * CHUNK_SPAN;
+
+  // The chunk the file now ends in loses its tail
+  if (keep > 0) {
+    char data[CHUNK_SIZE];
+    int len = load(node, n, data);
+    if (len < 0) {
+      return len;
+    }
+    if (len > 0) {
+      int rv = chunk_store(node, n, data, min(len, keep));
+      if (rv < 0) {
+        return rv;
+      }
+      end += rv;
+    }
+  }
+
+  cache_drop(inum, n);
+  extent_truncate(&node->extents, end);
+  journal_dirty(node, sizeof(inode_t));
+  node->size = size;
+
+  return 0;
+}
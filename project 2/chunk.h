@@ -0,0 +1,54 @@
+// Compressed file data.
+//
+// With NUFS_COMPRESS=1 in the environment, regular files created from then
+// on keep their data compressed. The INODE_COMPRESSED flag marks them, so an
+// image holds both kinds and can be mounted with or without the option.
+//
+// A compressed file is cut into CHUNK_SIZE-byte chunks, each compressed on
+// its own (see lz.h). The inode's extent tree doubles as the chunk map:
+// chunk n lives at logical blocks n * CHUNK_SPAN on, as a chunk header
+// followed by the compressed bytes, in as few blocks as those need. Chunks
+// that don't compress are stored as they are, which is what the extra block
+// in CHUNK_SPAN is for. An unmapped chunk is a hole.
+//
+// Writes recompress every chunk they touch, in place, and a chunk that
+// shrinks gives back the blocks it no longer needs. Decompressed chunks are
+// kept in a small cache, so reads and partial writes don't have to
+// decompress them again.
+//
+// Callers hold the inode's lock, as for the functions in inode.h.
+
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include "inode.h"
+
+#define CHUNK_SIZE (64 * 1024)
+#define CHUNK_BLOCKS (CHUNK_SIZE / BLOCK_SIZE)
+#define CHUNK_SPAN (CHUNK_BLOCKS + 1)
+
+// Empty the chunk cache and check NUFS_COMPRESS. Called at mount.
+void chunk_init();
+
+// Whether new files should be compressed.
+int chunk_enabled();
+
+// Read size bytes at offset from a compressed file, all of which must be
+// before its end. Returns size or a negative errno.
+int chunk_read(inode_t *node, char *buf, int size, int offset);
+
+// Write size bytes at offset to a compressed file, growing it if needed.
+// Returns size, -EFBIG past INODE_MAX_SIZE, or another negative errno.
+int chunk_write(inode_t *node, const char *buf, int size, off_t offset);
+
+// Shrink a compressed file, which mustn't be inline, to size bytes.
+int chunk_truncate(inode_t *node, int size);
+
+// Compress len bytes of data into chunk n of a file, replacing what was
+// there. Returns the number of blocks it now takes or a negative errno.
+int chunk_store(inode_t *node, int n, const char *data, int len);
+
+// Drop the cached chunks of a file that is being freed.
+void chunk_forget(int inum);
+
+#endif
@@ -0,0 +1,207 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+
+typedef struct dentry {
+  uint64_t hash;
+  uint32_t age;  // last use, for picking a victim within a set
+  int inum;      // -1 for a negative entry
+  int len;       // 0 for an empty slot (the empty path is never cached)
+  char path[DCACHE_PATH_MAX];
+} dentry_t;
+
+static dentry_t *dcache = NULL;
+static int dcache_sets = 0;
+static uint32_t dcache_clock = 0;
+static dcache_stats_t dcache_counters;
+static long dcache_gen = 0; // bumped by every invalidation
+
+// Sets are guarded by a fixed number of striped locks
+#define DCACHE_LOCKS 64
+static pthread_mutex_t dcache_locks[DCACHE_LOCKS];
+static pthread_once_t dcache_locks_once = PTHREAD_ONCE_INIT;
+
+static void dcache_locks_init() {
+  for (int i = 0; i < DCACHE_LOCKS; i++) {
+    pthread_mutex_init(&dcache_locks[i], NULL);
+  }
+}
+
+// Bump a counter shared between threads
+static void bump(long *counter) {
+  __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+// Hash len bytes of a path (64-bit FNV-1a)
+static uint64_t path_hash(const char *path, int len) {
+  uint64_t hash = 14695981039346656037ull;
+  for (int i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char) path[i]) * 1099511628211ull;
+  }
+
+  return hash;
+}
+
+// Get the first entry of the set a hash belongs to
+static dentry_t *get_set(uint64_t hash) {
+  return &dcache[(hash & (dcache_sets - 1)) * DCACHE_WAYS];
+}
+
+// Get the lock for the set a hash belongs to
+static pthread_mutex_t *get_lock(uint64_t hash) {
+  return &dcache_locks[(hash & (dcache_sets - 1)) % DCACHE_LOCKS];
+}
+
+// Get the clock value for an entry being used
+static uint32_t tick() {
+  return __atomic_add_fetch(&dcache_clock, 1, __ATOMIC_RELAXED);
+}
+
+// Find the entry for a path, or NULL
+static dentry_t *find_entry(const char *path, int len, uint64_t hash) {
+  dentry_t *set = get_set(hash);
+  for (int i = 0; i < DCACHE_WAYS; i++) {
+    if (set[i].len == len && set[i].hash == hash &&
+        memcmp(set[i].path, path, len) == 0) {
+      return &set[i];
+    }
+  }
+
+  return NULL;
+}
+
+// Set up an empty cache with room for the given number of entries. Not safe
+// to call while other threads use the cache.
+void dcache_init(int entries) {
+  pthread_once(&dcache_locks_once, dcache_locks_init);
+
+  free(dcache);
+  dcache = NULL;
+  dcache_sets = entries / DCACHE_WAYS;
+  if (dcache_sets > 0) {
+    dcache = calloc(dcache_sets * DCACHE_WAYS, sizeof(dentry_t));
+  }
+  memset(&dcache_counters, 0, sizeof(dcache_counters));
+}
+
+// Look up a cached path
+int dcache_lookup(const char *path, int len, int *inum) {
+  if (dcache_sets == 0 || len == 0 || len >= DCACHE_PATH_MAX) {
+    bump(&dcache_counters.misses);
+    return 0;
+  }
+
+  uint64_t hash = path_hash(path, len);
+  pthread_mutex_t *lock = get_lock(hash);
+  pthread_mutex_lock(lock);
+  dentry_t *ent = find_entry(path, len, hash);
+  if (ent == NULL) {
+    pthread_mutex_unlock(lock);
+    bump(&dcache_counters.misses);
+    return 0;
+  }
+
+  ent->age = tick();
+  *inum = ent->inum;
+  pthread_mutex_unlock(lock);
+
+  bump(&dcache_counters.hits);
+  if (*inum < 0) {
+    bump(&dcache_counters.negative_hits);
+  }
+
+  return 1;
+}
+
+// Get the current generation, to pass to dcache_insert
+long dcache_generation() {
+  return __atomic_load_n(&dcache_gen, __ATOMIC_ACQUIRE);
+}
+
+// Remember the result of resolving a path
+void dcache_insert(const char *path, int len, int inum, long gen) {
+  if (dcache_sets == 0 || len == 0 || len >= DCACHE_PATH_MAX) {
+    return;
+  }
+
+  uint64_t hash = path_hash(path, len);
+  pthread_mutex_t *lock = get_lock(hash);
+  pthread_mutex_lock(lock);
+
+  // Something was invalidated while the caller walked the tree, so its
+  // result may already be out of date
+  if (gen != dcache_generation()) {
+    pthread_mutex_unlock(lock);
+    return;
+  }
+
+  dentry_t *ent = find_entry(path, len, hash);
+
+  // Otherwise take an empty slot, or the least recently used one
+  if (ent == NULL) {
+    dentry_t *set = get_set(hash);
+    ent = &set[0];
+    for (int i = 0; i < DCACHE_WAYS; i++) {
+      if (set[i].len == 0) {
+        ent = &set[i];
+        break;
+      }
+      if (set[i].age < ent->age) {
+        ent = &set[i];
+      }
+    }
+  }
+
+  ent->hash = hash;
+  ent->age = tick();
+  ent->inum = inum;
+  ent->len = len;
+  memcpy(ent->path, path, len);
+  pthread_mutex_unlock(lock);
+}
+
+// Forget the given path
+void dcache_invalidate(const char *path) {
+  int len = strlen(path);
+  if (dcache_sets == 0 || len == 0 || len >= DCACHE_PATH_MAX) {
+    return;
+  }
+
+  uint64_t hash = path_hash(path, len);
+  pthread_mutex_t *lock = get_lock(hash);
+  pthread_mutex_lock(lock);
+  __atomic_add_fetch(&dcache_gen, 1, __ATOMIC_RELEASE);
+  dentry_t *ent = find_entry(path, len, hash);
+  if (ent != NULL) {
+    ent->len = 0;
+    bump(&dcache_counters.invalidations);
+  }
+  pthread_mutex_unlock(lock);
+}
+
+// Forget the given path and every path below it. Paths under a directory
+// hash to arbitrary sets, so this has to look at every entry.
+void dcache_invalidate_tree(const char *path) {
+  int len = strlen(path);
+
+  __atomic_add_fetch(&dcache_gen, 1, __ATOMIC_RELEASE);
+  for (int i = 0; i < dcache_sets * DCACHE_WAYS; i++) {
+    pthread_mutex_t *lock = &dcache_locks[(i / DCACHE_WAYS) % DCACHE_LOCKS];
+    pthread_mutex_lock(lock);
+    dentry_t *ent = &dcache[i];
+    if (ent->len >= len && memcmp(ent->path, path, len) == 0 &&
+        (ent->len == len || ent->path[len] == '/')) {
+      ent->len = 0;
+      bump(&dcache_counters.invalidations);
+    }
+    pthread_mutex_unlock(lock);
+  }
+}
+
+// Copy the hit/miss counters
+void dcache_get_stats(dcache_stats_t *stats) {
+  *stats = dcache_counters;
+}
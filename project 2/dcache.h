@@ -0,0 +1,52 @@
+// Path to inode number cache.
+//
+// tree_lookup resolves a path one directory at a time from the root; the
+// dentry cache remembers the result (including "does not exist") keyed by
+// the full path so repeated lookups cost a single hash probe. Anything that
+// changes the namespace must invalidate the affected paths, after making the
+// change.
+//
+// The cache is safe to use from several threads. Each invalidation bumps a
+// generation number; a lookup that walked the tree records the generation
+// before starting and its result is only cached if nothing was invalidated
+// in the meantime, so a walk racing with a change can't cache stale data.
+
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#define DCACHE_ENTRIES 16384 // default capacity, a power of two
+#define DCACHE_WAYS 4        // entries per hash set
+#define DCACHE_PATH_MAX 112  // longer paths are not cached
+
+typedef struct dcache_stats {
+  long hits;
+  long misses;
+  long negative_hits; // hits on paths known not to exist
+  long invalidations; // entries dropped by dcache_invalidate*
+} dcache_stats_t;
+
+// Set up an empty cache with room for the given number of entries. With 0
+// entries the cache is disabled and every lookup walks the tree.
+void dcache_init(int entries);
+
+// Look up a path of len bytes. Returns 1 and sets inum (-1 for a cached
+// miss) if the path is cached, 0 otherwise.
+int dcache_lookup(const char *path, int len, int *inum);
+
+// Get the current generation, to be read before resolving a path.
+long dcache_generation();
+
+// Remember that the path resolves to inum (-1 if it doesn't exist), unless
+// something was invalidated since generation gen.
+void dcache_insert(const char *path, int len, int inum, long gen);
+
+// Forget the given path.
+void dcache_invalidate(const char *path);
+
+// Forget the given path and every path below it.
+void dcache_invalidate_tree(const char *path);
+
+// Copy the hit/miss counters.
+void dcache_get_stats(dcache_stats_t *stats);
+
+#endif
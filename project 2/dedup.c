@@ -0,0 +1,406 @@
+// Block deduplication. See dedup.h.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "dedup.h"
+#include "flush.h"
+#include "stats.h"
+
+#define TABLE_MIN (1 << 12)
+#define TABLE_MAX (1 << 18) // entries in the hash index, at most
+
+// Extra references to a shared block. Block 0 holds the superblock and is
+// never shared, so bnum 0 marks an empty slot.
+typedef struct share {
+  uint32_t bnum;
+  uint32_t extra;
+} share_t;
+
+typedef struct table_entry {
+  uint64_t hash;
+  uint32_t bnum;
+} table_entry_t;
+
+// Guards everything below
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+static int enabled = 0;
+
+// Open addressing hash map of shared blocks, with linear probing
+static share_t *shares;
+static uint32_t share_cap;
+static uint32_t share_used;
+static long saved; // sum of the extra references
+
+static table_entry_t *table; // direct mapped hash index
+static uint32_t table_mask;
+static uint8_t *indexed; // blocks that may be shared through the index
+
+static int min(int a, int b) {
+  return a < b ? a : b;
+}
+
+static uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// Hash a block four words at a time, each into its own lane. The data comes
+// from the caller's buffer and may not be aligned.
+static uint64_t block_hash(const char *data) {
+  uint64_t lane[4] = {0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full,
+                      0x165667b19e3779f9ull, 0x27d4eb2f165667c5ull};
+
+  for (int i = 0; i < BLOCK_SIZE; i += sizeof(lane)) {
+    uint64_t word[4];
+    memcpy(word, data + i, sizeof(word));
+    for (int k = 0; k < 4; k++) {
+      lane[k] = rotl((lane[k] ^ word[k]) * 0x9e3779b97f4a7c15ull, 31);
+    }
+  }
+
+  uint64_t h = lane[0] ^ rotl(lane[1], 7) ^ rotl(lane[2], 12) ^ rotl(lane[3], 18);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  return h;
+}
+
+static uint32_t share_home(uint32_t bnum) {
+  return (bnum * 2654435761u) & (share_cap - 1);
+}
+
+// Find the entry for bnum, or the empty slot it would go in
+static share_t *share_find(uint32_t bnum) {
+  uint32_t i = share_home(bnum);
+  while (shares[i].bnum != 0 && shares[i].bnum != bnum) {
+    i = (i + 1) & (share_cap - 1);
+  }
+
+  return &shares[i];
+}
+
+// Whether bnum has extra references
+static int is_shared(uint32_t bnum) {
+  return share_used > 0 && share_find(bnum)->bnum == bnum;
+}
+
+static void share_grow() {
+  share_t *old = shares;
+  uint32_t oldCap = share_cap;
+
+  share_cap = oldCap ? oldCap * 2 : 1024;
+  shares = calloc(share_cap, sizeof(share_t));
+  for (uint32_t i = 0; i < oldCap; i++) {
+    if (old[i].bnum != 0) {
+      *share_find(old[i].bnum) = old[i];
+    }
+  }
+  free(old);
+}
+
+// Add an extra reference to bnum
+static void share_add(uint32_t bnum) {
+  if ((share_used + 1) * 2 > share_cap) {
+    share_grow();
+  }
+
+  share_t *s = share_find(bnum);
+  if (s->bnum == 0) {
+    s->bnum = bnum;
+    __atomic_store_n(&share_used, share_used + 1, __ATOMIC_RELAXED);
+  }
+  s->extra++;
+  __atomic_store_n(&saved, saved + 1, __ATOMIC_RELAXED);
+}
+
+// Drop an extra reference. The last one takes the entry out, moving later
+// entries of its probe sequence back so lookups still find them.
+static void share_drop(share_t *s) {
+  __atomic_store_n(&saved, saved - 1, __ATOMIC_RELAXED);
+  if (--s->extra > 0) {
+    return;
+  }
+
+  uint32_t mask = share_cap - 1;
+  uint32_t hole = s - shares;
+  for (uint32_t j = (hole + 1) & mask; shares[j].bnum != 0; j = (j + 1) & mask) {
+    // An entry can fill the hole unless its home is after the hole
+    uint32_t home = share_home(shares[j].bnum);
+    int between = hole <= j ? (hole < home && home <= j)
+                            : (hole < home || home <= j);
+    if (!between) {
+      shares[hole] = shares[j];
+      hole = j;
+    }
+  }
+  shares[hole].bnum = 0;
+  shares[hole].extra = 0;
+  __atomic_store_n(&share_used, share_used - 1, __ATOMIC_RELAXED);
+}
+
+// Count the blocks mapped by more than one file
+static void count_shares() {
+  superblock_t *sb = blocks_get_superblock();
+  uint8_t *seen = calloc(sb->max_blocks / 8, 1);
+
+  for (int inum = 0; inum < (int) sb->inode_count; inum++) {
+    if (!bitmap_get(get_inode_bitmap(), inum)) {
+      continue;
+    }
+
+    inode_t *node = get_inode(inum);
+    int end = inode_end_lblk(node);
+    for (int lblk = 0; lblk < end;) {
+      int pnum;
+      int run = min(inode_map_blocks(node, lblk, &pnum), end - lblk);
+      for (int b = pnum; pnum != 0 && b < pnum + run; b++) {
+        if (bitmap_get(seen, b)) {
+          share_add(b);
+        }
+        else {
+          bitmap_put(seen, b, 1);
+        }
+      }
+      lblk += run;
+    }
+  }
+
+  free(seen);
+}
+
+void dedup_init() {
+  const char *dedup = getenv("NUFS_DEDUP");
+  enabled = dedup && atoi(dedup) > 0;
+
+  free(shares);
+  free(table);
+  free(indexed);
+  shares = NULL;
+  table = NULL;
+  indexed = NULL;
+  share_cap = share_used = 0;
+  saved = 0;
+
+  superblock_t *sb = blocks_get_superblock();
+  if (enabled) {
+    uint32_t entries = TABLE_MIN;
+    while (entries < sb->max_blocks && entries < TABLE_MAX) {
+      entries *= 2;
+    }
+    table = calloc(entries, sizeof(table_entry_t));
+    table_mask = entries - 1;
+    indexed = calloc(sb->max_blocks / 8, 1);
+  }
+
+  count_shares();
+}
+
+int dedup_active() {
+  return enabled || __atomic_load_n(&share_used, __ATOMIC_RELAXED) > 0;
+}
+
+long dedup_saved() {
+  return __atomic_load_n(&saved, __ATOMIC_RELAXED);
+}
+
+int dedup_release(int bnum, int count) {
+  // Without deduplication nothing new gets shared, so once no block is
+  // shared none will be
+  if (!dedup_active()) {
+    return count;
+  }
+
+  pthread_mutex_lock(&dedup_lock);
+  if (is_shared(bnum)) {
+    share_drop(share_find(bnum));
+    pthread_mutex_unlock(&dedup_lock);
+    return 0;
+  }
+
+  int n = 1;
+  while (n < count && !is_shared(bnum + n)) {
+    n++;
+  }
+  if (indexed) {
+    bitmap_put_range(indexed, bnum, n, 0);
+  }
+  pthread_mutex_unlock(&dedup_lock);
+
+  return n;
+}
+
+// Find an indexed block other than cur holding the same bytes as data, and
+// take a reference to it. Returns its pnum, cur if cur holds those bytes
+// already, or 0.
+static int share_match(uint64_t hash, const char *data, int cur) {
+  int bnum = 0;
+
+  pthread_mutex_lock(&dedup_lock);
+  table_entry_t *e = &table[hash & table_mask];
+  if (e->hash == hash && e->bnum != 0 && bitmap_get(indexed, e->bnum) &&
+      memcmp(blocks_get_block(e->bnum), data, BLOCK_SIZE) == 0) {
+    bnum = e->bnum;
+    if (bnum != cur) {
+      share_add(bnum);
+    }
+  }
+  pthread_mutex_unlock(&dedup_lock);
+
+  stats_count(STATS_DEDUP_LOOKUPS, 1);
+  if (bnum != 0) {
+    stats_count(STATS_DEDUP_HITS, 1);
+  }
+  return bnum;
+}
+
+// Add a block that was just written to the index
+static void index_add(uint64_t hash, int bnum) {
+  pthread_mutex_lock(&dedup_lock);
+  table_entry_t *e = &table[hash & table_mask];
+  e->hash = hash;
+  e->bnum = bnum;
+  bitmap_put(indexed, bnum, 1);
+  pthread_mutex_unlock(&dedup_lock);
+}
+
+// Take bnum out of sharing so it can be changed in place. Returns 0 if it
+// is shared already.
+static int claim(int bnum) {
+  pthread_mutex_lock(&dedup_lock);
+  int mine = !is_shared(bnum);
+  if (mine && indexed) {
+    bitmap_put(indexed, bnum, 0);
+  }
+  pthread_mutex_unlock(&dedup_lock);
+
+  return mine;
+}
+
+// Map file block lblk, now mapped to cur (0 for a hole), to bnum instead
+static int remap(inode_t *node, int lblk, int cur, int bnum) {
+  if (cur != 0 && extent_punch(&node->extents, lblk, 1) != 0) {
+    return -ENOSPC;
+  }
+
+  return extent_insert(&node->extents, lblk, bnum, 1) == 0 ? 0 : -ENOSPC;
+}
+
+// Get a block for file block lblk, mapped to cur, that can be written in
+// place: cur itself unless it is shared, or else a new block, holding the
+// bytes of cur if keep is set. Returns its pnum or a negative errno.
+static int own_block(inode_t *node, int lblk, int cur, int keep) {
+  if (cur != 0 && claim(cur)) {
+    return cur;
+  }
+
+  // Place it right after the block before, like inode_alloc_range
+  int goal = 0;
+  if (lblk > 0 && inode_map_blocks(node, lblk - 1, &goal) > 0 && goal) {
+    goal++;
+  }
+  int got;
+  int bnum = alloc_data_blocks(1, goal, &got);
+  if (bnum < 0) {
+    return -ENOSPC;
+  }
+
+  char *block = blocks_get_block(bnum);
+  if (keep && cur != 0) {
+    memcpy(block, blocks_get_block(cur), BLOCK_SIZE);
+    stats_count(STATS_DEDUP_COPIES, 1);
+  }
+  else if (keep) {
+    memset(block, 0, BLOCK_SIZE);
+  }
+  flush_mark(bnum, 1);
+
+  int rv = remap(node, lblk, cur, bnum);
+  if (rv < 0) {
+    free_block(bnum);
+    return rv;
+  }
+  return bnum;
+}
+
+int dedup_own(inode_t *node, int lblk) {
+  int cur;
+  inode_map_blocks(node, lblk, &cur);
+
+  return cur != 0 && dedup_active() ? own_block(node, lblk, cur, 1) : cur;
+}
+
+// Write a whole block of data to file block lblk, mapped to cur
+static int write_block(inode_t *node, int lblk, int cur, const char *data) {
+  uint64_t hash = 0;
+
+  if (enabled) {
+    hash = block_hash(data);
+    int match = share_match(hash, data, cur);
+    if (match != 0 && match == cur) {
+      return 0;
+    }
+    if (match != 0) {
+      int rv = remap(node, lblk, cur, match);
+      if (rv < 0) {
+        free_block(match);
+      }
+      return rv;
+    }
+  }
+
+  int bnum = own_block(node, lblk, cur, 0);
+  if (bnum < 0) {
+    return bnum;
+  }
+  memcpy(blocks_get_block(bnum), data, BLOCK_SIZE);
+  flush_mark(bnum, 1);
+
+  if (enabled) {
+    index_add(hash, bnum);
+  }
+  return 0;
+}
+
+int dedup_write(inode_t *node, const char *buf, int size, off_t offset) {
+  if (offset < 0 || offset + size > INODE_MAX_SIZE) {
+    return -EFBIG;
+  }
+  int rv = inode_promote(node);
+  if (rv != 0) {
+    return rv;
+  }
+
+  for (int done = 0; done < size;) {
+    int pos = offset + done;
+    int lblk = pos / BLOCK_SIZE;
+    int from = pos % BLOCK_SIZE;
+    int n = min(size - done, BLOCK_SIZE - from);
+    int cur;
+    inode_map_blocks(node, lblk, &cur);
+
+    if (n == BLOCK_SIZE) {
+      rv = write_block(node, lblk, cur, buf + done);
+    }
+    else {
+      rv = own_block(node, lblk, cur, 1);
+      if (rv > 0) {
+        memcpy((char *) blocks_get_block(rv) + from, buf + done, n);
+        flush_mark(rv, 1);
+      }
+    }
+    if (rv < 0) {
+      return rv;
+    }
+    done += n;
+  }
+
+  if (node->size < offset + size) {
+    rv = grow_inode(node, offset + size);
+  }
+
+  return rv < 0 ? rv : size;
+}
@@ -0,0 +1,53 @@
+// Block deduplication.
+//
+// With NUFS_DEDUP=1 in the environment, every full block written to a
+// regular file is hashed and looked up in an index of the blocks written
+// before it. If one holds the same bytes (checked with memcmp, so hash
+// collisions don't matter), the file maps that block too instead of taking
+// a new one.
+//
+// A block mapped by several files has extra references, kept in memory and
+// counted again from the inodes' extent trees at every mount, so nothing
+// about them is stored on disk. free_blocks drops a reference rather than
+// freeing a block that still has one. Writing into a shared block copies it
+// first.
+//
+// The index is a fixed-size hash table in memory, filled as blocks are
+// written. An entry that gets overwritten by a colliding hash is simply
+// forgotten, so some duplicates go unnoticed. Each block also has a bit
+// saying it may be shared through the index; it is cleared before the block
+// is changed in place or freed, so a block is never shared while it's
+// changing.
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "inode.h"
+
+// Check NUFS_DEDUP and count the references to every data block. Called at
+// mount, after the inode table is loaded.
+void dedup_init();
+
+// Whether file writes have to go through dedup_write: deduplication is on,
+// or some blocks are shared from an earlier mount.
+int dedup_active();
+
+// Write size bytes at offset to a regular file, sharing full blocks with
+// identical ones and copying shared blocks before changing them. The caller
+// holds the inode's write lock. Returns size, -EFBIG past INODE_MAX_SIZE,
+// or another negative errno.
+int dedup_write(inode_t *node, const char *buf, int size, off_t offset);
+
+// Get file block lblk ready to be changed in place: copy it first if it is
+// shared. Returns its pnum, 0 for a hole, or a negative errno.
+int dedup_own(inode_t *node, int lblk);
+
+// Called by free_blocks for [bnum, bnum + count). If bnum is shared, drops
+// one of its extra references and returns 0. Otherwise returns how many
+// blocks from bnum on are not shared and can be freed.
+int dedup_release(int bnum, int count);
+
+// Blocks saved by sharing, i.e. the extra references to shared blocks.
+long dedup_saved();
+
+#endif
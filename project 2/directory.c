@@ -1,150 +1,643 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "directory.h"
+#include "dcache.h"
 #include "bitmap.h"
 #include "blocks.h"
 #include "inode.h"
+#include "journal.h"
 #include "slist.h"
+#include "path.h"
 #include <errno.h>
+#include <sys/stat.h>
+
+// Small directories are a single block of dirents ("linear" format). When
+// that block fills up the directory switches to a hashed index: block 0
+// becomes the root of a tree of (hash, block) entries sorted by hash, and
+// the dirents live in leaf blocks that each cover one range of name hashes.
+// Lookups, inserts and deletes then touch at most the root, one interior
+// index block and one leaf, however big the directory gets.
+
+// Hash a file name of len bytes (32-bit FNV-1a)
+static uint32_t dir_hash(const char *name, int len) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+  }
+
+  return hash;
+}
+
+// Number of dirents in a directory block
+static int dirents_per_block() {
+  return BLOCK_SIZE / sizeof(dirent_t);
+}
+
+// Number of entries in an index block
+static int dx_limit() {
+  return (BLOCK_SIZE - sizeof(dx_header_t)) / sizeof(dx_entry_t);
+}
+
+// Get the given logical block of a directory
+static void *dir_block(inode_t *dd, int lblk) {
+  return blocks_get_block(inode_get_bnum(dd, lblk * BLOCK_SIZE));
+}
+
+// Get the entries following an index header
+static dx_entry_t *dx_entries(dx_header_t *hdr) {
+  return (dx_entry_t *) (hdr + 1);
+}
+
+// Index of the last entry whose hash is <= the given one
+static int dx_find(dx_header_t *hdr, uint32_t hash) {
+  dx_entry_t *ent = dx_entries(hdr);
+  int lo = 1, hi = hdr->count - 1, found = 0;
+
+  // entry 0 always covers hash 0, so only the rest need searching
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (ent[mid].hash <= hash) {
+      found = mid;
+      lo = mid + 1;
+    }
+    else {
+      hi = mid - 1;
+    }
+  }
+
+  return found;
+}
+
+// Put an entry into an index block at the given position
+static void dx_insert_at(dx_header_t *hdr, int pos, dx_entry_t entry) {
+  dx_entry_t *ent = dx_entries(hdr);
+  journal_dirty(hdr, BLOCK_SIZE);
+  memmove(&ent[pos + 1], &ent[pos], (hdr->count - pos) * sizeof(dx_entry_t));
+  ent[pos] = entry;
+  hdr->count++;
+}
+
+// Add a zeroed block to the end of a directory, returning its logical number
+static int dir_append_block(inode_t *dd) {
+  int lblk = bytes_to_blocks(dd->size);
+  if (inode_alloc_range(dd, lblk, lblk + 1) != 0) {
+    return -ENOSPC;
+  }
+  grow_inode(dd, (lblk + 1) * BLOCK_SIZE);
+
+  return lblk;
+}
+
+// The path from the root to the leaf responsible for a hash
+typedef struct dx_path {
+  dx_header_t *node; // parent of the leaf (the root or an interior block)
+  int pos;           // position of the leaf's entry in node
+  int leaf;          // logical block of the leaf
+} dx_path_t;
+
+// Walk the index down to the leaf for the given hash
+static void dx_find_leaf(inode_t *dd, uint32_t hash, dx_path_t *path) {
+  dx_header_t *root = dir_block(dd, 0);
+  dx_header_t *node = root;
+  int pos = dx_find(node, hash);
+
+  for (int level = 0; level < root->levels; level++) {
+    node = dir_block(dd, dx_entries(node)[pos].block);
+    pos = dx_find(node, hash);
+  }
+
+  path->node = node;
+  path->pos = pos;
+  path->leaf = dx_entries(node)[pos].block;
+}
 
 // Set up the root directory
 void directory_init() {
-  inode_t* rnode = get_inode(alloc_inode());
-  rnode->mode = 040755; // Give read/write permissions & set as
-  // a directory
+  // Give read/write permissions & set as a directory
+  alloc_inode(040755);
 }
 
-// Return the inum of the given file (name) in the given directory inode
-int directory_lookup(inode_t *dd, const char *name) {
-  if (strcmp("", name) == 0) {
-    return 0;
+// Find a used dirent with the given name among count dirents
+static dirent_t *dirent_find(dirent_t *dir, int count, const char *name,
+                             int len) {
+  if (len >= DIR_NAME_LENGTH) {
+    return NULL;
   }
 
-  dirent_t *dir = blocks_get_block(dd->ptr[0]);
-  int dirCount = dd->size / sizeof(dirent_t);
+  for (int i = 0; i < count; i++) {
+    if ((dir[i].used == 1) && (memcmp(name, dir[i].name, len) == 0) &&
+        dir[i].name[len] == 0) {
+      return &dir[i];
+    }
+  }
 
-  // Iterate through all directory contents until one matches
-  // the one we are looking for
-  for (int i = 0; i < dirCount; i++) {
-    dirent_t currDir = dir[i];
+  return NULL;
+}
 
-    if ((strcmp(name, currDir.name) == 0) && (currDir.used == 1)) {
-      return currDir.inum;
-    }
+// Find the dirent with the given name in a directory
+static dirent_t *directory_find(inode_t *dd, const char *name, int len) {
+  if (dd->flags & INODE_DIR_HASHED) {
+    dx_path_t path;
+    dx_find_leaf(dd, dir_hash(name, len), &path);
+
+    return dirent_find(dir_block(dd, path.leaf), dirents_per_block(), name,
+                       len);
   }
 
-  return -1;
+  return dirent_find(dir_block(dd, 0), dd->size / sizeof(dirent_t), name,
+                     len);
+}
+
+// Return the inum of the given file (name, len bytes long) in the given
+// directory inode
+int directory_lookup(inode_t *dd, const char *name, int len) {
+  if (len == 0) {
+    return 0;
+  }
+
+  dirent_t *ent = directory_find(dd, name, len);
+
+  return ent ? ent->inum : -1;
 }
 
 // Returns the given filepath's file inum
 int tree_lookup(const char *path) {
-  // Get a list of all directories in the given path
-  slist_t* list = s_explode(path, '/');
-  slist_t* currDir = list;
+  return tree_lookup_n(path, strlen(path));
+}
 
-  int rinum = 0;
+// Returns the inum of the file at the first len bytes of path
+int tree_lookup_n(const char *path, int len) {
+  int rinum;
+  if (dcache_lookup(path, len, &rinum)) {
+    return rinum;
+  }
 
-  // Iterate through through each inode and find the one that contains the
-  // file we are looking for
-  while (currDir != NULL) {
-    inode_t* rnode = get_inode(rinum);
-    rinum = directory_lookup(rnode, currDir->data);
+  // Walk the components of the path in place, looking each one up in the
+  // directory found for the one before it. Only one directory is locked at a
+  // time.
+  long gen = dcache_generation();
+  path_iter_t it;
+  path_iter_init(&it, path, len);
+  rinum = 0;
+
+  while (path_iter_next(&it)) {
+    inode_read_lock(rinum);
+    int next = directory_lookup(get_inode(rinum), it.name, it.len);
+    inode_unlock(rinum);
+    rinum = next;
     if (rinum == -1) {
-      s_free(list);
-      return -1;
+      break;
     }
-
-    currDir = currDir->next;
   }
 
-  s_free(list);
+  dcache_insert(path, len, rinum, gen);
 
   return rinum;
 }
 
-// Puts a new file in the given dd with the given name and inum
-int directory_put(inode_t *dd, const char *name, int inum) {
-  dirent_t *dir = blocks_get_block(dd->ptr[0]);
+// Find an unused slot in a leaf block
+static dirent_t *leaf_free_slot(dirent_t *leaf) {
+  for (int i = 0; i < dirents_per_block(); i++) {
+    if (leaf[i].used == 0) {
+      return &leaf[i];
+    }
+  }
 
-  int added = 0;
+  return NULL;
+}
 
-  dirent_t newFile;
+// Order dirents by name hash
+static int dirent_hash_cmp(const void *a, const void *b) {
+  const char *na = ((const dirent_t *) a)->name;
+  const char *nb = ((const dirent_t *) b)->name;
+  uint32_t ha = dir_hash(na, strlen(na));
+  uint32_t hb = dir_hash(nb, strlen(nb));
 
-  // Create new file with given filename & inum
-  strcpy(newFile.name, name);
-  newFile.inum = inum;
-  newFile.used = 1;
+  return (ha > hb) - (ha < hb);
+}
 
-  // Add file to given directory
-  int dirCount = dd->size / sizeof(dirent_t);	
-  dir[dirCount] = newFile;
+// Hash of the name in the given dirent
+static uint32_t sorted_hash(dirent_t *dir, int i) {
+  return dir_hash(dir[i].name, strlen(dir[i].name));
+}
 
-  for (int i = 1; i < dirCount; i++) {
-    if (dir[i].used == 0) {
-      dir[i] = newFile;
-      added = 1;
+// Add an index entry pointing at a new leaf next to the one in path.
+// Interior blocks split as needed; returns -ENOSPC if the index is full.
+static int dx_add_leaf(inode_t *dd, dx_path_t *path, dx_entry_t entry) {
+  dx_header_t *root = dir_block(dd, 0);
+  dx_header_t *node = path->node;
+  int pos = path->pos + 1;
+
+  if (node->count < dx_limit()) {
+    dx_insert_at(node, pos, entry);
+    return 0;
+  }
+
+  // A full root moves into a new interior block and indexes that instead
+  if (node == root) {
+    int lblk = dir_append_block(dd);
+    if (lblk < 0) {
+      return lblk;
     }
+    node = dir_block(dd, lblk);
+    journal_dirty(node, BLOCK_SIZE);
+    journal_dirty(root, BLOCK_SIZE);
+    memcpy(node, root, BLOCK_SIZE);
+    node->levels = 0;
+
+    root->levels = 1;
+    root->count = 1;
+    dx_entries(root)[0].hash = 0;
+    dx_entries(root)[0].block = lblk;
   }
 
-  if (added == 0) {
-    dir[dirCount] = newFile;
-    dd->size += sizeof(dirent_t);
+  // Split the full interior block in half
+  if (root->count >= dx_limit()) {
+    return -ENOSPC;
+  }
+  int lblk = dir_append_block(dd);
+  if (lblk < 0) {
+    return lblk;
+  }
+  dx_header_t *right = dir_block(dd, lblk);
+  int half = node->count / 2;
+  journal_dirty(right, BLOCK_SIZE);
+  journal_dirty(node, BLOCK_SIZE);
+  right->magic = DX_MAGIC;
+  right->count = node->count - half;
+  right->levels = 0;
+  memcpy(dx_entries(right), &dx_entries(node)[half],
+         right->count * sizeof(dx_entry_t));
+  node->count = half;
+
+  dx_entry_t upper = {dx_entries(right)[0].hash, lblk};
+  dx_insert_at(root, dx_find(root, upper.hash) + 1, upper);
+
+  if (pos <= half) {
+    dx_insert_at(node, pos, entry);
+  }
+  else {
+    dx_insert_at(right, pos - half, entry);
   }
 
-  // Increase size of directory
-  dd->size = dd->size + sizeof(dirent_t);
+  return 0;
+}
+
+// Split a full leaf by hash, moving its upper half into a new leaf
+static int dx_split_leaf(inode_t *dd, dx_path_t *path) {
+  int count = dirents_per_block();
+  dirent_t *sorted = malloc(BLOCK_SIZE);
+  memcpy(sorted, dir_block(dd, path->leaf), BLOCK_SIZE);
+  qsort(sorted, count, sizeof(dirent_t), dirent_hash_cmp);
+
+  // Names with equal hashes have to stay in the same leaf
+  int mid = count / 2;
+  while (mid < count &&
+         sorted_hash(sorted, mid) == sorted_hash(sorted, mid - 1)) {
+    mid++;
+  }
+  if (mid == count) {
+    mid = count / 2;
+    while (mid > 0 &&
+           sorted_hash(sorted, mid) == sorted_hash(sorted, mid - 1)) {
+      mid--;
+    }
+  }
+  if (mid == 0) {
+    free(sorted);
+    return -ENOSPC;
+  }
+
+  int lblk = dir_append_block(dd);
+  if (lblk < 0) {
+    free(sorted);
+    return lblk;
+  }
+
+  dx_entry_t entry = {sorted_hash(sorted, mid), lblk};
+  int rv = dx_add_leaf(dd, path, entry);
+  if (rv == 0) {
+    dirent_t *leaf = dir_block(dd, path->leaf);
+    dirent_t *right = dir_block(dd, lblk);
+    journal_dirty(leaf, BLOCK_SIZE);
+    journal_dirty(right, BLOCK_SIZE);
+    memset(leaf, 0, BLOCK_SIZE);
+    memcpy(leaf, sorted, mid * sizeof(dirent_t));
+    memcpy(right, &sorted[mid], (count - mid) * sizeof(dirent_t));
+  }
+
+  free(sorted);
+  return rv;
+}
+
+// Turn a full linear directory into a hashed one: the dirents move to a
+// new leaf and block 0 becomes the index root
+static int dx_convert(inode_t *dd) {
+  int lblk = dir_append_block(dd);
+  if (lblk < 0) {
+    return lblk;
+  }
+
+  dx_header_t *root = dir_block(dd, 0);
+  void *leaf = dir_block(dd, lblk);
+  journal_dirty(leaf, BLOCK_SIZE);
+  journal_dirty(root, BLOCK_SIZE);
+  journal_dirty(dd, sizeof(inode_t));
+  memcpy(leaf, root, BLOCK_SIZE);
+  memset(root, 0, BLOCK_SIZE);
+  root->magic = DX_MAGIC;
+  root->count = 1;
+  root->levels = 0;
+  dx_entries(root)[0].hash = 0;
+  dx_entries(root)[0].block = lblk;
+  dd->flags |= INODE_DIR_HASHED;
 
   return 0;
 }
 
-// Delete the file with the given filename in the given directory
-int directory_delete(inode_t *dd, const char *name) {
-  dirent_t *dir = blocks_get_block(dd->ptr[0]);
-
-  int dirCount = dd->size / sizeof(dirent_t);
-
-  // Find the file that matches the given filename and delete it
-  for (int i = 0; i < dirCount; i++) {
-    if (strcmp(dir[i].name, name) == 0) {
-      dir[i].used = 0;
-      inode_t *fileNode = get_inode(dir[i].inum);
-      fileNode->refs = fileNode->refs - 1;
-      if (fileNode->refs < 1) {
-	free_inode(dir[i].inum);
-      }
+// The lowest seq not taken by a name with the given hash among count
+// dirents. Names with the same hash always share a block, so this makes
+// (hash, seq) unique in the directory.
+static int dirent_free_seq(dirent_t *dir, int count, uint32_t hash) {
+  int seq = 0;
+  for (int i = 0; i < count; i++) {
+    if (dir[i].used == 1 && dir[i].seq == seq &&
+        dir_hash(dir[i].name, strnlen(dir[i].name, DIR_NAME_LENGTH)) == hash) {
+      // Taken; start over with the next one
+      seq++;
+      i = -1;
+    }
+  }
 
+  return seq;
+}
+
+// Store a new dirent in the slot of a block holding count dirents
+static void dirent_fill(dirent_t *dir, int count, dirent_t *slot,
+                        const char *name, int len, int inum) {
+  int seq = dirent_free_seq(dir, count, dir_hash(name, len));
+  journal_dirty(slot, sizeof(dirent_t));
+  memset(slot, 0, sizeof(dirent_t));
+  memcpy(slot->name, name, len);
+  slot->inum = inum;
+  slot->used = 1;
+  slot->seq = seq;
+}
+
+// Puts a new file in the given dd with the given name and inum
+int directory_put(inode_t *dd, const char *name, int len, int inum) {
+  if (len >= DIR_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
+
+  if (!(dd->flags & INODE_DIR_HASHED)) {
+    dirent_t *dir = dir_block(dd, 0);
+    int dirCount = dd->size / sizeof(dirent_t);
+
+    // Reuse a deleted entry, or add one at the end of the block
+    dirent_t *slot = leaf_free_slot(dir);
+    if (slot != NULL && slot - dir <= dirCount) {
+      dirent_fill(dir, dirCount, slot, name, len, inum);
+      if (slot - dir == dirCount) {
+        journal_dirty(dd, sizeof(inode_t));
+        dd->size += sizeof(dirent_t);
+      }
       return 0;
     }
+
+    int rv = dx_convert(dd);
+    if (rv != 0) {
+      return rv;
+    }
   }
 
-  return -ENOENT;
+  uint32_t hash = dir_hash(name, len);
+  dx_path_t path;
+  dx_find_leaf(dd, hash, &path);
+
+  dirent_t *leaf = dir_block(dd, path.leaf);
+  dirent_t *slot = leaf_free_slot(leaf);
+  if (slot == NULL) {
+    int rv = dx_split_leaf(dd, &path);
+    if (rv != 0) {
+      return rv;
+    }
+    dx_find_leaf(dd, hash, &path);
+    leaf = dir_block(dd, path.leaf);
+    slot = leaf_free_slot(leaf);
+  }
+
+  dirent_fill(leaf, dirents_per_block(), slot, name, len, inum);
+
+  return 0;
+}
+
+// Delete the file with the given filename in the given directory
+int directory_delete(inode_t *dd, const char *name, int len) {
+  dirent_t *ent = directory_find(dd, name, len);
+  if (ent == NULL) {
+    return -ENOENT;
+  }
+
+  journal_dirty(ent, sizeof(dirent_t));
+  ent->used = 0;
+  int inum = ent->inum;
+  inode_write_lock(inum);
+  inode_t *fileNode = get_inode(inum);
+  journal_dirty(fileNode, sizeof(inode_t));
+  fileNode->refs = fileNode->refs - 1;
+  if (fileNode->refs < 1 && !inode_orphan(inum)) {
+    free_inode(inum);
+  }
+  inode_unlock(inum);
+
+  return 0;
+}
+
+// Add the used dirents in a block to the list
+static slist_t *list_block(dirent_t *dir, int count, slist_t *results) {
+  for (int i = 0; i < count; i++) {
+    if (dir[i].used == 1) {
+      results = s_cons(dir[i].name, results);
+    }
+  }
+
+  return results;
 }
 
 // Return a list of the given path's directory contents
 slist_t *directory_list(const char *path) {
   int inum = tree_lookup(path);
+  if (inum < 0) {
+    return NULL;
+  }
+
+  return directory_list_inum(inum);
+}
+
+// Return a list of the contents of the directory with the given inum
+slist_t *directory_list_inum(int inum) {
   inode_t *node = get_inode(inum);
 
-  int dirCount = node->size / sizeof(dirent_t);
-  dirent_t *dir = blocks_get_block(node->ptr[0]);
+  inode_read_lock(inum);
+  if (!(node->flags & INODE_DIR_HASHED)) {
+    int dirCount = node->size / sizeof(dirent_t);
+    slist_t *results = list_block(dir_block(node, 0), dirCount, NULL);
+    inode_unlock(inum);
+    return results;
+  }
+
+  // Visit the leaves in hash order
   slist_t *results = NULL;
+  dx_header_t *root = dir_block(node, 0);
+  for (int i = 0; i < root->count; i++) {
+    int lblk = dx_entries(root)[i].block;
+    if (root->levels == 0) {
+      results = list_block(dir_block(node, lblk), dirents_per_block(), results);
+      continue;
+    }
 
-  for (int i = 0; i < dirCount; i++) {
-    if (dir[i].used == 1) {
-      results = s_cons(dir[i].name, results);
+    dx_header_t *index = dir_block(node, lblk);
+    for (int j = 0; j < index->count; j++) {
+      dirent_t *leaf = dir_block(node, dx_entries(index)[j].block);
+      results = list_block(leaf, dirents_per_block(), results);
     }
   }
+  inode_unlock(inum);
 
   return results;
 }
 
+// A used dirent picked out of a block for directory_iterate
+typedef struct dir_item {
+  uint32_t hash;
+  int seq;
+  int inum;
+  char name[DIR_NAME_LENGTH];
+} dir_item_t;
+
+static int dir_item_cmp(const void *a, const void *b) {
+  const dir_item_t *x = a;
+  const dir_item_t *y = b;
+  if (x->hash != y->hash) {
+    return x->hash < y->hash ? -1 : 1;
+  }
+  return x->seq - y->seq;
+}
+
+// (hash, seq) is unique in a directory, see dirent_free_seq. seq is below
+// the number of dirents in a block, so it fits in the low 16 bits.
+static off_t item_cookie(dir_item_t *item) {
+  return DIR_COOKIE_MIN + 1 + ((off_t) item->hash << 16 | item->seq);
+}
+
+// The hash a cookie was made from, or 0 for offsets before the first entry
+static uint64_t cookie_hash(off_t cookie) {
+  if (cookie <= DIR_COOKIE_MIN) {
+    return 0;
+  }
+  return (uint64_t) (cookie - DIR_COOKIE_MIN - 1) >> 16;
+}
+
+// Find the leaf responsible for a hash, like dx_find_leaf, and the first
+// hash past the ones it covers (1 << 32 for the last leaf)
+static int dx_leaf_range(inode_t *dd, uint32_t hash, uint64_t *end) {
+  dx_header_t *root = dir_block(dd, 0);
+  dx_header_t *node = root;
+  *end = 1ull << 32;
+
+  for (int level = 0;; level++) {
+    int pos = dx_find(node, hash);
+    if (pos + 1 < node->count) {
+      *end = dx_entries(node)[pos + 1].hash;
+    }
+    int lblk = dx_entries(node)[pos].block;
+    if (level == root->levels) {
+      return lblk;
+    }
+    node = dir_block(dd, lblk);
+  }
+}
+
+// Copy the used dirents of the block holding hash into items, sorted by
+// hash and seq, and set end to the first hash that block doesn't cover.
+// Returns how many there are.
+static int collect_items(inode_t *dd, uint32_t hash, dir_item_t *items,
+                         uint64_t *end) {
+  dirent_t *dir;
+  int count;
+  if (dd->flags & INODE_DIR_HASHED) {
+    dir = dir_block(dd, dx_leaf_range(dd, hash, end));
+    count = dirents_per_block();
+  }
+  else {
+    dir = dir_block(dd, 0);
+    count = dd->size / sizeof(dirent_t);
+    *end = 1ull << 32;
+  }
+
+  int n = 0;
+  for (int i = 0; i < count; i++) {
+    if (dir[i].used == 1) {
+      int len = strnlen(dir[i].name, DIR_NAME_LENGTH);
+      items[n].hash = dir_hash(dir[i].name, len);
+      items[n].seq = dir[i].seq;
+      items[n].inum = dir[i].inum;
+      memcpy(items[n].name, dir[i].name, DIR_NAME_LENGTH);
+      n++;
+    }
+  }
+
+  qsort(items, n, sizeof(dir_item_t), dir_item_cmp);
+
+  return n;
+}
+
+int directory_iterate(int inum, off_t offset, dir_iter_fn fn, void *arg) {
+  inode_t *dd = get_inode(inum);
+  dir_item_t *items = malloc(dirents_per_block() * sizeof(dir_item_t));
+  uint64_t hash = cookie_hash(offset);
+  int rv = 0;
+
+  // One block at a time, so fn runs without the lock held
+  while (rv == 0 && hash < (1ull << 32)) {
+    inode_read_lock(inum);
+    if (dd->refs < 1 || !S_ISDIR(dd->mode)) {
+      rv = dd->refs < 1 ? -ENOENT : -ENOTDIR;
+      inode_unlock(inum);
+      break;
+    }
+    uint64_t end;
+    int count = collect_items(dd, hash, items, &end);
+    inode_unlock(inum);
+
+    for (int i = 0; i < count && rv == 0; i++) {
+      off_t cookie = item_cookie(&items[i]);
+      if (cookie > offset) {
+        rv = fn(arg, items[i].name, items[i].inum, cookie);
+      }
+    }
+    hash = end;
+  }
+
+  free(items);
+  return rv < 0 ? rv : 0;
+}
+
 // Print the items in the given directory inode
 void print_directory(inode_t *dd) {
-  dirent_t *dir = blocks_get_block(dd->ptr[0]);
-  int dirCount = dd->size / sizeof(dirent_t);
+  slist_t *names = NULL;
+
+  if (dd->flags & INODE_DIR_HASHED) {
+    printf("(hashed directory, %d blocks)\n", bytes_to_blocks(dd->size));
+    return;
+  }
 
-  for (int i = 0; i < dirCount; i++) {
-    printf("%s\n", dir[i].name);
+  names = list_block(dir_block(dd, 0), dd->size / sizeof(dirent_t), names);
+  for (slist_t *item = names; item != NULL; item = item->next) {
+    printf("%s\n", item->data);
   }
+  s_free(names);
 }
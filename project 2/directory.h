@@ -9,6 +9,9 @@
 
 #define DIR_NAME_LENGTH 48
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #include "blocks.h"
 #include "inode.h"
 #include "slist.h"
@@ -17,15 +20,55 @@ typedef struct dirent {
   char name[DIR_NAME_LENGTH];
   int inum;
   int used;
-  char _reserved[12];
+  uint16_t seq; // tells apart names with the same hash, see directory.c
+  char _reserved[10];
 } dirent_t;
 
+// Block 0 of a hashed directory (INODE_DIR_HASHED) is the root of its index,
+// and interior index blocks look the same: a header, then entries sorted by
+// hash pointing at the blocks below. See directory.c.
+#define DX_MAGIC 0x4e445844 // "DXDN"
+
+typedef struct dx_header {
+  uint32_t magic;
+  uint16_t count;  // entries in use
+  uint16_t levels; // root only: index levels between the root and leaves
+} dx_header_t;
+
+typedef struct dx_entry {
+  uint32_t hash;  // lowest name hash stored under this entry
+  uint32_t block; // logical block in the directory
+} dx_entry_t;
+
+// directory_lookup expects the caller to hold dd's read lock, and
+// directory_put and directory_delete its write lock. tree_lookup and
+// directory_list lock each directory they read themselves.
 void directory_init();
-int directory_lookup(inode_t *dd, const char *name);
+int directory_lookup(inode_t *dd, const char *name, int len);
 int tree_lookup(const char *path);
-int directory_put(inode_t *dd, const char *name, int inum);
-int directory_delete(inode_t *dd, const char *name);
+int tree_lookup_n(const char *path, int len);
+int directory_put(inode_t *dd, const char *name, int len, int inum);
+int directory_delete(inode_t *dd, const char *name, int len);
 slist_t *directory_list(const char *path);
+slist_t *directory_list_inum(int inum);
+
+// Offsets up to DIR_COOKIE_MIN are left to callers, for "." and "..". Every
+// entry's cookie is larger.
+#define DIR_COOKIE_MIN 2
+
+// Called by directory_iterate with each entry and its cookie. Returns
+// nonzero to stop.
+typedef int (*dir_iter_fn)(void *arg, const char *name, int inum,
+                           off_t cookie);
+
+// Call fn for the entries of directory inum whose cookies are past offset,
+// in cookie order, reading the dirent blocks one at a time. A cookie is made
+// from the name's hash and its dirent's seq, neither of which changes while
+// the name exists, so it stays valid while the directory changes: going on
+// from the last one seen skips nothing that was there all along. Takes
+// the directory's read lock, but doesn't hold it while calling fn. Returns 0
+// or a negative errno.
+int directory_iterate(int inum, off_t offset, dir_iter_fn fn, void *arg);
 void print_directory(inode_t *dd);
 
 #endif
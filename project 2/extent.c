@@ -0,0 +1,327 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "extent.h"
+#include "journal.h"
+
+// Get the tree node stored in the given block
+static extent_header_t *get_node(uint32_t bnum) {
+  return blocks_get_block(bnum);
+}
+
+// Get the entries that follow a node header
+static extent_t *node_entries(extent_header_t *hdr) {
+  return (extent_t *) (hdr + 1);
+}
+
+// Add a node (the root or a block) to the running transaction before
+// changing it
+static void node_dirty(extent_header_t *hdr) {
+  journal_dirty(hdr, sizeof(extent_header_t) + hdr->max * sizeof(extent_t));
+}
+
+// Number of entries that fit in a block-sized node
+static int node_max() {
+  return (BLOCK_SIZE - sizeof(extent_header_t)) / sizeof(extent_t);
+}
+
+// Index of the last entry starting at or before lblk, -1 if there is none
+static int find_entry(extent_header_t *hdr, uint32_t lblk) {
+  extent_t *ext = node_entries(hdr);
+  int lo = 0, hi = hdr->entries - 1, found = -1;
+
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (ext[mid].lblk <= lblk) {
+      found = mid;
+      lo = mid + 1;
+    }
+    else {
+      hi = mid - 1;
+    }
+  }
+
+  return found;
+}
+
+// Set up an empty tree
+void extent_init(extent_root_t *root) {
+  journal_dirty(root, sizeof(extent_root_t));
+  root->hdr.magic = EXTENT_MAGIC;
+  root->hdr.entries = 0;
+  root->hdr.max = EXTENT_ROOT_ENTRIES;
+  root->hdr.depth = 0;
+}
+
+// Map the given logical block, returning the length of the run it starts
+uint32_t extent_lookup(extent_root_t *root, uint32_t lblk, uint32_t *pblk) {
+  extent_header_t *hdr = &root->hdr;
+  uint32_t next = UINT32_MAX; // start of the next mapped run
+
+  while (hdr->depth > 0) {
+    extent_t *idx = node_entries(hdr);
+    int i = find_entry(hdr, lblk);
+    if (i < 0) {
+      *pblk = 0;
+      return idx[0].lblk - lblk;
+    }
+    if (i + 1 < hdr->entries) {
+      next = idx[i + 1].lblk;
+    }
+    hdr = get_node(idx[i].pblk);
+  }
+
+  extent_t *ext = node_entries(hdr);
+  int i = find_entry(hdr, lblk);
+  if (i >= 0 && lblk < ext[i].lblk + ext[i].len) {
+    *pblk = ext[i].pblk + (lblk - ext[i].lblk);
+    return ext[i].lblk + ext[i].len - lblk;
+  }
+
+  if (i + 1 < hdr->entries) {
+    next = ext[i + 1].lblk;
+  }
+  *pblk = 0;
+  return next - lblk;
+}
+
+// Put an entry at position pos of a node. If the node is full it is split
+// and the entry describing the new right-hand node is stored in split,
+// returning 1. The root can't have siblings, so when it fills up its
+// contents move into a new child block and the tree grows a level.
+static int node_insert(extent_header_t *hdr, int is_root, int pos,
+                       extent_t entry, extent_t *split) {
+  extent_t *ext = node_entries(hdr);
+  node_dirty(hdr);
+
+  if (hdr->entries < hdr->max) {
+    memmove(&ext[pos + 1], &ext[pos], (hdr->entries - pos) * sizeof(extent_t));
+    ext[pos] = entry;
+    hdr->entries++;
+    return 0;
+  }
+
+  int bnum = alloc_block();
+  if (bnum < 0) {
+    return -1;
+  }
+  extent_header_t *node = get_node(bnum);
+  extent_t *nodeExt = node_entries(node);
+  journal_dirty(node, BLOCK_SIZE);
+  node->magic = EXTENT_MAGIC;
+  node->max = node_max();
+  node->depth = hdr->depth;
+
+  if (is_root) {
+    // Push the root's entries down, then it indexes the new node
+    memcpy(nodeExt, ext, hdr->entries * sizeof(extent_t));
+    node->entries = hdr->entries;
+    node_insert(node, 0, pos, entry, split);
+
+    hdr->depth++;
+    hdr->entries = 1;
+    ext[0].lblk = nodeExt[0].lblk;
+    ext[0].len = 0;
+    ext[0].pblk = bnum;
+    return 0;
+  }
+
+  // Appending only moves the new entry, so files written front to back end
+  // up with full nodes. Otherwise split the node in half.
+  int half = (pos == hdr->entries) ? hdr->entries : hdr->entries / 2;
+  node->entries = hdr->entries - half;
+  memcpy(nodeExt, &ext[half], node->entries * sizeof(extent_t));
+  hdr->entries = half;
+
+  if (pos < half) {
+    node_insert(hdr, 0, pos, entry, split);
+  }
+  else {
+    node_insert(node, 0, pos - half, entry, split);
+  }
+
+  split->lblk = nodeExt[0].lblk;
+  split->len = 0;
+  split->pblk = bnum;
+  return 1;
+}
+
+// Insert an extent into the subtree under hdr
+static int insert_rec(extent_header_t *hdr, int is_root, extent_t entry,
+                      extent_t *split) {
+  extent_t *ext = node_entries(hdr);
+  int i = find_entry(hdr, entry.lblk);
+  node_dirty(hdr);
+
+  if (hdr->depth == 0) {
+    // Extend the previous extent if the new blocks continue it
+    if (i >= 0 && ext[i].lblk + ext[i].len == entry.lblk &&
+        ext[i].pblk + ext[i].len == entry.pblk) {
+      ext[i].len += entry.len;
+
+      // That may close the gap to the following extent too
+      if (i + 1 < hdr->entries &&
+          ext[i].lblk + ext[i].len == ext[i + 1].lblk &&
+          ext[i].pblk + ext[i].len == ext[i + 1].pblk) {
+        ext[i].len += ext[i + 1].len;
+        memmove(&ext[i + 1], &ext[i + 2],
+                (hdr->entries - i - 2) * sizeof(extent_t));
+        hdr->entries--;
+      }
+      return 0;
+    }
+
+    // Or prepend to the following extent
+    if (i + 1 < hdr->entries && entry.lblk + entry.len == ext[i + 1].lblk &&
+        entry.pblk + entry.len == ext[i + 1].pblk) {
+      ext[i + 1].lblk = entry.lblk;
+      ext[i + 1].pblk = entry.pblk;
+      ext[i + 1].len += entry.len;
+      return 0;
+    }
+
+    return node_insert(hdr, is_root, i + 1, entry, split);
+  }
+
+  // Each index entry holds the lowest block of its subtree
+  if (i < 0) {
+    i = 0;
+    ext[0].lblk = entry.lblk;
+  }
+
+  extent_t childSplit;
+  int rv = insert_rec(get_node(ext[i].pblk), 0, entry, &childSplit);
+  if (rv != 1) {
+    return rv;
+  }
+
+  return node_insert(hdr, is_root, i + 1, childSplit, split);
+}
+
+// Map [lblk, lblk + len) to [pblk, pblk + len)
+int extent_insert(extent_root_t *root, uint32_t lblk, uint32_t pblk,
+                  uint32_t len) {
+  extent_t entry = {lblk, len, pblk};
+  extent_t split;
+
+  int rv = insert_rec(&root->hdr, 1, entry, &split);
+  assert(rv != 1);
+
+  return rv;
+}
+
+// Free every mapping at or after lblk under the given node
+static void truncate_rec(extent_header_t *hdr, uint32_t lblk) {
+  extent_t *ext = node_entries(hdr);
+  node_dirty(hdr);
+
+  while (hdr->entries > 0) {
+    extent_t *last = &ext[hdr->entries - 1];
+
+    if (hdr->depth > 0) {
+      extent_header_t *child = get_node(last->pblk);
+      truncate_rec(child, lblk);
+      if (child->entries > 0) {
+        break;
+      }
+      free_block(last->pblk);
+    }
+    else if (last->lblk < lblk) {
+      // Keep the front of an extent that straddles the cut
+      if (last->lblk + last->len > lblk) {
+        uint32_t keep = lblk - last->lblk;
+        free_blocks(last->pblk + keep, last->len - keep);
+        last->len = keep;
+      }
+      break;
+    }
+    else {
+      free_blocks(last->pblk, last->len);
+    }
+
+    hdr->entries--;
+  }
+}
+
+// Unmap and free every block at or after lblk
+void extent_truncate(extent_root_t *root, uint32_t lblk) {
+  truncate_rec(&root->hdr, lblk);
+
+  if (root->hdr.entries == 0) {
+    root->hdr.depth = 0;
+  }
+
+  // Pull a lone child back into the root once it fits there again
+  while (root->hdr.depth > 0 && root->hdr.entries == 1) {
+    uint32_t bnum = root->ext[0].pblk;
+    extent_header_t *child = get_node(bnum);
+    if (child->entries > EXTENT_ROOT_ENTRIES) {
+      break;
+    }
+
+    memcpy(root->ext, node_entries(child), child->entries * sizeof(extent_t));
+    root->hdr.entries = child->entries;
+    root->hdr.depth = child->depth;
+    free_block(bnum);
+  }
+}
+
+// Find the leaf that lblk belongs in
+static extent_header_t *find_leaf(extent_root_t *root, uint32_t lblk) {
+  extent_header_t *hdr = &root->hdr;
+
+  while (hdr->depth > 0) {
+    int i = find_entry(hdr, lblk);
+    hdr = get_node(node_entries(hdr)[i < 0 ? 0 : i].pblk);
+  }
+
+  return hdr;
+}
+
+// Unmap and free [lblk, lblk + len)
+int extent_punch(extent_root_t *root, uint32_t lblk, uint32_t len) {
+  uint32_t end = lblk + len;
+
+  while (lblk < end) {
+    extent_header_t *leaf = find_leaf(root, lblk);
+    extent_t *ext = node_entries(leaf);
+    int i = find_entry(leaf, lblk);
+
+    // Skip over holes
+    if (i < 0 || lblk >= ext[i].lblk + ext[i].len) {
+      uint32_t pblk;
+      uint32_t run = extent_lookup(root, lblk, &pblk);
+      lblk = run < end - lblk ? lblk + run : end;
+      continue;
+    }
+
+    extent_t cut = ext[i];
+    uint32_t stop = end < cut.lblk + cut.len ? end : cut.lblk + cut.len;
+    node_dirty(leaf);
+    free_blocks(cut.pblk + (lblk - cut.lblk), stop - lblk);
+
+    if (lblk == cut.lblk && stop == cut.lblk + cut.len) {
+      memmove(&ext[i], &ext[i + 1], (leaf->entries - i - 1) * sizeof(extent_t));
+      leaf->entries--;
+    }
+    else if (lblk == cut.lblk) {
+      ext[i].lblk = stop;
+      ext[i].pblk += stop - cut.lblk;
+      ext[i].len -= stop - cut.lblk;
+    }
+    else {
+      // Keep the front here; the back, if any, becomes an extent of its own
+      ext[i].len = lblk - cut.lblk;
+      if (stop < cut.lblk + cut.len &&
+          extent_insert(root, stop, cut.pblk + (stop - cut.lblk),
+                        cut.lblk + cut.len - stop) != 0) {
+        return -1;
+      }
+    }
+    lblk = stop;
+  }
+
+  return 0;
+}
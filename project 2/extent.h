@@ -0,0 +1,58 @@
+// Extent-based block mapping.
+//
+// A file's blocks are described by (logical start, physical start, length)
+// runs kept sorted by logical block. A handful of extents live directly in
+// the inode; when they run out the root is pushed down into an on-disk tree
+// whose interior nodes hold (logical start, child block) index entries.
+
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <stdint.h>
+
+#define EXTENT_MAGIC 0xf30a
+#define EXTENT_ROOT_ENTRIES 4
+
+typedef struct extent {
+  uint32_t lblk; // first logical block covered
+  uint32_t len;  // number of blocks (unused in index entries)
+  uint32_t pblk; // first physical block, or child node for index entries
+} extent_t;
+
+typedef struct extent_header {
+  uint16_t magic;
+  uint16_t entries; // entries in use
+  uint16_t max;     // capacity of this node
+  uint16_t depth;   // 0 for leaves, otherwise height above the leaves
+} extent_header_t;
+
+// The root of an extent tree, stored inside the inode.
+typedef struct extent_root {
+  extent_header_t hdr;
+  extent_t ext[EXTENT_ROOT_ENTRIES];
+} extent_root_t;
+
+// Set up an empty tree.
+void extent_init(extent_root_t *root);
+
+// Map the given logical block. Sets pblk to its physical block (0 for a hole)
+// and returns the number of blocks from lblk on that map the same way, i.e.
+// the rest of the extent or the length of the hole.
+uint32_t extent_lookup(extent_root_t *root, uint32_t lblk, uint32_t *pblk);
+
+// Map [lblk, lblk + len) to [pblk, pblk + len). The logical range must not
+// already be mapped. Returns 0 on success and -1 if no node could be
+// allocated.
+int extent_insert(extent_root_t *root, uint32_t lblk, uint32_t pblk,
+                  uint32_t len);
+
+// Unmap and free every block at or after the given logical block, along
+// with any tree nodes that become empty.
+void extent_truncate(extent_root_t *root, uint32_t lblk);
+
+// Unmap and free the blocks in [lblk, lblk + len). Leaves may be left
+// empty; extent_truncate removes them. Returns 0 on success and -1 if an
+// extent had to be split and no node could be allocated for it.
+int extent_punch(extent_root_t *root, uint32_t lblk, uint32_t len);
+
+#endif
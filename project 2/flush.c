@@ -0,0 +1,164 @@
+// Dirty block tracking and write-back. See flush.h.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "flush.h"
+
+static uint64_t *dirty[2]; // a bitmap per generation
+static int current = 0;    // generation new marks go to
+
+static pthread_t flusher;
+static int flusher_running = 0;
+static int flusher_stop = 0;
+static int flush_age_ms;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+
+void flush_init(int max_blocks) {
+  int words = (max_blocks + 63) / 64;
+  dirty[0] = calloc(words, sizeof(uint64_t));
+  dirty[1] = calloc(words, sizeof(uint64_t));
+  current = 0;
+}
+
+void flush_mark(int bnum, int count) {
+  uint64_t *map = dirty[__atomic_load_n(&current, __ATOMIC_ACQUIRE)];
+  int i = bnum, end = bnum + count;
+
+  while (i < end) {
+    int bit = i % 64;
+    int n = (end - i < 64 - bit) ? end - i : 64 - bit;
+    uint64_t mask = (n == 64) ? ~0ull : ((1ull << n) - 1) << bit;
+    uint64_t *word = &map[i / 64];
+
+    // rewriting dirty blocks shouldn't bounce the cache line around
+    if ((__atomic_load_n(word, __ATOMIC_RELAXED) & mask) != mask) {
+      __atomic_or_fetch(word, mask, __ATOMIC_RELEASE);
+    }
+    i += n;
+  }
+}
+
+// msync blocks [bnum, end), widened to whole pages
+static int sync_blocks(int bnum, int end) {
+  long page = sysconf(_SC_PAGESIZE);
+  uintptr_t from = (uintptr_t) blocks_get_block(bnum);
+  uintptr_t to = (uintptr_t) blocks_get_block(end);
+  from &= ~(uintptr_t) (page - 1);
+  to = (to + page - 1) & ~(uintptr_t) (page - 1);
+
+  return msync((void *) from, to - from, MS_SYNC) == 0 ? 0 : -errno;
+}
+
+// Take the dirty bits in [bnum, end) out of the given bitmaps and write
+// those blocks back, merging neighbours into one msync. A bit is cleared
+// before its block is written, so a write racing with this marks the block
+// again rather than getting lost.
+static int flush_maps(uint64_t **maps, int nmaps, int bnum, int end) {
+  int rv = 0;
+  int runStart = -1, runEnd = -1;
+  int i = bnum;
+
+  while (i < end) {
+    int bit = i % 64;
+    int n = (end - i < 64 - bit) ? end - i : 64 - bit;
+    uint64_t mask = (n == 64) ? ~0ull : ((1ull << n) - 1) << bit;
+
+    uint64_t x = 0;
+    for (int m = 0; m < nmaps; m++) {
+      uint64_t *word = &maps[m][i / 64];
+      if (__atomic_load_n(word, __ATOMIC_RELAXED) & mask) {
+        x |= __atomic_fetch_and(word, ~mask, __ATOMIC_ACQ_REL) & mask;
+      }
+    }
+
+    while (x != 0) {
+      int b = (i - bit) + __builtin_ctzll(x);
+      x &= x - 1;
+      if (b != runEnd) {
+        if (runStart >= 0 && sync_blocks(runStart, runEnd) != 0) {
+          rv = -EIO;
+        }
+        runStart = b;
+      }
+      runEnd = b + 1;
+    }
+    i += n;
+  }
+
+  if (runStart >= 0 && sync_blocks(runStart, runEnd) != 0) {
+    rv = -EIO;
+  }
+  return rv;
+}
+
+int flush_range(int bnum, int count) {
+  return flush_maps(dirty, 2, bnum, bnum + count);
+}
+
+int flush_blocks(int bnum, int count) {
+  return count > 0 ? sync_blocks(bnum, bnum + count) : 0;
+}
+
+static void *flusher_main(void *arg) {
+  pthread_mutex_lock(&flusher_lock);
+  while (!flusher_stop) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += flush_age_ms / 1000;
+    until.tv_nsec += (flush_age_ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+    if (pthread_cond_timedwait(&flusher_wake, &flusher_lock, &until) == 0) {
+      continue;
+    }
+    pthread_mutex_unlock(&flusher_lock);
+
+    // Everything in the older generation has been dirty for a whole
+    // period; once it is written back it takes the new marks
+    int old = !current;
+    flush_maps(&dirty[old], 1, 0, __atomic_load_n(&BLOCK_COUNT, __ATOMIC_RELAXED));
+    __atomic_store_n(&current, old, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&flusher_lock);
+  }
+  pthread_mutex_unlock(&flusher_lock);
+
+  return NULL;
+}
+
+void flush_start() {
+  const char *age = getenv("NUFS_FLUSH_MS");
+  int age_ms = age ? atoi(age) : 0;
+  if (age_ms <= 0 || flusher_running) {
+    return;
+  }
+
+  flush_age_ms = age_ms;
+  flusher_stop = 0;
+  flusher_running = pthread_create(&flusher, NULL, flusher_main, NULL) == 0;
+}
+
+void flush_free() {
+  if (flusher_running) {
+    pthread_mutex_lock(&flusher_lock);
+    flusher_stop = 1;
+    pthread_cond_signal(&flusher_wake);
+    pthread_mutex_unlock(&flusher_lock);
+    pthread_join(flusher, NULL);
+    flusher_running = 0;
+  }
+
+  free(dirty[0]);
+  free(dirty[1]);
+  dirty[0] = dirty[1] = NULL;
+}
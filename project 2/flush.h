@@ -0,0 +1,42 @@
+// Dirty block tracking for the shared part of the image mapping.
+//
+// Data written through the mapping reaches the image file whenever the
+// kernel gets round to it. To make it durable sooner, writers mark the
+// blocks they change, and fsync msyncs just the dirty blocks of one file
+// rather than the whole mapping.
+//
+// Dirty blocks are kept in two bitmaps, one per generation. Marks go to the
+// current one. An optional flusher thread wakes up every age milliseconds,
+// writes back the blocks of the older generation (dirty for at least that
+// long) and makes its emptied bitmap the current one. No block then stays
+// dirty much longer than twice the age.
+//
+// Metadata is committed by the journal instead. On images without one,
+// fsync writes back the whole metadata region, and all of a directory.
+
+#ifndef FLUSH_H
+#define FLUSH_H
+
+// Set up tracking for an image of up to max_blocks blocks.
+void flush_init(int max_blocks);
+
+// Stop the flusher and forget all dirty blocks.
+void flush_free();
+
+// Note that blocks [bnum, bnum + count) have been written to. Call after
+// changing them.
+void flush_mark(int bnum, int count);
+
+// Write the dirty blocks among [bnum, bnum + count) back to the image
+// file and wait for them. Returns 0 or a negative errno.
+int flush_range(int bnum, int count);
+
+// Write blocks [bnum, bnum + count) back whether marked dirty or not.
+int flush_blocks(int bnum, int count);
+
+// Start the flusher if NUFS_FLUSH_MS is set, writing back blocks once they
+// have been dirty for that many milliseconds. Call it in the process that
+// serves requests, after FUSE has gone into the background.
+void flush_start();
+
+#endif
@@ -0,0 +1,995 @@
+// fsck.nufs: checks an unmounted nufs image and, with -y, repairs it.
+//
+// The image is read through a blockdev (mapped, unless -B says otherwise)
+// and checked in passes, each shared out between several threads:
+//
+//  1. Every allocated inode is checked on its own: its mode, flags and size,
+//     the shape of its extent tree and, for a directory, its index.
+//  2. The directory tree is walked from the root a level at a time, the
+//     directories of a level shared between the threads. This counts the
+//     entries naming each inode and finds the dangling ones: entries naming
+//     a free or broken inode, and second entries for a directory. Allocated
+//     inodes the walk never reaches are lost.
+//  3. The blocks of every inode that is kept are counted, which gives the
+//     block bitmap the image should have. Data blocks of regular files may
+//     be claimed more than once, since NUFS_DEDUP shares them, but a block
+//     of a tree node, a directory or a compressed chunk may not.
+//
+// Then the bitmaps and reference counts are compared with what was found.
+// With -y, dangling entries are cleared, broken and lost inodes freed,
+// blocks claimed twice copied so each owner has its own, and the bitmaps,
+// reference counts and free counts rewritten. A committed journal
+// transaction is replayed first, and the journal emptied after a repair so
+// that it can't undo it at the next mount.
+//
+// Exits with 0 if the image is clean, 1 if errors were repaired, 4 if some
+// are left and 8 if the image couldn't be checked at all, like e2fsck.
+//
+// Usage: fsck.nufs [-y] [-v] [-j threads] [-B mmap|cache|uring] image
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blockdev.h"
+#include "blocks.h"
+#include "directory.h"
+#include "extent.h"
+#include "inode.h"
+#include "journal.h"
+
+#define EXIT_CLEAN 0
+#define EXIT_FIXED 1
+#define EXIT_ERRORS 4
+#define EXIT_FAILED 8
+
+#define BATCH 256      // inodes or directories a thread takes at a time
+#define MAX_DEPTH 8    // deeper extent trees are taken to be corrupt
+#define MAX_RANGES 20  // block ranges listed with -v
+
+// Per inode
+#define I_USED 0x1    // set in the inode bitmap
+#define I_BAD 0x2     // failed pass 1
+#define I_DIR 0x4
+#define I_REACHED 0x8 // named by a directory the walk reached, or the root
+#define I_ORPHAN 0x10 // no references: was open when its last name went
+
+// Per block: who claims it
+#define B_DATA 0x1 // regular file data, which may be shared
+#define B_META 0x2 // anything else
+
+static blockdev_t *dev;
+static superblock_t sb;
+static int repair;
+static int verbose;
+static int threads;
+
+static uint8_t *block_bitmap; // copies of the bitmaps in the image
+static uint8_t *inode_bitmap;
+static uint8_t *istate;  // I_* per inode
+static uint32_t *links;  // entries naming each inode
+static uint32_t *claims; // references to each block
+static uint8_t *kinds;   // B_* per block
+static uint8_t *used;    // the block bitmap there should be
+
+static int *frontier; // directories of the level being walked
+static int *next_level;
+static uint32_t next_count;
+
+static uint64_t errors;  // problems found
+static uint64_t unfixed; // problems left as they are
+static uint64_t changes; // blocks written by repairs
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: fsck.nufs [-y] [-v] [-j threads] "
+                  "[-B mmap|cache|uring] image\n");
+  exit(EXIT_FAILED);
+}
+
+// Report a problem. Unless fixed says it is being repaired, it is left
+// behind.
+static void problem(int fixed, const char *fmt, ...) {
+  char line[256];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+
+  printf("%s\n", line);
+  __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+  if (!fixed) {
+    __atomic_add_fetch(&unfixed, 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Note that a block was changed by a repair
+static void changed(uint32_t bnum) {
+  blockdev_dirty(dev, bnum);
+  __atomic_add_fetch(&changes, 1, __ATOMIC_RELAXED);
+}
+
+// Run fn over [0, count) in batches, on every thread
+typedef void (*batch_fn)(uint32_t from, uint32_t to);
+static batch_fn work_fn;
+static uint32_t work_count;
+static uint32_t work_next;
+
+static void *worker(void *arg) {
+  for (;;) {
+    uint32_t from = __atomic_fetch_add(&work_next, BATCH, __ATOMIC_RELAXED);
+    if (from >= work_count) {
+      return NULL;
+    }
+    work_fn(from, from + BATCH < work_count ? from + BATCH : work_count);
+  }
+}
+
+static void run_parallel(batch_fn fn, uint32_t count) {
+  work_fn = fn;
+  work_count = count;
+  work_next = 0;
+
+  pthread_t *tids = malloc(threads * sizeof(pthread_t));
+  for (int i = 1; i < threads; i++) {
+    pthread_create(&tids[i], NULL, worker, NULL);
+  }
+  worker(NULL);
+  for (int i = 1; i < threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  free(tids);
+}
+
+static int inodes_per_block() { return sb.block_size / INODE_SIZE; }
+
+static int dirents_per_block() { return sb.block_size / sizeof(dirent_t); }
+
+static int dx_limit() {
+  return (sb.block_size - sizeof(dx_header_t)) / sizeof(dx_entry_t);
+}
+
+static int node_max() {
+  return (sb.block_size - sizeof(extent_header_t)) / sizeof(extent_t);
+}
+
+static uint32_t inode_block(int inum) {
+  return sb.inode_table_start + inum / inodes_per_block();
+}
+
+// Pin the block holding an inode and return the inode, NULL if the block
+// can't be read
+static inode_t *inode_get(int inum) {
+  char *block = blockdev_get(dev, inode_block(inum));
+  if (block == NULL) {
+    return NULL;
+  }
+  return (inode_t *) (block + (inum % inodes_per_block()) * INODE_SIZE);
+}
+
+static void inode_put(int inum) { blockdev_put(dev, inode_block(inum)); }
+
+// Whether [pblk, pblk + len) lies in the data region of the image
+static int in_data(uint32_t pblk, uint32_t len) {
+  return pblk >= sb.data_start && (uint64_t) pblk + len <= sb.block_count;
+}
+
+// Map a logical block of a file whose tree passed check_tree, 0 if it's a
+// hole
+static uint32_t map_lblk(inode_t *node, uint32_t lblk) {
+  extent_header_t *hdr = &node->extents.hdr;
+  uint32_t held = 0, pblk = 0;
+
+  for (;;) {
+    extent_t *ext = (extent_t *) (hdr + 1);
+    int i = hdr->entries - 1;
+    while (i >= 0 && ext[i].lblk > lblk) {
+      i--;
+    }
+    if (hdr->depth == 0) {
+      if (i >= 0 && lblk - ext[i].lblk < ext[i].len) {
+        pblk = ext[i].pblk + (lblk - ext[i].lblk);
+      }
+      break;
+    }
+    if (i < 0) {
+      break;
+    }
+
+    uint32_t child = ext[i].pblk;
+    extent_header_t *next = blockdev_get(dev, child);
+    if (held) {
+      blockdev_put(dev, held);
+    }
+    held = next ? child : 0;
+    if (next == NULL) {
+      break;
+    }
+    hdr = next;
+  }
+
+  if (held) {
+    blockdev_put(dev, held);
+  }
+  return pblk;
+}
+
+// Check a tree node that covers logical blocks [lo, hi). Returns what is
+// wrong with it, or NULL.
+static const char *check_node(extent_header_t *hdr, int max, int depth,
+                              uint64_t lo, uint64_t hi) {
+  if (hdr->magic != EXTENT_MAGIC) {
+    return "has an extent node with a bad magic number";
+  }
+  if (hdr->max != max || hdr->entries > max || hdr->depth != depth) {
+    return "has an extent node with a bad header";
+  }
+
+  extent_t *ext = (extent_t *) (hdr + 1);
+  for (int i = 0; i < hdr->entries; i++) {
+    uint64_t end = i + 1 < hdr->entries ? ext[i + 1].lblk : hi;
+    if (ext[i].lblk < lo || ext[i].lblk >= end) {
+      return "has extents out of order";
+    }
+
+    if (depth == 0) {
+      if (ext[i].len == 0 || ext[i].lblk + (uint64_t) ext[i].len > end) {
+        return "has overlapping extents";
+      }
+      if (!in_data(ext[i].pblk, ext[i].len)) {
+        return "has an extent outside the data region";
+      }
+      continue;
+    }
+
+    if (!in_data(ext[i].pblk, 1)) {
+      return "has an extent node outside the data region";
+    }
+    extent_header_t *child = blockdev_get(dev, ext[i].pblk);
+    if (child == NULL) {
+      return "has an extent node that can't be read";
+    }
+    const char *why = check_node(child, node_max(), depth - 1, ext[i].lblk,
+                                 end);
+    blockdev_put(dev, ext[i].pblk);
+    if (why) {
+      return why;
+    }
+  }
+
+  return NULL;
+}
+
+static const char *check_tree(inode_t *node) {
+  if (node->extents.hdr.depth > MAX_DEPTH) {
+    return "has an extent tree that is too deep";
+  }
+  return check_node(&node->extents.hdr, EXTENT_ROOT_ENTRIES,
+                    node->extents.hdr.depth, 0, (uint64_t) 1 << 32);
+}
+
+// Check an index block of a hashed directory and what is below it. levels
+// is the number of index levels under it, or -1 for the root, which says
+// itself. seen marks the blocks already pointed at.
+static const char *check_dx(inode_t *node, uint32_t lblk, int levels,
+                            uint32_t nblocks, uint8_t *seen) {
+  uint32_t pblk = map_lblk(node, lblk);
+  dx_header_t *hdr = pblk ? blockdev_get(dev, pblk) : NULL;
+  if (hdr == NULL) {
+    return "has a directory index block missing";
+  }
+
+  const char *why = NULL;
+  if (levels < 0) {
+    levels = hdr->levels;
+    if (levels > 1) {
+      why = "has a directory index that is too deep";
+    }
+  }
+  else if (hdr->levels != 0) {
+    why = "has a bad directory index block";
+  }
+  if (hdr->magic != DX_MAGIC || hdr->count == 0 || hdr->count > dx_limit()) {
+    why = "has a bad directory index block";
+  }
+
+  dx_entry_t *ent = (dx_entry_t *) (hdr + 1);
+  for (int i = 0; i < hdr->count && !why; i++) {
+    uint32_t child = ent[i].block;
+    if (i > 0 && ent[i].hash < ent[i - 1].hash) {
+      why = "has a directory index out of order";
+    }
+    else if (child == 0 || child >= nblocks || seen[child]) {
+      why = "has a directory index pointing at the wrong block";
+    }
+    else if (levels > 0) {
+      seen[child] = 1;
+      why = check_dx(node, child, levels - 1, nblocks, seen);
+    }
+    else {
+      seen[child] = 1;
+      if (map_lblk(node, child) == 0) {
+        why = "has a directory block missing";
+      }
+    }
+  }
+
+  blockdev_put(dev, pblk);
+  return why;
+}
+
+static const char *check_dir(inode_t *node) {
+  if (node->flags & (INODE_INLINE | INODE_COMPRESSED)) {
+    return "is a directory with the flags of a file";
+  }
+  const char *why = check_tree(node);
+  if (why) {
+    return why;
+  }
+
+  if (!(node->flags & INODE_DIR_HASHED)) {
+    if (node->size % sizeof(dirent_t) != 0 ||
+        node->size / sizeof(dirent_t) > (size_t) dirents_per_block()) {
+      return "has the wrong size for a directory";
+    }
+    return map_lblk(node, 0) ? NULL : "has its directory block missing";
+  }
+
+  uint32_t nblocks = node->size / sb.block_size;
+  if (node->size % sb.block_size != 0 || nblocks < 2) {
+    return "has the wrong size for a directory";
+  }
+  uint8_t *seen = calloc(nblocks, 1);
+  why = check_dx(node, 0, -1, nblocks, seen);
+  free(seen);
+  return why;
+}
+
+// What is wrong with an allocated inode, or NULL
+static const char *check_inode(inode_t *node) {
+  int type = node->mode & S_IFMT;
+  if (type != S_IFREG && type != S_IFDIR && type != S_IFLNK &&
+      type != S_IFIFO && type != S_IFSOCK && type != S_IFCHR &&
+      type != S_IFBLK) {
+    return "has a bad mode";
+  }
+  if (node->flags & ~(INODE_DIR_HASHED | INODE_INLINE | INODE_COMPRESSED) ||
+      ((node->flags & INODE_DIR_HASHED) && type != S_IFDIR)) {
+    return "has bad flags";
+  }
+  if (node->size < 0) {
+    return "has a negative size";
+  }
+
+  if (type == S_IFDIR) {
+    return check_dir(node);
+  }
+  if (node->flags & INODE_INLINE) {
+    return node->size > (int) INODE_INLINE_SIZE ? "is too big to be inline"
+                                                : NULL;
+  }
+  return check_tree(node);
+}
+
+// Pass 1
+static void check_inodes(uint32_t from, uint32_t to) {
+  // Start reading this batch's part of the table
+  uint32_t bnums[BATCH];
+  int count = 0;
+  for (uint32_t b = inode_block(from); b <= inode_block(to - 1); b++) {
+    bnums[count++] = b;
+  }
+  blockdev_prefetch(dev, bnums, count);
+
+  for (uint32_t inum = from; inum < to; inum++) {
+    if (!bitmap_get(inode_bitmap, inum)) {
+      continue;
+    }
+    istate[inum] = I_USED;
+
+    inode_t *node = inode_get(inum);
+    const char *why = node ? check_inode(node) : "can't be read";
+    if (node && S_ISDIR(node->mode)) {
+      istate[inum] |= I_DIR;
+    }
+    if (node && node->refs == 0) {
+      istate[inum] |= I_ORPHAN;
+    }
+    if (node) {
+      inode_put(inum);
+    }
+
+    if (why) {
+      istate[inum] |= I_BAD;
+      problem(repair, "inode %u %s; %s", inum, why,
+              repair ? "freeing it" : "it should be freed");
+    }
+  }
+}
+
+// What is wrong with a used directory entry, or NULL. Counts it, and adds a
+// directory it names to the next level of the walk.
+static const char *check_dirent(dirent_t *ent, int *inum) {
+  *inum = ent->inum;
+  if (ent->name[0] == '\0' || !memchr(ent->name, '\0', DIR_NAME_LENGTH)) {
+    return "with a bad name";
+  }
+  if (ent->inum < 0 || (uint32_t) ent->inum >= sb.inode_count ||
+      !(istate[ent->inum] & I_USED)) {
+    return "naming a free inode";
+  }
+
+  uint8_t state = istate[ent->inum];
+  if (state & I_BAD) {
+    return "naming a broken inode";
+  }
+  if (state & I_DIR) {
+    state = __atomic_fetch_or(&istate[ent->inum], I_REACHED, __ATOMIC_RELAXED);
+    if (state & I_REACHED) {
+      return "naming a directory that already has one";
+    }
+    uint32_t slot = __atomic_fetch_add(&next_count, 1, __ATOMIC_RELAXED);
+    next_level[slot] = ent->inum;
+  }
+  else {
+    __atomic_fetch_or(&istate[ent->inum], I_REACHED, __ATOMIC_RELAXED);
+  }
+
+  __atomic_add_fetch(&links[ent->inum], 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+// Check the first count entries of a directory block
+static void scan_dirents(int dir, uint32_t pblk, int count) {
+  dirent_t *ents = blockdev_get(dev, pblk);
+  if (ents == NULL) {
+    problem(0, "directory %d: block %u can't be read", dir, pblk);
+    return;
+  }
+
+  int dirty = 0;
+  for (int i = 0; i < count; i++) {
+    int inum;
+    const char *why = ents[i].used ? check_dirent(&ents[i], &inum) : NULL;
+    if (why == NULL) {
+      continue;
+    }
+
+    problem(repair, "directory %d has an entry %s (inode %d); %s", dir, why,
+            inum, repair ? "clearing it" : "it should be cleared");
+    if (repair) {
+      ents[i].used = 0;
+      dirty = 1;
+    }
+  }
+
+  if (dirty) {
+    changed(pblk);
+  }
+  blockdev_put(dev, pblk);
+}
+
+// Check the leaves under an index block of a hashed directory
+static void scan_dx(int dir, inode_t *node, uint32_t lblk, int levels) {
+  uint32_t pblk = map_lblk(node, lblk);
+  dx_header_t *hdr = blockdev_get(dev, pblk);
+  if (hdr == NULL) {
+    return;
+  }
+  if (levels < 0) {
+    levels = hdr->levels;
+  }
+
+  dx_entry_t *ent = (dx_entry_t *) (hdr + 1);
+  for (int i = 0; i < hdr->count; i++) {
+    if (levels > 0) {
+      scan_dx(dir, node, ent[i].block, levels - 1);
+    }
+    else {
+      scan_dirents(dir, map_lblk(node, ent[i].block), dirents_per_block());
+    }
+  }
+  blockdev_put(dev, pblk);
+}
+
+// Pass 2, over one level of the walk
+static void scan_dirs(uint32_t from, uint32_t to) {
+  for (uint32_t i = from; i < to; i++) {
+    int dir = frontier[i];
+    inode_t *node = inode_get(dir);
+    if (node == NULL) {
+      continue;
+    }
+    if (node->flags & INODE_DIR_HASHED) {
+      scan_dx(dir, node, 0, -1);
+    }
+    else {
+      scan_dirents(dir, map_lblk(node, 0), node->size / sizeof(dirent_t));
+    }
+    inode_put(dir);
+  }
+}
+
+// Whether an inode is left once repairs are done
+static int kept(uint32_t inum) {
+  return (istate[inum] & (I_USED | I_BAD | I_REACHED)) == (I_USED | I_REACHED);
+}
+
+// Called for each entry of an extent tree; an index entry covers just the
+// child node. Returns 1 if it changed the entry.
+typedef int (*extent_fn)(int inum, extent_t *ext, int is_node, uint8_t kind);
+
+// Walk the tree under hdr, returning 1 if an entry of hdr itself changed
+static int walk_tree(int inum, extent_header_t *hdr, extent_fn fn,
+                     uint8_t kind) {
+  extent_t *ext = (extent_t *) (hdr + 1);
+  int dirty = 0;
+
+  for (int i = 0; i < hdr->entries; i++) {
+    if (hdr->depth == 0) {
+      dirty |= fn(inum, &ext[i], 0, kind);
+      continue;
+    }
+
+    dirty |= fn(inum, &ext[i], 1, kind);
+    uint32_t child = ext[i].pblk;
+    extent_header_t *node = blockdev_get(dev, child);
+    if (node == NULL) {
+      continue;
+    }
+    if (walk_tree(inum, node, fn, kind)) {
+      changed(child);
+    }
+    blockdev_put(dev, child);
+  }
+
+  return dirty;
+}
+
+// Walk the tree of an inode that keeps its data in blocks
+static void walk_inode(int inum, extent_fn fn) {
+  inode_t *node = inode_get(inum);
+  if (node == NULL) {
+    return;
+  }
+
+  if (!(node->flags & INODE_INLINE)) {
+    uint8_t kind = S_ISREG(node->mode) && !(node->flags & INODE_COMPRESSED)
+                       ? B_DATA
+                       : B_META;
+    if (walk_tree(inum, &node->extents.hdr, fn, kind)) {
+      changed(inode_block(inum));
+    }
+  }
+  inode_put(inum);
+}
+
+static int claim(int inum, extent_t *ext, int is_node, uint8_t kind) {
+  uint32_t len = is_node ? 1 : ext->len;
+  for (uint32_t b = ext->pblk; b < ext->pblk + len; b++) {
+    __atomic_add_fetch(&claims[b], 1, __ATOMIC_RELAXED);
+    __atomic_or_fetch(&kinds[b], is_node ? B_META : kind, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+// Pass 3
+static void claim_blocks(uint32_t from, uint32_t to) {
+  for (uint32_t inum = from; inum < to; inum++) {
+    if (kept(inum)) {
+      walk_inode(inum, claim);
+    }
+  }
+}
+
+// A block claimed more than once when it may not be
+static int conflict(uint32_t b) {
+  return claims[b] > 1 && (kinds[b] & B_META);
+}
+
+// Blocks in conflict that some inode has kept
+static uint8_t *owned;
+
+// Give an inode its own copy of an extent or node that shares blocks it may
+// not share. The first inode to get to a block keeps it.
+static int unshare(int inum, extent_t *ext, int is_node, uint8_t kind) {
+  uint32_t len = is_node ? 1 : ext->len;
+  int shared = 0;
+  for (uint32_t b = ext->pblk; b < ext->pblk + len; b++) {
+    if (conflict(b) && bitmap_get(owned, b)) {
+      shared = 1;
+    }
+  }
+  if (!shared) {
+    for (uint32_t b = ext->pblk; b < ext->pblk + len; b++) {
+      if (conflict(b)) {
+        bitmap_put(owned, b, 1);
+      }
+    }
+    return 0;
+  }
+
+  int copy = repair ? bitmap_find_zero_run(used, sb.data_start,
+                                           sb.block_count, len)
+                    : -1;
+  problem(copy >= 0, "inode %d shares blocks %u-%u with another inode%s",
+          inum, ext->pblk, ext->pblk + len - 1,
+          copy >= 0 ? "; copying them"
+                    : repair ? "; there is no room to copy them" : "");
+  if (copy < 0) {
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < len; i++) {
+    void *src = blockdev_get(dev, ext->pblk + i);
+    void *dst = blockdev_get(dev, copy + i);
+    if (src && dst) {
+      memcpy(dst, src, sb.block_size);
+      changed(copy + i);
+    }
+    if (src) {
+      blockdev_put(dev, ext->pblk + i);
+    }
+    if (dst) {
+      blockdev_put(dev, copy + i);
+    }
+
+    claims[ext->pblk + i]--;
+    claims[copy + i] = 1;
+    kinds[copy + i] = is_node ? B_META : kind;
+  }
+  bitmap_put_range(used, copy, len, 1);
+  ext->pblk = copy;
+  return 1;
+}
+
+// Pass 4: count what refers to each kept inode
+static void check_refs(uint32_t from, uint32_t to) {
+  for (uint32_t inum = from; inum < to; inum++) {
+    if (!kept(inum)) {
+      continue;
+    }
+
+    // Nothing names the root, but it holds a reference of its own
+    int expected = links[inum] + (inum == 0);
+    inode_t *node = inode_get(inum);
+    if (node == NULL || node->refs == expected) {
+      if (node) {
+        inode_put(inum);
+      }
+      continue;
+    }
+
+    problem(repair, "inode %u has %d references but %d directory entries%s",
+            inum, node->refs, expected, repair ? "; correcting it" : "");
+    if (repair) {
+      node->refs = expected;
+      changed(inode_block(inum));
+    }
+    inode_put(inum);
+  }
+}
+
+// Report inodes that are allocated but aren't broken and weren't reached
+static void find_lost() {
+  for (uint32_t inum = 1; inum < sb.inode_count; inum++) {
+    if ((istate[inum] & (I_USED | I_BAD | I_REACHED)) != I_USED) {
+      continue;
+    }
+    if (istate[inum] & I_ORPHAN) {
+      problem(repair, "inode %u is an orphan, unlinked while open; %s", inum,
+              repair ? "freeing it" : "it should be freed");
+    }
+    else {
+      problem(repair, "inode %u isn't in any directory; %s", inum,
+              repair ? "freeing it" : "it should be freed");
+    }
+  }
+}
+
+// List ranges of blocks whose bit in the image is bit but should be !bit
+static uint32_t diff_blocks(int bit, const char *what) {
+  uint32_t count = 0, ranges = 0;
+  for (uint32_t b = 0; b < sb.max_blocks; b++) {
+    if (b % 8 == 0 && block_bitmap[b / 8] == used[b / 8]) {
+      b += 7;
+      continue;
+    }
+    if (bitmap_get(block_bitmap, b) != bit || bitmap_get(used, b) == bit) {
+      continue;
+    }
+    uint32_t end = b + 1;
+    while (end < sb.max_blocks && bitmap_get(block_bitmap, end) == bit &&
+           bitmap_get(used, end) != bit) {
+      end++;
+    }
+    if (verbose && ranges++ < MAX_RANGES) {
+      printf("  blocks %u-%u %s\n", b, end - 1, what);
+    }
+    count += end - b;
+    b = end;
+  }
+  return count;
+}
+
+// Copy a bitmap region of the image into memory
+static uint8_t *read_bitmap(uint32_t start, uint32_t blocks) {
+  uint8_t *bm = malloc((size_t) blocks * sb.block_size);
+  for (uint32_t i = 0; i < blocks; i++) {
+    void *block = blockdev_get(dev, start + i);
+    if (block == NULL) {
+      fprintf(stderr, "fsck.nufs: can't read the bitmaps: %s\n",
+              strerror(errno));
+      exit(EXIT_FAILED);
+    }
+    memcpy(bm + (size_t) i * sb.block_size, block, sb.block_size);
+    blockdev_put(dev, start + i);
+  }
+  return bm;
+}
+
+// Write the blocks of a bitmap that differ from the copy read at the start
+static void write_bitmap(uint32_t start, uint32_t blocks, const uint8_t *old,
+                         const uint8_t *bm) {
+  for (uint32_t i = 0; i < blocks; i++) {
+    size_t off = (size_t) i * sb.block_size;
+    if (memcmp(old + off, bm + off, sb.block_size) == 0) {
+      continue;
+    }
+    void *block = blockdev_get(dev, start + i);
+    if (block) {
+      memcpy(block, bm + off, sb.block_size);
+      changed(start + i);
+      blockdev_put(dev, start + i);
+    }
+  }
+}
+
+// Whether the superblock describes an image this program can walk
+static int sane(const superblock_t *s) {
+  uint64_t bs = s->block_size;
+  return s->magic == NUFS_MAGIC && s->version == NUFS_VERSION &&
+         bs >= 512 && bs <= (1 << 20) && (bs & (bs - 1)) == 0 &&
+         s->inode_count > 0 && s->block_count <= s->max_blocks &&
+         s->data_start <= s->block_count &&
+         s->block_bitmap_blocks * bs * 8 >= s->max_blocks &&
+         s->inode_bitmap_blocks * bs * 8 >= s->inode_count &&
+         s->inode_table_blocks * bs >= (uint64_t) s->inode_count * INODE_SIZE &&
+         s->block_bitmap_start >= 1 &&
+         s->block_bitmap_start + s->block_bitmap_blocks <= s->data_start &&
+         s->inode_bitmap_start + s->inode_bitmap_blocks <= s->data_start &&
+         s->inode_table_start + s->inode_table_blocks <= s->data_start &&
+         s->journal_start + s->journal_blocks <= s->data_start;
+}
+
+int main(int argc, char **argv) {
+  blockdev_options_t opts;
+  blockdev_default_options(&opts);
+  threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "yvj:B:")) != -1) {
+    switch (opt) {
+    case 'y':
+      repair = 1;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'B':
+      if (blockdev_parse_kind(optarg) < 0) {
+        usage();
+      }
+      opts.kind = blockdev_parse_kind(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc - 1) {
+    usage();
+  }
+  const char *path = argv[optind];
+  threads = threads < 1 ? 1 : threads;
+
+  int fd = open(path, repair ? O_RDWR : O_RDONLY);
+  if (fd < 0 || pread(fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+    fprintf(stderr, "fsck.nufs: %s: %s\n", path,
+            fd < 0 ? strerror(errno) : "too short");
+    return EXIT_FAILED;
+  }
+  if (!sane(&sb)) {
+    fprintf(stderr, "fsck.nufs: %s: not a nufs image, or its superblock is "
+                    "corrupt\n", path);
+    return EXIT_FAILED;
+  }
+
+  // Check what the next mount would see: with the last commit written home
+  if (repair) {
+    int replayed = journal_replay(fd, &sb);
+    if (replayed < 0 || pread(fd, &sb, sizeof(sb), 0) != sizeof(sb) ||
+        !sane(&sb)) {
+      fprintf(stderr, "fsck.nufs: %s: can't replay the journal\n", path);
+      return EXIT_FAILED;
+    }
+    if (replayed > 0 && verbose) {
+      printf("replayed %d blocks from the journal\n", replayed);
+    }
+  }
+  else if (journal_pending(fd, &sb) != 0) {
+    printf("the journal holds changes that aren't written back yet; what "
+           "follows may be out of date (-y replays them)\n");
+  }
+
+  struct stat st;
+  fstat(fd, &st);
+  if (st.st_size < (off_t) sb.block_count * sb.block_size) {
+    // Mounting would extend it with zeros too
+    problem(repair, "the image is shorter than its %u blocks%s",
+            sb.block_count, repair ? "; extending it" : "");
+    if (repair && ftruncate(fd, (off_t) sb.block_count * sb.block_size) != 0) {
+      perror("fsck.nufs: ftruncate");
+      return EXIT_FAILED;
+    }
+    if (!repair) {
+      return EXIT_ERRORS;
+    }
+  }
+
+  opts.block_size = sb.block_size;
+  opts.readonly = !repair;
+  dev = blockdev_open(path, &opts);
+  if (dev == NULL) {
+    fprintf(stderr, "fsck.nufs: %s: %s\n", path, strerror(errno));
+    return EXIT_FAILED;
+  }
+
+  double start = now(), mark = start;
+  block_bitmap = read_bitmap(sb.block_bitmap_start, sb.block_bitmap_blocks);
+  inode_bitmap = read_bitmap(sb.inode_bitmap_start, sb.inode_bitmap_blocks);
+  istate = calloc(sb.inode_count, 1);
+  links = calloc(sb.inode_count, sizeof(uint32_t));
+  claims = calloc(sb.max_blocks, sizeof(uint32_t));
+  kinds = calloc(sb.max_blocks, 1);
+
+  run_parallel(check_inodes, sb.inode_count);
+  if (verbose) {
+    printf("pass 1: inodes checked in %.3f s\n", now() - mark);
+  }
+  mark = now();
+
+  if (istate[0] != (I_USED | I_DIR)) {
+    printf("the root directory is missing or broken; can't go on\n");
+    return EXIT_ERRORS;
+  }
+  istate[0] |= I_REACHED;
+  frontier = malloc(sb.inode_count * sizeof(int));
+  next_level = malloc(sb.inode_count * sizeof(int));
+  frontier[0] = 0;
+  uint32_t levelCount = 1;
+  while (levelCount > 0) {
+    next_count = 0;
+    run_parallel(scan_dirs, levelCount);
+    int *t = frontier;
+    frontier = next_level;
+    next_level = t;
+    levelCount = next_count;
+  }
+  find_lost();
+  if (verbose) {
+    printf("pass 2: directories walked in %.3f s\n", now() - mark);
+  }
+  mark = now();
+
+  run_parallel(claim_blocks, sb.inode_count);
+  used = calloc(sb.block_bitmap_blocks, sb.block_size);
+  bitmap_put_range(used, 0, sb.data_start, 1);
+  uint32_t conflicts = 0, shared = 0;
+  for (uint32_t b = sb.data_start; b < sb.block_count; b++) {
+    if (claims[b] > 0) {
+      bitmap_put(used, b, 1);
+    }
+    conflicts += conflict(b);
+    shared += claims[b] > 1 && !conflict(b);
+  }
+
+  // Rare enough to sort out on one thread, in inode order, so the same
+  // inodes keep their blocks every time
+  if (conflicts > 0) {
+    owned = calloc(sb.block_bitmap_blocks, sb.block_size);
+    for (uint32_t inum = 0; inum < sb.inode_count; inum++) {
+      if (kept(inum)) {
+        walk_inode(inum, unshare);
+      }
+    }
+  }
+  if (verbose) {
+    printf("pass 3: blocks counted in %.3f s; %u shared by deduplication\n",
+           now() - mark, shared);
+  }
+  mark = now();
+
+  run_parallel(check_refs, sb.inode_count);
+
+  uint32_t leaked = diff_blocks(1, "are marked used but nothing uses them");
+  if (leaked) {
+    problem(repair, "%u blocks are marked used but nothing uses them%s",
+            leaked, repair ? "; freeing them" : "");
+  }
+  uint32_t lost = diff_blocks(0, "are in use but marked free");
+  if (lost) {
+    problem(repair, "%u blocks are in use but marked free%s", lost,
+            repair ? "; marking them used" : "");
+  }
+
+  uint8_t *inodes = calloc(sb.inode_bitmap_blocks, sb.block_size);
+  uint32_t inodesUsed = 0;
+  for (uint32_t inum = 0; inum < sb.inode_count; inum++) {
+    if (kept(inum)) {
+      bitmap_put(inodes, inum, 1);
+      inodesUsed++;
+    }
+  }
+  uint32_t blocksUsed = bitmap_count(used, sb.block_count);
+
+  if (repair) {
+    write_bitmap(sb.block_bitmap_start, sb.block_bitmap_blocks, block_bitmap,
+                 used);
+    write_bitmap(sb.inode_bitmap_start, sb.inode_bitmap_blocks, inode_bitmap,
+                 inodes);
+
+    // A mount recounts these, so stale ones aren't an error. The orphans
+    // are gone now too.
+    superblock_t *msb = blockdev_get(dev, 0);
+    if (msb && (msb->free_blocks != sb.block_count - blocksUsed ||
+                msb->free_inodes != sb.inode_count - inodesUsed ||
+                msb->orphans != 0)) {
+      msb->free_blocks = sb.block_count - blocksUsed;
+      msb->free_inodes = sb.inode_count - inodesUsed;
+      msb->orphans = 0;
+      changed(0);
+    }
+    if (msb) {
+      blockdev_put(dev, 0);
+    }
+  }
+  if (verbose) {
+    printf("pass 4: counts compared in %.3f s\n", now() - mark);
+  }
+
+  if (blockdev_close(dev) != 0 ||
+      (changes > 0 && journal_discard(fd, &sb) != 0)) {
+    fprintf(stderr, "fsck.nufs: %s: can't write the repairs: %s\n", path,
+            strerror(errno));
+    return EXIT_FAILED;
+  }
+  close(fd);
+
+  printf("%s: %u/%u inodes, %u/%u blocks, checked in %.2f s with %d "
+         "thread%s\n",
+         path, inodesUsed, sb.inode_count, blocksUsed, sb.block_count,
+         now() - start, threads, threads == 1 ? "" : "s");
+  if (errors == 0) {
+    printf("%s: clean\n", path);
+    return EXIT_CLEAN;
+  }
+  printf("%s: %lu error%s, %lu left\n", path, (unsigned long) errors,
+         errors == 1 ? "" : "s", (unsigned long) unfixed);
+  return unfixed ? EXIT_ERRORS : EXIT_FIXED;
+}
@@ -5,13 +5,38 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <dirent.h>
-#include <bsd/string.h>
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
 #include "storage.h"
 #include "inode.h"
 #include "bitmap.h"
-#define FUSE_USE_VERSION 26
-#include <fuse.h>
+#include "chunk.h"
+#include "dedup.h"
+#include "flush.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
+
+static int inode_cursor = 0; // where the next allocation search starts
+static pthread_mutex_t inode_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// One reader/writer lock per inode, kept in memory only
+static pthread_rwlock_t *inode_locks = NULL;
+static int inode_lock_count = 0;
+
+// What the kernel holds of each inode through the low-level frontend, also
+// in memory only. lookups and orphan change under the inode's lock.
+typedef struct inode_hold {
+  uint64_t lookups;    // FUSE's lookup count
+  uint32_t generation; // changes whenever the inode is freed
+  int orphan;          // no names left; freed with the last lookup
+} inode_hold_t;
+
+static inode_hold_t *inode_holds = NULL;
 
 // Print the inode data
 void print_inode(inode_t *node) {
@@ -19,85 +44,378 @@ void print_inode(inode_t *node) {
   printf("refs: %d\n", node->refs);
   printf("mode: 0x%X\n", node->mode);
   printf("size: %d\n", node->size);
-  printf("pointers: %d, %d\n", node->ptr[0], node->ptr[1]);
-  printf("indirect pointer: %d\n", node->iptr);
+  if (node->flags & INODE_INLINE) {
+    printf("inline\n");
+    return;
+  }
+  printf("extents: %d (depth %d)\n", node->extents.hdr.entries,
+         node->extents.hdr.depth);
 }
 
 // Get the inode for the given inum 
 inode_t *get_inode(int inum) {
-  inode_t* inode = get_inode_bitmap() + 32;
+  inode_t* inode = get_inode_table();
 
   return &inode[inum];
 }
 
-// Allocate a new inode and return its inum
-int alloc_inode() {
-  for (int i = 0; i < 256; ++i) {
-    // If inode does not exist, create new one
-    if (!bitmap_get(get_inode_bitmap(), i)) {
-      bitmap_put(get_inode_bitmap(), i, 1);
-      inode_t* newNode = get_inode(i);
-      newNode->refs = 1;
-      newNode->size = 0;
-      newNode->mode = 0;
-      newNode->ptr[0] = alloc_block();
+// Set up a lock and a lookup count for each of count inodes. Called at
+// mount, so allocation starts over from inode 0 and a new image gets its
+// root there.
+void inode_locks_init(int count) {
+  inode_cursor = 0;
+  for (int i = 0; i < inode_lock_count; i++) {
+    pthread_rwlock_destroy(&inode_locks[i]);
+  }
+  free(inode_locks);
+
+  inode_locks = malloc(count * sizeof(pthread_rwlock_t));
+  for (int i = 0; i < count; i++) {
+    pthread_rwlock_init(&inode_locks[i], NULL);
+  }
+  inode_lock_count = count;
+
+  // Start generations from the time, so they differ from the last mount's
+  free(inode_holds);
+  inode_holds = calloc(count, sizeof(inode_hold_t));
+  assert(inode_holds != NULL);
+  uint32_t now = time(NULL);
+  for (int i = 0; i < count; i++) {
+    inode_holds[i].generation = now;
+  }
+}
+
+// Lock the inode for reading
+void inode_read_lock(int inum) {
+  pthread_rwlock_rdlock(&inode_locks[inum]);
+}
+
+// Lock the inode for writing
+void inode_write_lock(int inum) {
+  pthread_rwlock_wrlock(&inode_locks[inum]);
+}
+
+// Release either kind of inode lock
+void inode_unlock(int inum) {
+  pthread_rwlock_unlock(&inode_locks[inum]);
+}
+
+// Allocate a new inode with the given mode and return its inum. Files and
+// symlinks start out with their data inline; directories get block 0.
+int alloc_inode(int mode) {
+  superblock_t *sb = blocks_get_superblock();
+  void *ibm = get_inode_bitmap();
+
+  pthread_mutex_lock(&inode_alloc_lock);
+  if (sb->free_inodes == 0) {
+    pthread_mutex_unlock(&inode_alloc_lock);
+    stats_count(STATS_ALLOC_FAILURES, 1);
+    TRACE(TRACE_ALLOC, ALLOC_INODE, -1, 0, -ENOSPC);
+    return -1;
+  }
+
+  // Next fit, like alloc_block
+  int i = bitmap_find_zero(ibm, inode_cursor, sb->inode_count);
+  if (i < 0) {
+    i = bitmap_find_zero(ibm, 0, inode_cursor);
+  }
+  if (i < 0) {
+    pthread_mutex_unlock(&inode_alloc_lock);
+    return -1;
+  }
+
+  journal_dirty(sb, sizeof(superblock_t));
+  journal_dirty((uint8_t *) ibm + i / 8, 1);
+  bitmap_put(ibm, i, 1);
+  sb->free_inodes--;
+  inode_cursor = i + 1;
+  pthread_mutex_unlock(&inode_alloc_lock);
+  stats_count(STATS_INODE_ALLOCS, 1);
+  TRACE(TRACE_ALLOC, ALLOC_INODE, i, 0, i);
+
+  inode_t* newNode = get_inode(i);
+  journal_dirty(newNode, sizeof(inode_t));
+  memset(newNode, 0, sizeof(inode_t));
+  newNode->refs = 1;
+  newNode->mode = mode;
+  if (!S_ISDIR(mode)) {
+    newNode->flags = INODE_INLINE;
+    return i;
+  }
+
+  extent_init(&newNode->extents);
+  if (inode_alloc_range(newNode, 0, 1) != 0) {
+    newNode->refs = 0;
+    free_inode(i);
+    return -1;
+  }
+
+  return i;
+}
+
+// Add to the superblock's count of orphans
+static void count_orphans(int delta) {
+  superblock_t *sb = blocks_get_superblock();
+  pthread_mutex_lock(&inode_alloc_lock);
+  journal_dirty(sb, sizeof(superblock_t));
+  sb->orphans += delta;
+  pthread_mutex_unlock(&inode_alloc_lock);
+}
 
-      return i;
+// Whether the inode has names, or is kept as an orphan. Called with the
+// inode's lock held.
+int inode_in_use(int inum) {
+  return get_inode(inum)->refs > 0 || inode_holds[inum].orphan;
+}
+
+// Count a reference the kernel takes to the inode. Returns -ENOENT if it
+// has no names left, as nothing can look it up then.
+int inode_hold(int inum) {
+  inode_read_lock(inum);
+  int rv = get_inode(inum)->refs < 1 ? -ENOENT : 0;
+  if (rv == 0) {
+    __atomic_add_fetch(&inode_holds[inum].lookups, 1, __ATOMIC_RELAXED);
+  }
+  inode_unlock(inum);
+  return rv;
+}
+
+// Drop count references the kernel held, freeing the inode with the last
+// of them if it is an orphan. Called inside a journal handle.
+void inode_forget(int inum, uint64_t count) {
+  inode_hold_t *hold = &inode_holds[inum];
+  inode_write_lock(inum);
+  hold->lookups = hold->lookups > count ? hold->lookups - count : 0;
+  if (hold->lookups == 0 && hold->orphan) {
+    hold->orphan = 0;
+    free_inode(inum);
+    count_orphans(-1);
+  }
+  inode_unlock(inum);
+}
+
+// Keep an inode that has just lost its last name if the kernel still holds
+// it, since it may be open. Returns 1 if it is kept as an orphan and 0 if
+// it should be freed now. Called with the inode's write lock held.
+int inode_orphan(int inum) {
+  if (inode_holds[inum].lookups == 0) {
+    return 0;
+  }
+  inode_holds[inum].orphan = 1;
+  count_orphans(1);
+  return 1;
+}
+
+// Free every orphan, once the kernel can't refer to any: at mount, for those
+// left by a crash, and at unmount. Called inside a journal handle.
+void inode_free_orphans() {
+  superblock_t *sb = blocks_get_superblock();
+  if (sb->orphans == 0) {
+    return;
+  }
+
+  void *ibm = get_inode_bitmap();
+  for (int inum = bitmap_find_one(ibm, 0, sb->inode_count); inum >= 0;
+       inum = bitmap_find_one(ibm, inum + 1, sb->inode_count)) {
+    if (get_inode(inum)->refs < 1) {
+      inode_holds[inum].lookups = 0;
+      inode_holds[inum].orphan = 0;
+      free_inode(inum);
     }
   }
+  count_orphans(-(int) sb->orphans);
+}
 
-  return -1;
+// The generation of the inode, which tells its uses of the inum apart
+uint32_t inode_generation(int inum) {
+  return __atomic_load_n(&inode_holds[inum].generation, __ATOMIC_RELAXED);
 }
 
 // Free the inode
 void free_inode(int inum) {
   inode_t* delete_node = get_inode(inum);
   void* b_map = get_inode_bitmap();
-  shrink_inode(delete_node, 0);
-  free_block(delete_node->ptr[0]);
+  if (!(delete_node->flags & INODE_INLINE)) {
+    extent_truncate(&delete_node->extents, 0);
+  }
+  if (delete_node->flags & INODE_COMPRESSED) {
+    chunk_forget(inum);
+  }
+
+  superblock_t *sb = blocks_get_superblock();
+  pthread_mutex_lock(&inode_alloc_lock);
+  journal_dirty(sb, sizeof(superblock_t));
+  journal_dirty((uint8_t *) b_map + inum / 8, 1);
   bitmap_put(b_map, inum, 0);
+  sb->free_inodes++;
+  pthread_mutex_unlock(&inode_alloc_lock);
+  __atomic_add_fetch(&inode_holds[inum].generation, 1, __ATOMIC_RELAXED);
+  stats_count(STATS_INODE_FREES, 1);
+  TRACE(TRACE_ALLOC, FREE_INODE, inum, 0, 0);
 }
 
-// Increase size of the given inode
+// Increase size of the given inode. The new range is a hole; blocks are
+// only allocated when something is written there.
 int grow_inode(inode_t *node, int size) {
-  int base = (node->size / 4096) + 1;
-  for (int i = base; i <= size / 4096; i++) {
-    if (i >= 2) {
-      if (node->iptr == 0) {
-	node->iptr = alloc_block();
-      }
-
-      int* dir = blocks_get_block(node->iptr);
-      dir[i - 2] = alloc_block();
-    }
-    else {
-      node->ptr[i] = alloc_block();
+  if (size > (int) INODE_INLINE_SIZE) {
+    int rv = inode_promote(node);
+    if (rv != 0) {
+      return rv;
     }
   }
 
+  journal_dirty(node, sizeof(inode_t));
   node->size = size;
 
   return 0;
 }
 
-// Shrink size of the given inode
-int shrink_inode(inode_t *node, int size) {
-  int base = node->size / 4096;
-  for (int i = base; i > size / 4096; i--) {
-    if (i >= 2) {
-      int* dir = blocks_get_block(node->iptr);
-      free_block(dir[i - 2]);
-      dir[i - 2] = 0;
-
-      if (i == 2) {
-	free_block(node->iptr);
-	node->iptr = 0;
+// inode_promote for compressed files: the inline data becomes chunk 0
+static int promote_chunk(inode_t *node) {
+  char data[INODE_INLINE_SIZE];
+  memcpy(data, node->inline_data, node->size);
+
+  journal_dirty(node, sizeof(inode_t));
+  node->flags &= ~INODE_INLINE;
+  memset(node->inline_data, 0, INODE_INLINE_SIZE);
+  extent_init(&node->extents);
+
+  int rv = node->size > 0 ? chunk_store(node, 0, data, node->size) : 0;
+  return rv < 0 ? rv : 0;
+}
+
+// Move inline data out to a block, switching the inode to an extent tree.
+// Does nothing if the data is already in blocks.
+int inode_promote(inode_t *node) {
+  if (!(node->flags & INODE_INLINE)) {
+    return 0;
+  }
+  if (node->flags & INODE_COMPRESSED) {
+    return promote_chunk(node);
+  }
+
+  int bnum = 0;
+  if (node->size > 0) {
+    int got;
+    bnum = S_ISREG(node->mode) ? alloc_data_blocks(1, 0, &got) : alloc_block();
+    if (bnum < 0) {
+      return -ENOSPC;
+    }
+    char *block = blocks_get_block(bnum);
+    memset(block, 0, BLOCK_SIZE);
+    memcpy(block, node->inline_data, node->size);
+    flush_mark(bnum, 1);
+  }
+
+  journal_dirty(node, sizeof(inode_t));
+  node->flags &= ~INODE_INLINE;
+  memset(node->inline_data, 0, INODE_INLINE_SIZE);
+  extent_init(&node->extents);
+  if (bnum != 0) {
+    extent_insert(&node->extents, 0, bnum, 1);
+  }
+
+  return 0;
+}
+
+// Allocate zeroed blocks for the holes in file blocks [lblk, end)
+int inode_alloc_range(inode_t *node, int lblk, int end) {
+  int rv = inode_promote(node);
+  if (rv != 0) {
+    return rv;
+  }
+
+  while (lblk < end) {
+    int pnum;
+    int run = inode_map_blocks(node, lblk, &pnum);
+    if (run > end - lblk) {
+      run = end - lblk;
+    }
+
+    // Fill the unmapped stretch with runs placed right after the block
+    // before it, so files written sequentially stay contiguous
+    if (pnum == 0) {
+      int goal = 0;
+      if (lblk > 0 && inode_map_blocks(node, lblk - 1, &goal) > 0 && goal) {
+        goal++;
       }
-      else {
-	free_block(node->ptr[i]);
-	node->ptr[i] = 0;
+      for (int done = 0; done < run;) {
+        int got;
+        int first = S_ISREG(node->mode)
+                        ? alloc_data_blocks(run - done, goal, &got)
+                        : alloc_blocks(run - done, goal, &got);
+        if (first < 0) {
+          return -ENOSPC;
+        }
+        memset(blocks_get_block(first), 0, (size_t) got * BLOCK_SIZE);
+        flush_mark(first, got);
+        if (extent_insert(&node->extents, lblk + done, first, got) != 0) {
+          free_blocks(first, got);
+          return -ENOSPC;
+        }
+        done += got;
+        goal = first + got;
       }
     }
+
+    lblk += run;
+  }
+
+  return 0;
+}
+
+// Count the blocks allocated to the given inode
+int inode_count_blocks(inode_t *node) {
+  int count = 0;
+  int end = inode_end_lblk(node);
+  for (int lblk = 0; lblk < end;) {
+    int pnum;
+    int run = inode_map_blocks(node, lblk, &pnum);
+    if (run > end - lblk) {
+      run = end - lblk;
+    }
+    if (pnum != 0) {
+      count += run;
+    }
+    lblk += run;
+  }
+
+  return count;
+}
+
+// Get the logical block the given inode's mapping ends before
+int inode_end_lblk(inode_t *node) {
+  if (node->flags & INODE_COMPRESSED) {
+    return ((long) node->size + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SPAN;
+  }
+
+  return bytes_to_blocks(node->size);
+}
+
+// Shrink size of the given inode
+int shrink_inode(inode_t *node, int size) {
+  journal_dirty(node, sizeof(inode_t));
+  if (node->flags & INODE_INLINE) {
+    memset(node->inline_data + size, 0, node->size - size);
+    node->size = size;
+    return 0;
+  }
+  if (node->flags & INODE_COMPRESSED) {
+    return chunk_truncate(node, size);
+  }
+
+  extent_truncate(&node->extents, bytes_to_blocks(size));
+
+  // Clear the rest of the new last block so growing again reads zeros. A
+  // shared block gets copied first.
+  int tail = size % BLOCK_SIZE;
+  int bnum = tail != 0 ? dedup_own(node, size / BLOCK_SIZE) : 0;
+  if (bnum < 0) {
+    return bnum;
+  }
+  if (bnum != 0) {
+    memset((char *) blocks_get_block(bnum) + tail, 0, BLOCK_SIZE - tail);
+    flush_mark(bnum, 1);
   }
   node->size = size;
 
@@ -106,14 +424,25 @@ int shrink_inode(inode_t *node, int size) {
 
 // Get the pnum of the given inode
 int inode_get_bnum(inode_t *node, int fpn) {
-  int count = fpn / 4096;
+  int bnum;
+  inode_map_blocks(node, fpn / BLOCK_SIZE, &bnum);
 
-  if (count >= 2) {
-    int* dir = blocks_get_block(node->iptr);
+  return bnum;
+}
 
-    return dir[count - 2];
-  }
-  else {
-    return node->ptr[count];
+// Map the given file block to its pnum. Returns how many blocks from there
+// on are stored contiguously (or, for unmapped blocks, how many are missing).
+int inode_map_blocks(inode_t *node, int lblk, int *bnum) {
+  // keep byte counts derived from the run within an int
+  uint32_t limit = INT_MAX / BLOCK_SIZE;
+  if (node->flags & INODE_INLINE) {
+    *bnum = 0;
+    return limit;
   }
+
+  uint32_t pblk;
+  uint32_t run = extent_lookup(&node->extents, lblk, &pblk);
+  *bnum = pblk;
+
+  return run < limit ? run : limit;
 }
@@ -8,25 +8,72 @@
 #define INODE_H
 
 #include "blocks.h"
+#include "extent.h"
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include <time.h>
 
+#define INODE_DIR_HASHED 0x1 // directory uses the hashed index format
+#define INODE_INLINE 0x2     // data is stored in the inode, not in blocks
+#define INODE_COMPRESSED 0x4 // data is stored in compressed chunks
+
+#define INODE_SIZE 256
+#define INODE_INLINE_SIZE (INODE_SIZE - 16 - 3 * sizeof(time_t))
+#define INODE_MAX_SIZE INT_MAX // sizes are kept in an int; writes past fail
+
+// Small files and symlinks keep their data in the inode itself until it
+// outgrows INODE_INLINE_SIZE bytes, so they take no blocks of their own.
+// Bytes of inline_data past size are always zero.
 typedef struct inode {
   int refs;  // reference count
   int mode;  // permission & type
   int size;  // bytes
-  int ptr[2]; // single block pointer (if max file size <= 4K)
-  int iptr;
+  int flags; // INODE_* flags
   time_t create_time;
   time_t access_time;
   time_t modification_time;
+  union {
+    extent_root_t extents; // block mapping, see extent.h
+    char inline_data[INODE_INLINE_SIZE];
+  };
 } inode_t;
 
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode_t must be INODE_SIZE");
+// The inode table starts on a block boundary, so this keeps every inode in
+// cache lines of its own
+_Static_assert(INODE_SIZE % 64 == 0, "inodes must fill whole cache lines");
+
+// Callers hold the inode's write lock while changing it (or the directory's,
+// for directory_put/directory_delete) and its read lock while reading it.
+void inode_locks_init(int count);
+void inode_read_lock(int inum);
+void inode_write_lock(int inum);
+void inode_unlock(int inum);
+
+// The kernel's references to inodes through the low-level frontend (FUSE's
+// lookup count), kept in memory. An inode that loses its last name while
+// referenced, say because it is open, stays allocated as an orphan until
+// the kernel forgets it; the superblock counts orphans, so that a mount can
+// free those left behind.
+int inode_in_use(int inum);
+int inode_hold(int inum);
+void inode_forget(int inum, uint64_t count);
+int inode_orphan(int inum);
+void inode_free_orphans();
+uint32_t inode_generation(int inum);
+
 void print_inode(inode_t *node);
 inode_t *get_inode(int inum);
-int alloc_inode();
+int alloc_inode(int mode);
 void free_inode();
 int grow_inode(inode_t *node, int size);
 int shrink_inode(inode_t *node, int size);
+int inode_promote(inode_t *node);
+int inode_alloc_range(inode_t *node, int lblk, int end);
+int inode_count_blocks(inode_t *node);
+int inode_end_lblk(inode_t *node);
 int inode_get_bnum(inode_t *node, int fbnum);
+int inode_map_blocks(inode_t *node, int lblk, int *bnum);
 
 #endif
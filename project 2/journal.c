@@ -0,0 +1,690 @@
+// Write-ahead metadata journal. See journal.h.
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "journal.h"
+
+typedef struct free_run {
+  int bnum;
+  int count;
+} free_run_t;
+
+typedef struct transaction {
+  uint64_t seq;
+  int *blocks;       // home blocks dirtied
+  int count;
+  int cap;
+  free_run_t *frees; // runs freed, released once this commits
+  int free_count;
+  int free_cap;
+  long freed;        // blocks in frees
+} transaction_t;
+
+static int journal_fd = -1;
+static int active = 0;
+static uint32_t journal_start;
+static uint32_t journal_blocks;
+static uint32_t data_start;
+static uint64_t next_seq = 1; // after the last transaction found by replay
+
+static transaction_t running;
+static uint8_t *dirty_map;   // blocks dirty in the running transaction
+static uint8_t *private_map; // data blocks mapped privately
+static uint8_t *freeing_map; // blocks freed by the transaction being committed
+
+// Handles hold the barrier shared; a commit holds it exclusively while it
+// takes a copy of the transaction. Writers go first, so a steady stream of
+// handles can't hold a commit off.
+static pthread_rwlock_t barrier;
+static pthread_mutex_t txn_lock = PTHREAD_MUTEX_INITIALIZER; // guards running
+
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+static uint64_t commit_wanted; // highest seq someone waits for
+static uint64_t committed;     // seq of the last transaction on disk
+static int stopping;
+static int commit_busy; // the commit thread is in do_commit
+static pthread_t commit_thread;
+
+static __thread int handle_depth;
+static __thread int is_commit_thread;
+
+// FNV-1a over 64-bit words; len is a multiple of the block size
+static uint64_t checksum(const void *data, size_t len) {
+  const uint64_t *word = data;
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < len / 8; i++) {
+    hash = (hash ^ word[i]) * 1099511628211ull;
+  }
+
+  return hash;
+}
+
+// Blocks taken by the header and home block list of a transaction
+static uint32_t header_blocks(uint32_t count, uint32_t block_size) {
+  size_t bytes = sizeof(journal_header_t) + (size_t) count * sizeof(uint32_t);
+  return (bytes + block_size - 1) / block_size;
+}
+
+static int write_all(int fd, const void *buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t rv = pwrite(fd, buf, len, offset);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      return -1;
+    }
+    buf = (const char *) buf + rv;
+    len -= rv;
+    offset += rv;
+  }
+
+  return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t rv = pread(fd, buf, len, offset);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      return -1;
+    }
+    buf = (char *) buf + rv;
+    len -= rv;
+    offset += rv;
+  }
+
+  return 0;
+}
+
+// Write the images in a log to their home blocks, which are sorted, one
+// contiguous run at a time
+static int write_home(int fd, const uint32_t *homes, uint32_t count,
+                      const char *images, uint32_t block_size) {
+  for (uint32_t i = 0; i < count;) {
+    uint32_t run = 1;
+    while (i + run < count && homes[i + run] == homes[i] + run) {
+      run++;
+    }
+    if (write_all(fd, images + (size_t) i * block_size,
+                  (size_t) run * block_size,
+                  (off_t) homes[i] * block_size) != 0) {
+      return -1;
+    }
+    i += run;
+  }
+
+  return 0;
+}
+
+// Read the last transaction in the journal of the image open as fd into a
+// new buffer in *log. Fills in hdr as far as it gets. Returns 1 if the
+// transaction is complete, 0 if there is none (or one a crash cut short)
+// and -1 on error.
+static int read_log(int fd, const superblock_t *sb, journal_header_t *hdr,
+                    char **log) {
+  uint32_t bs = sb->block_size;
+  *log = NULL;
+  if (sb->journal_blocks == 0) {
+    return 0;
+  }
+
+  off_t start = (off_t) sb->journal_start * bs;
+  if (read_all(fd, hdr, sizeof(*hdr), start) != 0 ||
+      hdr->magic != JOURNAL_MAGIC) {
+    return 0;
+  }
+
+  uint32_t hblocks = header_blocks(hdr->blocks, bs);
+  if (hblocks + hdr->blocks > sb->journal_blocks) {
+    return 0;
+  }
+  size_t len = (size_t) (hblocks + hdr->blocks) * bs;
+  char *buf = malloc(len);
+  if (buf == NULL || read_all(fd, buf, len, start) != 0) {
+    free(buf);
+    return -1;
+  }
+
+  // A commit cut short by a crash doesn't add up; its blocks never left
+  // the journal, so the image still holds the commit before it
+  journal_header_t *lhdr = (journal_header_t *) buf;
+  lhdr->checksum = 0;
+  uint32_t *homes = (uint32_t *) (lhdr + 1);
+  int valid = checksum(buf, len) == hdr->checksum;
+  for (uint32_t i = 0; valid && i < hdr->blocks; i++) {
+    valid = homes[i] < sb->max_blocks &&
+            (homes[i] < sb->journal_start ||
+             homes[i] >= sb->journal_start + sb->journal_blocks);
+  }
+  if (!valid) {
+    free(buf);
+    return 0;
+  }
+
+  *log = buf;
+  return 1;
+}
+
+int journal_replay(int fd, const superblock_t *sb) {
+  journal_header_t hdr = {0};
+  char *log;
+  int rv = read_log(fd, sb, &hdr, &log);
+  if (hdr.magic == JOURNAL_MAGIC) {
+    next_seq = hdr.seq + 1;
+  }
+  if (rv <= 0) {
+    return rv;
+  }
+
+  uint32_t bs = sb->block_size;
+  rv = write_home(fd, (uint32_t *) ((journal_header_t *) log + 1), hdr.blocks,
+                  log + (size_t) header_blocks(hdr.blocks, bs) * bs, bs);
+  if (rv == 0) {
+    rv = fdatasync(fd);
+  }
+  free(log);
+
+  return rv == 0 ? (int) hdr.blocks : rv;
+}
+
+int journal_pending(int fd, const superblock_t *sb) {
+  journal_header_t hdr = {0};
+  char *log;
+  int rv = read_log(fd, sb, &hdr, &log);
+  if (rv <= 0) {
+    return rv;
+  }
+
+  uint32_t bs = sb->block_size;
+  uint32_t *homes = (uint32_t *) ((journal_header_t *) log + 1);
+  char *images = log + (size_t) header_blocks(hdr.blocks, bs) * bs;
+  char *block = malloc(bs);
+  int pending = 0;
+  for (uint32_t i = 0; !pending && i < hdr.blocks; i++) {
+    // A block past the end of the file was never written home either
+    pending = read_all(fd, block, bs, (off_t) homes[i] * bs) != 0 ||
+              memcmp(block, images + (size_t) i * bs, bs) != 0;
+  }
+  free(block);
+  free(log);
+
+  return pending;
+}
+
+// Zero the first block of the journal, so it holds no transaction
+static int zero_journal(int fd, uint32_t start, uint32_t block_size) {
+  char *zero = calloc(1, block_size);
+  int rv = write_all(fd, zero, block_size, (off_t) start * block_size);
+  if (rv == 0) {
+    rv = fdatasync(fd);
+  }
+  free(zero);
+
+  return rv;
+}
+
+int journal_discard(int fd, const superblock_t *sb) {
+  if (sb->journal_blocks == 0) {
+    return 0;
+  }
+
+  return zero_journal(fd, sb->journal_start, sb->block_size);
+}
+
+// Bits that other threads may test without taking txn_lock
+static int map_test(uint8_t *map, int bit) {
+  return (__atomic_load_n(&map[bit / 8], __ATOMIC_ACQUIRE) >> (bit % 8)) & 1;
+}
+
+static void map_set(uint8_t *map, int bit) {
+  __atomic_or_fetch(&map[bit / 8], 1 << (bit % 8), __ATOMIC_RELEASE);
+}
+
+static int cmp_int(const void *a, const void *b) {
+  int x = *(const int *) a;
+  int y = *(const int *) b;
+  return (x > y) - (x < y);
+}
+
+// Release the blocks a committed transaction freed, sharing any that held
+// metadata again so file data written to them reaches the image
+static void release_frees(transaction_t *txn) {
+  journal_begin();
+  for (int i = 0; i < txn->free_count; i++) {
+    int first = txn->frees[i].bnum;
+    int end = first + txn->frees[i].count;
+
+    pthread_mutex_lock(&txn_lock);
+    int b = bitmap_find_one(private_map, first, end);
+    while (b >= 0) {
+      int stop = bitmap_find_zero(private_map, b, end);
+      if (stop < 0) {
+        stop = end;
+      }
+      blocks_set_private(b, stop - b, 0);
+      bitmap_put_range(private_map, b, stop - b, 0);
+      b = stop < end ? bitmap_find_one(private_map, stop, end) : -1;
+    }
+    pthread_mutex_unlock(&txn_lock);
+
+    blocks_release(first, end - first);
+  }
+  journal_end();
+}
+
+// Invalidate the log, so nothing is replayed at the next mount
+static int journal_clear() {
+  return zero_journal(journal_fd, journal_start, BLOCK_SIZE);
+}
+
+// Write a transaction's log to the journal, then its blocks to their homes
+static void write_log(char *log, uint64_t seq, int count) {
+  uint32_t bs = BLOCK_SIZE;
+  uint32_t hblocks = header_blocks(count, bs);
+  journal_header_t *hdr = (journal_header_t *) log;
+  uint32_t *homes = (uint32_t *) (hdr + 1);
+  char *images = log + (size_t) hblocks * bs;
+  size_t len = (size_t) (hblocks + count) * bs;
+
+  int rv = 0;
+  if (hblocks + count <= journal_blocks) {
+    hdr->magic = JOURNAL_MAGIC;
+    hdr->blocks = count;
+    hdr->seq = seq;
+    hdr->checksum = 0;
+    hdr->checksum = checksum(log, len);
+    rv = write_all(journal_fd, log, len, (off_t) journal_start * bs);
+    if (rv == 0) {
+      rv = fdatasync(journal_fd);
+    }
+  } else {
+    // Can't be made atomic; only a single enormous operation gets here.
+    // The last log must not be replayed over what follows.
+    fprintf(stderr, "nufs: %d blocks do not fit in the journal\n", count);
+    rv = journal_clear();
+  }
+
+  if (rv == 0) {
+    rv = write_home(journal_fd, homes, count, images, bs);
+  }
+  if (rv == 0) {
+    rv = fdatasync(journal_fd);
+  }
+  if (rv != 0) {
+    perror("nufs: journal commit");
+  }
+}
+
+// Find the copy of a home block among count sorted ones
+static char *find_image(const int *homes, char *images, int count, int bnum) {
+  int *found = bsearch(&bnum, homes, count, sizeof(int), cmp_int);
+  assert(found != NULL);
+  return images + (size_t) (found - homes) * BLOCK_SIZE;
+}
+
+// The blocks a transaction frees stay allocated in memory until it has
+// committed, but are free in what it commits, so a crash can't leak them.
+// journal_defer_free put the superblock and the bitmap blocks concerned in
+// the transaction.
+static void commit_frees(transaction_t *txn, char *images, int count) {
+  if (txn->free_count == 0) {
+    return;
+  }
+
+  superblock_t *sb = blocks_get_superblock();
+  superblock_t *sbImage =
+      (superblock_t *) find_image(txn->blocks, images, count, 0);
+  int bitsPerBlock = BLOCK_SIZE * 8;
+
+  for (int i = 0; i < txn->free_count; i++) {
+    int bnum = txn->frees[i].bnum;
+    int end = bnum + txn->frees[i].count;
+    while (bnum < end) {
+      int mapBlock = bnum / bitsPerBlock;
+      int stop = (mapBlock + 1) * bitsPerBlock;
+      if (stop > end) {
+        stop = end;
+      }
+      char *map = find_image(txn->blocks, images, count,
+                             sb->block_bitmap_start + mapBlock);
+      sbImage->free_blocks += bitmap_put_range(
+          map, bnum - mapBlock * bitsPerBlock, stop - bnum, 0);
+      bnum = stop;
+    }
+  }
+}
+
+// Commit the running transaction. Returns 0 if it was empty.
+static int do_commit() {
+  pthread_rwlock_wrlock(&barrier);
+  transaction_t txn = running;
+  memset(&running, 0, sizeof(running));
+  __atomic_store_n(&running.seq, txn.seq + 1, __ATOMIC_RELAXED);
+
+  int busy = txn.count > 0 || txn.free_count > 0;
+  char *log = NULL;
+  int count = 0;
+  if (busy) {
+    // Blocks freed here don't matter once this commits, and must not be
+    // written home, where they may soon hold file data
+    for (int i = 0; i < txn.free_count; i++) {
+      bitmap_put_range(freeing_map, txn.frees[i].bnum, txn.frees[i].count, 1);
+    }
+    qsort(txn.blocks, txn.count, sizeof(int), cmp_int);
+    for (int i = 0; i < txn.count; i++) {
+      bitmap_put(dirty_map, txn.blocks[i], 0);
+      if (!bitmap_get(freeing_map, txn.blocks[i])) {
+        txn.blocks[count++] = txn.blocks[i];
+      }
+    }
+    for (int i = 0; i < txn.free_count; i++) {
+      bitmap_put_range(freeing_map, txn.frees[i].bnum, txn.frees[i].count, 0);
+    }
+
+    uint32_t hblocks = header_blocks(count, BLOCK_SIZE);
+    log = calloc(hblocks + count, BLOCK_SIZE);
+    assert(log != NULL);
+    uint32_t *homes = (uint32_t *) ((journal_header_t *) log + 1);
+    for (int i = 0; i < count; i++) {
+      homes[i] = txn.blocks[i];
+      memcpy(log + (size_t) (hblocks + i) * BLOCK_SIZE,
+             blocks_get_block(txn.blocks[i]), BLOCK_SIZE);
+    }
+    commit_frees(&txn, log + (size_t) hblocks * BLOCK_SIZE, count);
+  }
+  pthread_rwlock_unlock(&barrier);
+
+  if (busy) {
+    write_log(log, txn.seq, count);
+    free(log);
+    release_frees(&txn);
+  }
+  free(txn.blocks);
+  free(txn.frees);
+
+  pthread_mutex_lock(&commit_lock);
+  committed = txn.seq;
+  pthread_cond_broadcast(&commit_done);
+  pthread_mutex_unlock(&commit_lock);
+
+  return busy;
+}
+
+// Whether the running transaction should be committed before its time
+static int txn_big() {
+  return __atomic_load_n(&running.count, __ATOMIC_RELAXED) >
+             (int) journal_blocks / 2 ||
+         __atomic_load_n(&running.freed, __ATOMIC_RELAXED) > JOURNAL_FREE_BATCH;
+}
+
+static void *commit_main(void *arg) {
+  is_commit_thread = 1;
+
+  pthread_mutex_lock(&commit_lock);
+  while (!stopping) {
+    if (commit_wanted <= committed && !txn_big()) {
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec += JOURNAL_COMMIT_MS / 1000;
+      until.tv_nsec += (JOURNAL_COMMIT_MS % 1000) * 1000000L;
+      if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&commit_wake, &commit_lock, &until);
+    }
+    commit_busy = 1;
+    pthread_mutex_unlock(&commit_lock);
+    do_commit();
+    pthread_mutex_lock(&commit_lock);
+    commit_busy = 0;
+    pthread_cond_broadcast(&commit_done);
+  }
+  pthread_mutex_unlock(&commit_lock);
+
+  // Releasing freed blocks dirties the bitmap again, so keep going until
+  // nothing is left
+  while (do_commit()) {
+  }
+
+  return NULL;
+}
+
+// FUSE forks to go into the background after the image is opened, and
+// only the forking thread survives a fork. Fork while the commit thread is
+// idle, then start it again in the child.
+static void fork_prepare() {
+  if (!active) {
+    return;
+  }
+  pthread_mutex_lock(&commit_lock);
+  while (commit_busy) {
+    pthread_cond_wait(&commit_done, &commit_lock);
+  }
+}
+
+static void fork_parent() {
+  if (active) {
+    pthread_mutex_unlock(&commit_lock);
+  }
+}
+
+static void fork_child() {
+  if (!active) {
+    return;
+  }
+  pthread_mutex_unlock(&commit_lock);
+  pthread_cond_init(&commit_wake, NULL);
+  pthread_cond_init(&commit_done, NULL);
+  int rv = pthread_create(&commit_thread, NULL, commit_main, NULL);
+  assert(rv == 0);
+}
+
+static void register_atfork() {
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+void journal_init(int fd) {
+  superblock_t *sb = blocks_get_superblock();
+  if (sb->journal_blocks == 0) {
+    return;
+  }
+
+  journal_fd = fd;
+  journal_start = sb->journal_start;
+  journal_blocks = sb->journal_blocks;
+  data_start = sb->data_start;
+
+  size_t map_bytes = sb->max_blocks / 8;
+  dirty_map = calloc(map_bytes, 1);
+  private_map = calloc(map_bytes, 1);
+  freeing_map = calloc(map_bytes, 1);
+  assert(dirty_map && private_map && freeing_map);
+
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&barrier, &attr);
+  pthread_rwlockattr_destroy(&attr);
+
+  memset(&running, 0, sizeof(running));
+  running.seq = next_seq;
+  committed = next_seq - 1;
+  commit_wanted = committed;
+  stopping = 0;
+  commit_busy = 0;
+  active = 1;
+
+  static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+  pthread_once(&atfork_once, register_atfork);
+
+  int rv = pthread_create(&commit_thread, NULL, commit_main, NULL);
+  assert(rv == 0);
+}
+
+void journal_stop() {
+  if (!active) {
+    return;
+  }
+
+  pthread_mutex_lock(&commit_lock);
+  stopping = 1;
+  pthread_cond_signal(&commit_wake);
+  pthread_mutex_unlock(&commit_lock);
+  pthread_join(commit_thread, NULL);
+
+  // Everything is home, so there is nothing to replay at the next mount
+  if (journal_clear() != 0) {
+    perror("nufs: journal");
+  }
+
+  active = 0;
+  next_seq = running.seq;
+  free(running.blocks);
+  free(running.frees);
+  free(dirty_map);
+  free(private_map);
+  free(freeing_map);
+  pthread_rwlock_destroy(&barrier);
+}
+
+void journal_commit() {
+  if (!active) {
+    return;
+  }
+  assert(handle_depth == 0);
+
+  pthread_mutex_lock(&commit_lock);
+  uint64_t seq = __atomic_load_n(&running.seq, __ATOMIC_RELAXED);
+  if (commit_wanted < seq) {
+    commit_wanted = seq;
+  }
+  pthread_cond_signal(&commit_wake);
+  while (committed < seq) {
+    pthread_cond_wait(&commit_done, &commit_lock);
+  }
+  pthread_mutex_unlock(&commit_lock);
+}
+
+void journal_begin() {
+  if (!active || handle_depth++ > 0) {
+    return;
+  }
+
+  // Let the commit thread catch up before the transaction outgrows the
+  // journal
+  if (!is_commit_thread) {
+    while (__atomic_load_n(&running.count, __ATOMIC_RELAXED) >
+           (int) journal_blocks * 3 / 4) {
+      handle_depth = 0;
+      journal_commit();
+      handle_depth = 1;
+    }
+  }
+
+  pthread_rwlock_rdlock(&barrier);
+}
+
+void journal_end() {
+  if (!active || --handle_depth > 0) {
+    return;
+  }
+  pthread_rwlock_unlock(&barrier);
+
+  if (!is_commit_thread && txn_big()) {
+    pthread_mutex_lock(&commit_lock);
+    pthread_cond_signal(&commit_wake);
+    pthread_mutex_unlock(&commit_lock);
+  }
+}
+
+// Add a block to the running transaction
+static void add_dirty(int bnum) {
+  pthread_mutex_lock(&txn_lock);
+  if (!map_test(dirty_map, bnum)) {
+    if (running.count == running.cap) {
+      running.cap = running.cap ? running.cap * 2 : 64;
+      running.blocks = realloc(running.blocks, running.cap * sizeof(int));
+      assert(running.blocks != NULL);
+    }
+    running.blocks[running.count] = bnum;
+    __atomic_store_n(&running.count, running.count + 1, __ATOMIC_RELAXED);
+
+    // A data block now holding metadata has to stop going to the file
+    if ((uint32_t) bnum >= data_start && !bitmap_get(private_map, bnum)) {
+      blocks_set_private(bnum, 1, 1);
+      bitmap_put(private_map, bnum, 1);
+    }
+    map_set(dirty_map, bnum);
+  }
+  pthread_mutex_unlock(&txn_lock);
+}
+
+void journal_dirty(const void *ptr, size_t len) {
+  if (!active || len == 0) {
+    return;
+  }
+
+  // Only blocks of the image are journaled; callers may hand in copies,
+  // like an extent root kept on the stack
+  uintptr_t base = (uintptr_t) blocks_get_block(0);
+  uintptr_t end = base + (uintptr_t) __atomic_load_n(&BLOCK_COUNT,
+                                                     __ATOMIC_RELAXED) *
+                             BLOCK_SIZE;
+  if ((uintptr_t) ptr < base || (uintptr_t) ptr >= end) {
+    return;
+  }
+  if ((uintptr_t) ptr + len > end) {
+    len = end - (uintptr_t) ptr;
+  }
+
+  size_t offset = (uintptr_t) ptr - base;
+  int first = offset / BLOCK_SIZE;
+  int last = (offset + len - 1) / BLOCK_SIZE;
+  for (int bnum = first; bnum <= last; bnum++) {
+    if (!map_test(dirty_map, bnum)) {
+      add_dirty(bnum);
+    }
+  }
+}
+
+int journal_defer_free(int bnum, int count) {
+  if (!active) {
+    return 0;
+  }
+
+  uint8_t *bbm = get_blocks_bitmap();
+  journal_dirty(blocks_get_superblock(), sizeof(superblock_t));
+  journal_dirty(bbm + bnum / 8, (bnum + count - 1) / 8 - bnum / 8 + 1);
+
+  pthread_mutex_lock(&txn_lock);
+  if (running.free_count == running.free_cap) {
+    running.free_cap = running.free_cap ? running.free_cap * 2 : 16;
+    running.frees =
+        realloc(running.frees, running.free_cap * sizeof(free_run_t));
+    assert(running.frees != NULL);
+  }
+  running.frees[running.free_count].bnum = bnum;
+  running.frees[running.free_count].count = count;
+  running.free_count++;
+  __atomic_store_n(&running.freed, running.freed + count, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&txn_lock);
+
+  return 1;
+}
@@ -0,0 +1,87 @@
+// Write-ahead metadata journal.
+//
+// Metadata (the superblock, bitmaps, inode table, directory blocks and
+// extent tree nodes) is never written to the image in place. The metadata
+// region is mapped privately, and so is any data block once it is used for
+// metadata, so changes stay in memory. They reach the image through the
+// journal only.
+//
+// Every operation that changes metadata runs inside a handle
+// (journal_begin/journal_end) and calls journal_dirty on what it changes,
+// before changing it. Handles all join the same running transaction.
+// A commit thread closes the transaction every JOURNAL_COMMIT_MS, or
+// sooner once it gets big. It copies the dirty blocks while no handle is
+// running, then writes them to the journal region with a checksum in one
+// sequential write and syncs that. Only then are they written to their
+// home locations (the checkpoint).
+//
+// After a crash, blocks_init replays the last transaction whose checksum
+// matches, so the metadata is exactly what some commit left behind.
+// Freed blocks are only handed out again once the transaction freeing
+// them has committed. File data is not journaled.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blocks.h"
+
+#define JOURNAL_MAGIC 0x4c4e524a // "JRNL" in little-endian
+#define JOURNAL_COMMIT_MS 1000   // longest a change waits to be committed
+#define JOURNAL_FREE_BATCH 4096  // commit early once this many blocks wait to be freed
+
+// Start of a transaction in the journal region; the home block numbers
+// follow, then (in the next block) the block images themselves.
+typedef struct journal_header {
+  uint32_t magic;
+  uint32_t blocks;   // number of block images
+  uint64_t seq;      // transaction number
+  uint64_t checksum; // over the header blocks and images, taken as 0 here
+} journal_header_t;
+
+// Replay the last complete transaction in the journal of the image open as
+// fd, described by sb, writing it to its home locations. Called before the
+// image is mapped. Returns the number of blocks replayed, or -1 on error.
+int journal_replay(int fd, const superblock_t *sb);
+
+// Check whether the journal of the image open as fd holds a transaction
+// that isn't in its home locations yet, i.e. whether journal_replay would
+// change anything. Returns 1 if so, 0 if not and -1 on error.
+int journal_pending(int fd, const superblock_t *sb);
+
+// Empty the journal of the image open as fd, so that nothing is replayed at
+// the next mount. For tools that change an unmounted image after replaying
+// it, whose changes an older transaction would otherwise undo. Returns 0 on
+// success and -1 on error.
+int journal_discard(int fd, const superblock_t *sb);
+
+// Start journaling the mapped image open as fd. Does nothing if the image
+// has no journal.
+void journal_init(int fd);
+
+// Commit what is left and stop the commit thread.
+void journal_stop();
+
+// Start a handle. Handles nest; only the outermost one counts, and it must
+// be taken before any other lock.
+void journal_begin();
+
+// End a handle.
+void journal_end();
+
+// Add the blocks holding [ptr, ptr + len) of the mapped image to the
+// running transaction. Must be called inside a handle, before the change.
+void journal_dirty(const void *ptr, size_t len);
+
+// Hold on to blocks freed inside a handle until the transaction commits.
+// Returns 0, leaving the caller to free them at once, when the image has
+// no journal.
+int journal_defer_free(int bnum, int count);
+
+// Commit the running transaction and wait until it is on disk. Must not be
+// called inside a handle.
+void journal_commit();
+
+#endif
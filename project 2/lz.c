@@ -0,0 +1,213 @@
+// LZ77 compression. See lz.h.
+
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define HASH_BITS 12
+
+static uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t read64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static int hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Count the bytes from p on that equal those from ref, stopping at end
+static int match_length(const uint8_t *p, const uint8_t *ref,
+                        const uint8_t *end) {
+  const uint8_t *start = p;
+
+  while (end - p >= 8) {
+    uint64_t diff = read64(p) ^ read64(ref);
+    if (diff != 0) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      return p - start + (__builtin_ctzll(diff) >> 3);
+#else
+      return p - start + (__builtin_clzll(diff) >> 3);
+#endif
+    }
+    p += 8;
+    ref += 8;
+  }
+  while (p < end && *p == *ref) {
+    p++;
+    ref++;
+  }
+
+  return p - start;
+}
+
+// Write the bytes continuing a length nibble of 15. Returns the new output
+// position, or NULL if out of room.
+static uint8_t *put_length(uint8_t *op, uint8_t *end, int n) {
+  while (n >= 255) {
+    if (op >= end) {
+      return NULL;
+    }
+    *op++ = 255;
+    n -= 255;
+  }
+  if (op >= end) {
+    return NULL;
+  }
+  *op++ = n;
+
+  return op;
+}
+
+// Write a sequence of litLen literals followed by a match, or by nothing if
+// matchLen is 0. Returns the new output position, or NULL if out of room.
+static uint8_t *put_sequence(uint8_t *op, uint8_t *end, const uint8_t *lit,
+                             int litLen, int offset, int matchLen) {
+  int extra = matchLen ? matchLen - LZ_MIN_MATCH : 0;
+  if (op >= end) {
+    return NULL;
+  }
+  *op++ = (litLen < 15 ? litLen : 15) << 4 | (extra < 15 ? extra : 15);
+
+  if (litLen >= 15 && !(op = put_length(op, end, litLen - 15))) {
+    return NULL;
+  }
+  if (end - op < litLen) {
+    return NULL;
+  }
+  memcpy(op, lit, litLen);
+  op += litLen;
+  if (matchLen == 0) {
+    return op;
+  }
+
+  if (end - op < 2) {
+    return NULL;
+  }
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  if (extra >= 15) {
+    op = put_length(op, end, extra - 15);
+  }
+
+  return op;
+}
+
+int lz_compress(const void *src, int len, void *dst, int cap) {
+  const uint8_t *in = src;
+  uint8_t *op = dst, *end = op + cap;
+  int table[1 << HASH_BITS] = {0}; // last position + 1 with each hash
+  int ip = 0, anchor = 0;
+
+  while (ip <= len - LZ_MIN_MATCH) {
+    uint32_t seq = read32(in + ip);
+    int h = hash(seq);
+    int ref = table[h] - 1;
+    table[h] = ip + 1;
+
+    if (ref < 0 || ip - ref > LZ_MAX_OFFSET || read32(in + ref) != seq) {
+      // Step further the longer nothing has matched, so incompressible
+      // data goes by quickly
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+
+    // The match may start before the position that found it
+    while (ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1]) {
+      ip--;
+      ref--;
+    }
+    int matchLen = LZ_MIN_MATCH + match_length(in + ip + LZ_MIN_MATCH,
+                                               in + ref + LZ_MIN_MATCH,
+                                               in + len);
+
+    op = put_sequence(op, end, in + anchor, ip - anchor, ip - ref, matchLen);
+    if (op == NULL) {
+      return 0;
+    }
+    ip += matchLen;
+    anchor = ip;
+  }
+
+  op = put_sequence(op, end, in + anchor, len - anchor, 0, 0);
+
+  return op ? op - (uint8_t *) dst : 0;
+}
+
+// Add up the bytes continuing a length nibble of 15 onto n. Returns 0, or -1
+// if they run past end.
+static int get_length(const uint8_t **ip, const uint8_t *end, int *n) {
+  while (*ip < end) {
+    int b = *(*ip)++;
+    if (*n > INT_MAX / 2) {
+      return -1;
+    }
+    *n += b;
+    if (b != 255) {
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+int lz_decompress(const void *src, int len, void *dst, int cap) {
+  const uint8_t *ip = src, *end = ip + len;
+  uint8_t *start = dst, *op = start, *limit = op + cap;
+
+  while (ip < end) {
+    int token = *ip++;
+
+    int litLen = token >> 4;
+    if (litLen == 15 && get_length(&ip, end, &litLen) != 0) {
+      return -1;
+    }
+    if (end - ip < litLen || limit - op < litLen) {
+      return -1;
+    }
+    memcpy(op, ip, litLen);
+    op += litLen;
+    ip += litLen;
+
+    // Only the last sequence ends without a match
+    if (ip == end) {
+      break;
+    }
+    if (end - ip < 2) {
+      return -1;
+    }
+    int offset = ip[0] | ip[1] << 8;
+    ip += 2;
+
+    int matchLen = token & 15;
+    if (matchLen == 15 && get_length(&ip, end, &matchLen) != 0) {
+      return -1;
+    }
+    matchLen += LZ_MIN_MATCH;
+    if (offset == 0 || offset > op - start || limit - op < matchLen) {
+      return -1;
+    }
+
+    // A match may overlap the bytes it produces, repeating them
+    const uint8_t *ref = op - offset;
+    if (offset >= matchLen) {
+      memcpy(op, ref, matchLen);
+    }
+    else {
+      for (int i = 0; i < matchLen; i++) {
+        op[i] = ref[i];
+      }
+    }
+    op += matchLen;
+  }
+
+  return op - start;
+}
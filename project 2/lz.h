@@ -0,0 +1,27 @@
+// A small LZ77 codec in the style of LZ4's block format.
+//
+// Compressed data is a series of sequences. Each starts with a token byte
+// whose high nibble is a literal count and low nibble a match length minus
+// LZ_MIN_MATCH; a nibble of 15 continues in following bytes, each added on
+// until one is below 255. The literals follow, then a two byte little-endian
+// offset back into the output for the match. The last sequence has only
+// literals.
+//
+// Matches are found through a single-entry hash table of 4-byte prefixes,
+// which keeps compression fast at some cost in ratio.
+
+#ifndef LZ_H
+#define LZ_H
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+// Compress len bytes of src into dst, which holds cap bytes. Returns the
+// compressed length, or 0 if it would not fit.
+int lz_compress(const void *src, int len, void *dst, int cap);
+
+// Decompress len bytes of src into dst, which holds cap bytes. Returns the
+// decompressed length, or -1 if src is corrupt or doesn't fit.
+int lz_decompress(const void *src, int len, void *dst, int cap);
+
+#endif
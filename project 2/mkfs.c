@@ -0,0 +1,224 @@
+// mkfs.nufs: creates a nufs image ahead of time, with a chosen geometry,
+// instead of the defaults a mount picks for an empty file. The image file
+// is extended with ftruncate and only the superblock, the bitmap bits of
+// the metadata regions and the root directory are written, so even a large
+// image is created in a moment and takes little space until it fills up.
+//
+// Usage: mkfs.nufs [-f] [-b block size] [-s size] [-M max size]
+//                  [-N inodes | -i bytes per inode] [-j journal size]
+//                  [-r reserved percent] image
+//
+// Sizes take a K, M, G or T suffix. The image starts out -s big (by default
+// just big enough for the metadata and a few data blocks) and grows as
+// files are written, up to -M. With -s there is an inode for every 64K of
+// it unless -N or -i say otherwise. -r keeps a share of the data blocks back
+// from file data, so directories can still be changed when the image is
+// full.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "inode.h"
+#include "storage.h"
+
+#define DEFAULT_BYTES_PER_INODE (64 * 1024)
+
+static void usage() {
+  fprintf(stderr,
+          "usage: mkfs.nufs [-f] [-b block size] [-s size] [-M max size]\n"
+          "                 [-N inodes | -i bytes per inode] "
+          "[-j journal size]\n"
+          "                 [-r reserved percent] image\n");
+  exit(2);
+}
+
+// Parse a size like 512, 64K or 10G. Returns -1 if it isn't one.
+static long long parse_size(const char *text) {
+  char *end;
+  long long size = strtoll(text, &end, 10);
+  if (end == text || size < 0) {
+    return -1;
+  }
+
+  const char *units = "KMGT";
+  const char *unit = *end ? strchr(units, *end) : NULL;
+  if (*end && (!unit || end[1] != '\0')) {
+    return -1;
+  }
+  for (const char *u = units; unit && u <= unit; u++) {
+    size *= 1024;
+  }
+  return size;
+}
+
+static long long size_arg(const char *text) {
+  long long size = parse_size(text);
+  if (size < 0) {
+    fprintf(stderr, "mkfs.nufs: bad size '%s'\n", text);
+    usage();
+  }
+  return size;
+}
+
+static double gigabytes(uint64_t blocks, uint32_t bs) {
+  return (double) blocks * bs / (1024.0 * 1024.0 * 1024.0);
+}
+
+int main(int argc, char **argv) {
+  int force = 0;
+  long long blockSize = NUFS_DEFAULT_BLOCK_SIZE;
+  long long size = -1, maxSize = -1, journal = -1;
+  long long inodes = -1, bytesPerInode = DEFAULT_BYTES_PER_INODE;
+  double reserved = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "fb:s:M:N:i:j:r:")) != -1) {
+    switch (opt) {
+    case 'f':
+      force = 1;
+      break;
+    case 'b':
+      blockSize = size_arg(optarg);
+      break;
+    case 's':
+      size = size_arg(optarg);
+      break;
+    case 'M':
+      maxSize = size_arg(optarg);
+      break;
+    case 'N':
+      inodes = atoll(optarg);
+      break;
+    case 'i':
+      bytesPerInode = size_arg(optarg);
+      break;
+    case 'j':
+      journal = size_arg(optarg);
+      break;
+    case 'r':
+      reserved = atof(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc - 1) {
+    usage();
+  }
+  const char *path = argv[optind];
+
+  if (blockSize < 512 || blockSize > (1 << 20) ||
+      (blockSize & (blockSize - 1)) != 0) {
+    fprintf(stderr, "mkfs.nufs: the block size must be a power of two "
+                    "from 512 to 1M\n");
+    return 1;
+  }
+  if (reserved < 0 || reserved >= 50) {
+    fprintf(stderr, "mkfs.nufs: the reserved percentage must be below 50\n");
+    return 1;
+  }
+
+  nufs_geometry_t geo;
+  blocks_default_geometry(&geo);
+  geo.block_size = blockSize;
+
+  // The block bitmap covers the largest size, so it's a multiple of 8
+  long long maxBlocks = maxSize >= 0 ? maxSize / blockSize : geo.max_blocks;
+  long long sizeBlocks = size >= 0 ? size / blockSize : 0;
+  if (maxBlocks < sizeBlocks) {
+    maxBlocks = sizeBlocks;
+  }
+  maxBlocks = (maxBlocks + 7) / 8 * 8;
+  if (maxBlocks > INT32_MAX) {
+    fprintf(stderr, "mkfs.nufs: at most %d blocks of %lld bytes\n",
+            INT32_MAX & ~7, blockSize);
+    return 1;
+  }
+  geo.max_blocks = maxBlocks;
+
+  // One inode per bytesPerInode of the initial size, or as many as images
+  // made at mount get, filling the inode table's blocks
+  if (inodes < 0) {
+    inodes = size >= 0 ? size / (bytesPerInode > 0 ? bytesPerInode : 1)
+                       : NUFS_DEFAULT_INODE_COUNT;
+  }
+  long long perBlock = blockSize / INODE_SIZE > 8 ? blockSize / INODE_SIZE : 8;
+  inodes = inodes > perBlock ? (inodes + perBlock - 1) / perBlock * perBlock
+                             : perBlock;
+  if (inodes > (1 << 26)) {
+    fprintf(stderr, "mkfs.nufs: at most %d inodes\n", 1 << 26);
+    return 1;
+  }
+  geo.inode_count = inodes;
+
+  if (journal >= 0) {
+    geo.journal_blocks = (journal + blockSize - 1) / blockSize;
+  }
+  else if (blockSize != NUFS_DEFAULT_BLOCK_SIZE) {
+    // The same size of journal as with the default blocks
+    geo.journal_blocks = (long long) NUFS_DEFAULT_JOURNAL_BLOCKS *
+                         NUFS_DEFAULT_BLOCK_SIZE / blockSize;
+  }
+
+  // Find out how big the metadata is before sizing the data region
+  superblock_t sb;
+  geo.block_count = 0;
+  if (blocks_layout(&geo, &sb) != 0) {
+    fprintf(stderr, "mkfs.nufs: the metadata doesn't fit in %lld blocks\n",
+            maxBlocks);
+    return 1;
+  }
+  if (geo.journal_blocks > 0 && sb.journal_blocks == 0) {
+    fprintf(stderr, "mkfs.nufs: blocks smaller than a page; no journal\n");
+  }
+  geo.block_count = size >= 0 ? sizeBlocks - (long long) sb.data_start
+                              : NUFS_DEFAULT_BLOCK_COUNT;
+  if (geo.block_count < 1) {
+    fprintf(stderr, "mkfs.nufs: %lld bytes don't leave room for data; the "
+                    "metadata takes %u blocks\n", size, sb.data_start);
+    return 1;
+  }
+  geo.reserved_blocks = (maxBlocks - sb.data_start) * reserved / 100;
+  if (blocks_layout(&geo, &sb) != 0) {
+    fprintf(stderr, "mkfs.nufs: an image of up to %lld blocks can't start "
+                    "with %d data blocks\n", maxBlocks, geo.block_count);
+    return 1;
+  }
+
+  struct stat st;
+  if (!force && stat(path, &st) == 0 && st.st_size > 0) {
+    fprintf(stderr, "mkfs.nufs: %s already exists; use -f to overwrite it\n",
+            path);
+    return 1;
+  }
+  int fd = open(path, O_CREAT | O_RDWR, 0644);
+  if (fd < 0 || blocks_format(fd, &geo) != 0 || fsync(fd) != 0) {
+    fprintf(stderr, "mkfs.nufs: %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  close(fd);
+
+  // Mount it once to create the root directory
+  storage_init(path);
+  blocks_free();
+
+  printf("%s: %u blocks of %u bytes (%.1f GB), growing up to %u (%.1f GB)\n",
+         path, sb.block_count, sb.block_size,
+         gigabytes(sb.block_count, sb.block_size), sb.max_blocks,
+         gigabytes(sb.max_blocks, sb.block_size));
+  printf("  %u inodes in blocks %u-%u\n", sb.inode_count, sb.inode_table_start,
+         sb.inode_table_start + sb.inode_table_blocks - 1);
+  if (sb.journal_blocks > 0) {
+    printf("  journal in blocks %u-%u\n", sb.journal_start,
+           sb.journal_start + sb.journal_blocks - 1);
+  }
+  printf("  data from block %u, %u blocks reserved for metadata\n",
+         sb.data_start, sb.reserved_blocks);
+  return 0;
+}
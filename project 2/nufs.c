@@ -3,10 +3,14 @@
 #include <assert.h>
 #include <bsd/string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "storage.h"
@@ -15,15 +19,39 @@
 #include "bitmap.h"
 #include "slist.h"
 #include "blocks.h"
+#include "flush.h"
+#include "stats.h"
+#include "trace.h"
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
 
+// The statistics file is not stored in the image. Opening it renders a
+// report into the file handle; writing to it, or truncating it to nothing,
+// resets the statistics.
+static int is_stats(const char *path) {
+  return path != NULL && strcmp(path, STATS_PATH) == 0;
+}
+
+static void stats_getattr(struct stat *st) {
+  size_t len = 0;
+  free(stats_report(&len));
+
+  memset(st, 0, sizeof(struct stat));
+  st->st_mode = 0100644;
+  st->st_nlink = 1;
+  st->st_size = len;
+  st->st_uid = getuid();
+  st->st_mtime = st->st_ctime = time(NULL);
+}
+
 // implementation for: man 2 access
 // Checks if a file exists.
 int nufs_access(const char *path, int mask) {
-  int rv = storage_access(path);
-  printf("access(%s, %04o) -> %d\n", path, mask, rv);
+  uint64_t start = stats_now();
+  int rv = is_stats(path) ? 0 : storage_access(path);
+  stats_op(TRACE_ACCESS, start, 0, rv);
+  TRACE(TRACE_OPS, ACCESS, -1, mask, rv);
   
   return rv;
 }
@@ -32,6 +60,7 @@ int nufs_access(const char *path, int mask) {
 // Implementation for: man 2 stat
 // This is a crucial function.
 int nufs_getattr(const char *path, struct stat *st) {
+  uint64_t start = stats_now();
   int rv = 0;
 
   // Return some metadata for the root directory...
@@ -41,13 +70,16 @@ int nufs_getattr(const char *path, struct stat *st) {
     st->st_uid = getuid();
     st->st_nlink = 1;
   }
+  else if (is_stats(path)) {
+    stats_getattr(st);
+  }
   else {
     rv = storage_stat(path, st);
     st->st_uid = getuid();
   }
   
-  printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode,
-         st->st_size);
+  stats_op(TRACE_GETATTR, start, 0, rv);
+  TRACE(TRACE_OPS, GETATTR, rv == 0 ? (int) st->st_ino : -1, st->st_size, rv);
 
   if (rv == -1) {
     return -ENOENT;
@@ -55,43 +87,57 @@ int nufs_getattr(const char *path, struct stat *st) {
   return 0;
 }
 
-// implementation for: man 2 readdir
-// lists the contents of a directory
-int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                 off_t offset, struct fuse_file_info *fi) {
+// Where nufs_readdir's entries go
+typedef struct fill_dir {
+  void *buf;
+  fuse_fill_dir_t filler;
+  int entries;
+} fill_dir_t;
+
+// Add one entry, with attributes straight from its inode. Returns nonzero
+// once the buffer is full.
+static int fill_entry(void *arg, const char *name, int inum, off_t cookie) {
+  fill_dir_t *fd = arg;
   struct stat st;
-  int rv = nufs_getattr(path, &st);
-  assert(rv == 0);
+  memset(&st, 0, sizeof(st));
 
-  slist_t* dir_list = storage_list(path);
-  filler(buf, ".", &st, 0);
-  if (dir_list == NULL) {
-    printf("readdir(%s) -> %d\n", path, rv);
+  // Skip entries deleted since the directory block was read
+  if (storage_stat_inum(inum, &st) < 0) {
     return 0;
   }
+  st.st_uid = getuid();
+  fd->entries++;
 
-  slist_t* current = dir_list;
-  while(current) {
-    char file_path[strlen(path) + 50];
-    strcpy(file_path, path);
-    
-    if (path[strlen(path) - 1] == '/') {
-      file_path[strlen(path)] = 0;
-    } else {
-      file_path[strlen(path)] = '/';
-      file_path[strlen(path) + 1] = 0;
-    }
+  return fd->filler(fd->buf, name, &st, cookie);
+}
 
-    strcat(file_path, current->data);
-    nufs_getattr(file_path, &st);
-    filler(buf, current->data, &st, 0);
-    current = current->next;
+// implementation for: man 2 readdir
+// lists the contents of a directory, resuming at offset
+int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                 off_t offset, struct fuse_file_info *fi) {
+  uint64_t start = stats_now();
+  fill_dir_t fd = {buf, filler, 0};
+  int inum = storage_open(path);
+  int rv = inum < 0 ? inum : 0;
+  int full = 0;
+
+  // "." and ".." come first, at offsets 1 and 2
+  if (rv == 0 && offset < 1) {
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    storage_stat_inum(inum, &st);
+    full = filler(buf, ".", &st, 1);
+  }
+  if (rv == 0 && !full && offset < 2) {
+    full = filler(buf, "..", NULL, 2);
+  }
+  if (rv == 0 && !full) {
+    rv = storage_readdir(inum, offset, fill_entry, &fd);
   }
 
-  printf("readdir(%s) -> %d\n", path, rv);
-  s_free(dir_list);
-
-  return 0;
+  stats_op(TRACE_READDIR, start, 0, rv);
+  TRACE(TRACE_OPS, READDIR, inum, fd.entries, rv);
+  return rv;
 }
 
 // mknod makes a filesystem object like a file or directory
@@ -99,8 +145,10 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 // Note, for this assignment, you can alternatively implement the create
 // function.
 int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
-  int rv = storage_mknod(path, mode);
-  printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
+  uint64_t start = stats_now();
+  int rv = is_stats(path) ? -EEXIST : storage_mknod(path, mode);
+  stats_op(TRACE_MKNOD, start, 0, rv);
+  TRACE(TRACE_OPS, MKNOD, -1, mode, rv);
   
   return rv;
 }
@@ -108,32 +156,40 @@ int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
 // most of the following callbacks implement
 // another system call; see section 2 of the manual
 int nufs_mkdir(const char *path, mode_t mode) {
-  int rv = nufs_mknod(path, mode | 040000, 0);
-  printf("mkdir(%s) -> %d\n", path, rv);
+  uint64_t start = stats_now();
+  int rv = is_stats(path) ? -EEXIST : storage_mknod(path, mode | 040000);
+  stats_op(TRACE_MKDIR, start, 0, rv);
+  TRACE(TRACE_OPS, MKDIR, -1, mode, rv);
   
   return rv;
 }
 
 // unlinks reference to path
 int nufs_unlink(const char *path) {
-  int rv = storage_unlink(path);
-  printf("unlink(%s) -> %d\n", path, rv);
+  uint64_t start = stats_now();
+  int rv = is_stats(path) ? -EPERM : storage_unlink(path);
+  stats_op(TRACE_UNLINK, start, 0, rv);
+  TRACE(TRACE_OPS, UNLINK, -1, 0, rv);
   
   return rv;
 }
 
 // links path 'from' to 'to'
 int nufs_link(const char *from, const char *to) {
-  int rv = storage_link(from, to);
-  printf("link(%s => %s) -> %d\n", from, to, rv);
+  uint64_t start = stats_now();
+  int rv = is_stats(from) || is_stats(to) ? -EPERM : storage_link(from, to);
+  stats_op(TRACE_LINK, start, 0, rv);
+  TRACE(TRACE_OPS, LINK, -1, 0, rv);
 
   return rv;
 }
 
 // removes directory at path
 int nufs_rmdir(const char *path) {
+  uint64_t start = stats_now();
   int rv = storage_unlink(path);
-  printf("rmdir(%s) -> %d\n", path, rv);
+  stats_op(TRACE_RMDIR, start, 0, rv);
+  TRACE(TRACE_OPS, RMDIR, -1, 0, rv);
   
   return rv;
 }
@@ -141,44 +197,191 @@ int nufs_rmdir(const char *path) {
 // implements: man 2 rename
 // called to move a file within the same filesystem
 int nufs_rename(const char *from, const char *to) {
-  int rv = storage_rename(from, to);
-  printf("rename(%s => %s) -> %d\n", from, to, rv);
+  uint64_t start = stats_now();
+  int rv = is_stats(from) || is_stats(to) ? -EPERM
+                                          : storage_rename(from, to);
+  stats_op(TRACE_RENAME, start, 0, rv);
+  TRACE(TRACE_OPS, RENAME, -1, 0, rv);
   
   return rv;
 }
 
 // changes the mode field of the object
 int nufs_chmod(const char *path, mode_t mode) {
+  uint64_t start = stats_now();
   int rv = -1;
-  printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
+  stats_op(TRACE_CHMOD, start, 0, rv);
+  TRACE(TRACE_OPS, CHMOD, -1, mode, rv);
   
   return rv;
 }
 
+// Truncating the statistics file to nothing resets the statistics
+static void stats_truncate(off_t size) {
+  if (size == 0) {
+    stats_reset();
+  }
+}
+
 // sets size of file at path
 int nufs_truncate(const char *path, off_t size) {
-  int rv = storage_truncate(path, size);
-  printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
+  uint64_t start = stats_now();
+  int rv = 0;
+  if (is_stats(path)) {
+    stats_truncate(size);
+  } else {
+    rv = storage_truncate(path, size);
+  }
+  stats_op(TRACE_TRUNCATE, start, 0, rv);
+  TRACE(TRACE_OPS, TRUNCATE, -1, size, rv);
   
   return rv;
 }
 
-// This is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-// You can just check whether the file is accessible.
-int nufs_open(const char *path, struct fuse_file_info *fi) {
+// sets size of an open file
+int nufs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+  uint64_t start = stats_now();
+  int rv = 0;
+  if (is_stats(path)) {
+    stats_truncate(size);
+  } else {
+    rv = storage_truncate_inum(fi->fh, size);
+  }
+  stats_op(TRACE_FTRUNCATE, start, 0, rv);
+  TRACE(TRACE_OPS, FTRUNCATE, fi->fh, size, rv);
+
+  return rv;
+}
+
+// Gets an open file's attributes
+int nufs_fgetattr(const char *path, struct stat *st,
+                  struct fuse_file_info *fi) {
+  uint64_t start = stats_now();
   int rv = 0;
-  printf("open(%s) -> %d\n", path, rv);
+  if (is_stats(path)) {
+    stats_getattr(st);
+  } else {
+    rv = storage_stat_inum(fi->fh, st);
+    st->st_uid = getuid();
+  }
+  stats_op(TRACE_FGETATTR, start, 0, rv);
+  TRACE(TRACE_OPS, FGETATTR, fi->fh, st->st_size, rv);
+
+  return rv;
+}
+
+// This is called on open. The path is resolved here once and the inode
+// kept in the file handle, so reads and writes don't look it up again.
+// A file unlinked while open stays allocated until it is released, since
+// FUSE renames it to .fuse_hidden* rather than unlinking it (unless mounted
+// with -o hard_remove).
+int nufs_open(const char *path, struct fuse_file_info *fi) {
+  uint64_t start = stats_now();
+  int rv;
+  if (is_stats(path)) {
+    // no page cache, so every open reads a fresh report to the end
+    size_t len;
+    char *report = stats_report(&len);
+    fi->fh = (uintptr_t) report;
+    fi->direct_io = 1;
+    rv = report ? 0 : -ENOMEM;
+  } else if ((rv = storage_open(path)) >= 0) {
+    fi->fh = rv;
+    rv = 0;
+  }
+  stats_op(TRACE_OPEN, start, 0, rv);
+  TRACE(TRACE_OPS, OPEN, rv == 0 ? (int) fi->fh : -1, 0, rv);
   
   return rv;
 }
 
+// Called when the last reference to an open file goes away
+int nufs_release(const char *path, struct fuse_file_info *fi) {
+  if (is_stats(path)) {
+    free((char *) fi->fh);
+  }
+
+  return 0;
+}
+
+// Writes an open file and the metadata describing it to disk
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  if (is_stats(path)) {
+    return 0;
+  }
+
+  uint64_t start = stats_now();
+  int rv = storage_fsync_inum(fi->fh);
+  stats_op(TRACE_FSYNC, start, 0, rv);
+  TRACE(TRACE_OPS, FSYNC, fi->fh, datasync, rv);
+
+  return rv;
+}
+
+// Writes a directory to disk. There is no opendir here, so the path is
+// resolved again.
+int nufs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+  uint64_t start = stats_now();
+  int inum = storage_open(path);
+  int rv = inum < 0 ? inum : storage_fsync_inum(inum);
+  stats_op(TRACE_FSYNCDIR, start, 0, rv);
+  TRACE(TRACE_OPS, FSYNCDIR, inum, datasync, rv);
+
+  return rv;
+}
+
+// FUSE reads the data of a zero-copy read only after nufs_read_buf returns,
+// without telling us when it's done. So the blocks stay pinned until the
+// same thread reads again, or exits, by which time the reply has been sent.
+static pthread_key_t read_pin_key;
+
+static void drop_read_pin(void *pin) {
+  blocks_unpin(pin);
+}
+
+// Called once FUSE has gone into the background, so threads started here
+// are the ones serving requests
+void *nufs_init(struct fuse_conn_info *conn) {
+  flush_start();
+  pthread_key_create(&read_pin_key, drop_read_pin);
+
+  // Take writes in large pieces, and let data be spliced both ways
+  const char *maxWrite = getenv("NUFS_MAX_WRITE");
+  conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES | FUSE_CAP_SPLICE_READ |
+                                 FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+  conn->max_write = maxWrite ? atoi(maxWrite) : NUFS_MAX_WRITE;
+
+  return NULL;
+}
+
+// Creates and opens a file in one go
+int nufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  uint64_t start = stats_now();
+  int rv = is_stats(path) ? -EEXIST : storage_mknod(path, mode);
+  stats_op(TRACE_CREATE, start, 0, rv);
+  TRACE(TRACE_OPS, CREATE, -1, mode, rv);
+  if (rv < 0) {
+    return rv;
+  }
+
+  return nufs_open(path, fi);
+}
+
 // Actually read data
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
-  int rv = storage_read(path, buf, size, offset);
-  printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  uint64_t start = stats_now();
+  int rv;
+  if (is_stats(path)) {
+    const char *report = (const char *) fi->fh;
+    size_t len = strlen(report);
+    rv = offset < len ? (len - offset < size ? len - offset : size) : 0;
+    memcpy(buf, report + offset, rv);
+  } else {
+    rv = storage_read_inum(fi->fh, buf, size, offset);
+  }
+  stats_op(TRACE_READ, start, rv, rv);
+  TRACE(TRACE_OPS, READ, fi->fh, size, rv);
   
   return rv;
 }
@@ -186,17 +389,134 @@ int nufs_read(const char *path, char *buf, size_t size, off_t offset,
 // Actually write data
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi) {
-  int rv = storage_write(path, buf, size, offset);
-  printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  uint64_t start = stats_now();
+  int rv;
+  if (is_stats(path)) {
+    stats_reset();
+    rv = size;
+  } else {
+    rv = storage_write_inum(fi->fh, buf, size, offset);
+  }
+  stats_op(TRACE_WRITE, start, rv, rv);
+  TRACE(TRACE_OPS, WRITE, fi->fh, size, rv);
   
   return rv;
 }
 
+// Point FUSE at where the data lies in the image file, so it can splice it
+// to the kernel without copying it through us. The inode lock is dropped
+// before FUSE gets to it, so the blocks are pinned, lest they be freed and
+// reused for something else first.
+int nufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                  off_t offset, struct fuse_file_info *fi) {
+  int max = size / BLOCK_SIZE + 2;
+  struct fuse_bufvec *bv =
+      calloc(1, sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf));
+  storage_span_t spans[max];
+  *bufp = bv;
+
+  blocks_unpin(pthread_getspecific(read_pin_key));
+  pthread_setspecific(read_pin_key, NULL);
+
+  uint64_t start = stats_now();
+  int rv = is_stats(path) ? -EAGAIN
+                          : storage_read_spans(fi->fh, offset, size, spans, max);
+  if (rv >= 0) {
+    size_t total = 0;
+    int bnum[max];
+    int count[max];
+    for (int i = 0; i < rv; i++) {
+      bv->buf[i].size = spans[i].len;
+      bv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      bv->buf[i].fd = blocks_image_fd();
+      bv->buf[i].pos = spans[i].pos;
+      total += spans[i].len;
+      bnum[i] = spans[i].pos / BLOCK_SIZE;
+      count[i] = bytes_to_blocks(spans[i].pos % BLOCK_SIZE + spans[i].len);
+    }
+    bv->count = rv;
+    pthread_setspecific(read_pin_key, blocks_pin(bnum, count, rv));
+    storage_spans_done(fi->fh, 0, spans, rv);
+    stats_op(TRACE_READ, start, total, total);
+    TRACE(TRACE_OPS, READ, fi->fh, size, total);
+    return 0;
+  }
+
+  // Anything not stored in plain blocks is read into memory as before
+  bv->count = 1;
+  bv->buf[0].mem = malloc(size);
+  rv = nufs_read(path, bv->buf[0].mem, size, offset, fi);
+  bv->buf[0].size = rv > 0 ? rv : 0;
+
+  return rv < 0 ? rv : 0;
+}
+
+// Have FUSE move the data into the blocks it goes to, splicing it from the
+// kernel when it can
+int nufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                   struct fuse_file_info *fi) {
+  size_t size = fuse_buf_size(buf);
+  int max = size / BLOCK_SIZE + 2;
+  storage_span_t spans[max];
+
+  uint64_t start = stats_now();
+  int rv = is_stats(path) ? -EAGAIN
+                          : storage_write_spans(fi->fh, offset, size, spans, max);
+  if (rv >= 0) {
+    struct fuse_bufvec *dst =
+        calloc(1, sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf));
+    for (int i = 0; i < rv; i++) {
+      dst->buf[i].size = spans[i].len;
+      dst->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      dst->buf[i].fd = blocks_image_fd();
+      dst->buf[i].pos = spans[i].pos;
+    }
+    dst->count = rv;
+    ssize_t done = fuse_buf_copy(dst, buf, 0);
+    storage_spans_done(fi->fh, 1, spans, rv);
+    free(dst);
+
+    stats_op(TRACE_WRITE, start, done, done);
+    TRACE(TRACE_OPS, WRITE, fi->fh, size, done);
+    return done;
+  }
+  if (rv != -EAGAIN) {
+    stats_op(TRACE_WRITE, start, rv, rv);
+    TRACE(TRACE_OPS, WRITE, fi->fh, size, rv);
+    return rv;
+  }
+
+  // Inline, compressed and deduplicated files take the data from memory
+  struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+  mem.buf[0].mem = malloc(size);
+  ssize_t got = fuse_buf_copy(&mem, buf, 0);
+  rv = got < 0 ? got : nufs_write(path, mem.buf[0].mem, got, offset, fi);
+  free(mem.buf[0].mem);
+
+  return rv;
+}
+
+#if FUSE_VERSION >= 38
+// Find data or holes for SEEK_DATA / SEEK_HOLE; other seeks never reach us.
+// libfuse only has this callback from 3.8 on; older versions let the kernel
+// treat the whole file as data.
+off_t nufs_lseek(const char *path, off_t off, int whence,
+                 struct fuse_file_info *fi) {
+  uint64_t start = stats_now();
+  off_t rv = storage_lseek_inum(fi->fh, off, whence);
+  stats_op(TRACE_LSEEK, start, 0, rv);
+  TRACE(TRACE_OPS, LSEEK, fi->fh, rv < 0 ? off : rv, rv < 0 ? rv : 0);
+
+  return rv;
+}
+#endif
+
 // Update the timestamps on a file or directory.
 int nufs_utimens(const char *path, const struct timespec ts[2]) {
-  int rv = storage_set_time(path, ts);
-  printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n", path, ts[0].tv_sec,
-         ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
+  uint64_t start = stats_now();
+  int rv = is_stats(path) ? 0 : storage_set_time(path, ts);
+  stats_op(TRACE_UTIMENS, start, 0, rv);
+  TRACE(TRACE_OPS, UTIMENS, -1, ts[1].tv_sec, rv);
   
   return rv;
 }
@@ -204,35 +524,42 @@ int nufs_utimens(const char *path, const struct timespec ts[2]) {
 // Extended operations
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data) {
+  uint64_t start = stats_now();
   int rv = -1;
-  printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
+  stats_op(TRACE_IOCTL, start, 0, rv);
+  TRACE(TRACE_OPS, IOCTL, fi->fh, cmd, rv);
   
   return rv;
 }
 
 // symbolic links 'from' to 'to'
 int nufs_sym_link(const char* from, const char* to) {
-  int rv = -1;
-  printf("symlink(%s, %s) -> %d\n", to, from, rv);
+  uint64_t start = stats_now();
+  int rv = is_stats(to) ? -EEXIST : storage_sym_link(from, to);
+  stats_op(TRACE_SYMLINK, start, 0, rv);
+  TRACE(TRACE_OPS, SYMLINK, -1, 0, rv);
   
   return rv;
 }
 
 // reads link
 int nufs_read_link(const char*path, char* buf, size_t size) {
-  int rv = -1;
-  printf("readlink(%s, %ld) -> %d\n", path, size, rv);
+  uint64_t start = stats_now();
+  int rv = storage_readlink(path, buf, size);
+  stats_op(TRACE_READLINK, start, 0, rv);
+  TRACE(TRACE_OPS, READLINK, -1, size, rv);
   
   return rv;
 }
 
 void nufs_init_ops(struct fuse_operations *ops) {
   memset(ops, 0, sizeof(struct fuse_operations));
+  ops->init = nufs_init;
   ops->access = nufs_access;
   ops->getattr = nufs_getattr;
   ops->readdir = nufs_readdir;
   ops->mknod = nufs_mknod;
-  // ops->create   = nufs_create; // alternative to mknod
+  ops->create = nufs_create;
   ops->mkdir = nufs_mkdir;
   ops->link = nufs_link;
   ops->unlink = nufs_unlink;
@@ -240,20 +567,41 @@ void nufs_init_ops(struct fuse_operations *ops) {
   ops->rename = nufs_rename;
   ops->chmod = nufs_chmod;
   ops->truncate = nufs_truncate;
+  ops->ftruncate = nufs_ftruncate;
+  ops->fgetattr = nufs_fgetattr;
   ops->open = nufs_open;
+  ops->release = nufs_release;
+  ops->fsync = nufs_fsync;
+  ops->fsyncdir = nufs_fsyncdir;
   ops->read = nufs_read;
   ops->write = nufs_write;
   ops->utimens = nufs_utimens;
+#if FUSE_VERSION >= 38
+  ops->lseek = nufs_lseek;
+#endif
   ops->ioctl = nufs_ioctl;
   ops->readlink = nufs_read_link;
   ops->symlink = nufs_sym_link;
+
+  // NUFS_SPLICE=0 leaves data to be copied through read and write, to
+  // compare against
+  const char *splice = getenv("NUFS_SPLICE");
+  if (splice == NULL || atoi(splice) != 0) {
+    ops->read_buf = nufs_read_buf;
+    ops->write_buf = nufs_write_buf;
+  }
 };
 
 struct fuse_operations nufs_ops;
 
 int main(int argc, char *argv[]) {
   assert(argc > 2 && argc < 6);
+  trace_init();
   storage_init(argv[--argc]);
+  stats_reset();
   nufs_init_ops(&nufs_ops);
-  return fuse_main(argc, argv, &nufs_ops, NULL);
+  int rv = fuse_main(argc, argv, &nufs_ops, NULL);
+  trace_dump();
+  blocks_free();
+  return rv;
 }
@@ -0,0 +1,517 @@
+// Low-level FUSE frontend for nufs.
+//
+// The kernel hands every operation an inode number rather than a path, so
+// nothing here parses paths: names are only looked up one at a time in a
+// directory whose inode we already have. FUSE inode numbers are nufs inums
+// plus one, since FUSE reserves 1 for the root and nufs keeps it in inode 0.
+// Storage counts the kernel's lookups of each inode until it forgets them,
+// so that a file unlinked while open keeps its inode, and the kernel's inode
+// number stays its own, until then.
+// Images are shared with the path-based frontend in nufs.c.
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "storage.h"
+#include "blocks.h"
+#include "dcache.h"
+#include "flush.h"
+#include "slist.h"
+#include "trace.h"
+
+#define FUSE_USE_VERSION 26
+#include <fuse_lowlevel.h>
+
+// Seconds the kernel may cache names and attributes. Every change goes
+// through this process, and the kernel updates its copies for those itself.
+#define NUFS_TIMEOUT 1.0
+
+// A readdir reply being filled in
+typedef struct dirbuf {
+  fuse_req_t req;
+  char *data;
+  size_t size; // bytes used
+  size_t max;  // bytes the kernel asked for
+} dirbuf_t;
+
+static int to_inum(fuse_ino_t ino) {
+  return ino - 1;
+}
+
+static fuse_ino_t to_ino(int inum) {
+  return inum + 1;
+}
+
+// Get the attributes of an inode as FUSE wants them
+static int get_stat(int inum, struct stat *st) {
+  memset(st, 0, sizeof(*st));
+  int rv = storage_stat_inum(inum, st);
+  st->st_ino = to_ino(inum);
+  st->st_uid = getuid();
+  st->st_gid = getgid();
+
+  return rv;
+}
+
+// Fill in the entry for inum, counting the reference the kernel takes to it
+// with the reply. Returns 0, or the errno to reply with instead.
+static int get_entry(int inum, struct fuse_entry_param *e) {
+  memset(e, 0, sizeof(*e));
+  if (inum < 0) {
+    return -inum;
+  }
+  if (get_stat(inum, &e->attr) < 0 || storage_hold_inum(inum) < 0) {
+    return ENOENT;
+  }
+  e->ino = to_ino(inum);
+  e->generation = storage_generation(inum);
+  e->attr_timeout = NUFS_TIMEOUT;
+  e->entry_timeout = NUFS_TIMEOUT;
+  return 0;
+}
+
+// Reply with the entry for inum, or with the error if inum is negative
+static void reply_entry(fuse_req_t req, int inum) {
+  struct fuse_entry_param e;
+  int err = get_entry(inum, &e);
+  if (err) {
+    fuse_reply_err(req, err);
+  }
+  // The kernel doesn't count the reference if the request was interrupted
+  else if (fuse_reply_entry(req, &e) == -ENOENT) {
+    storage_forget_inum(inum, 1);
+  }
+}
+
+// Finds name in the directory parent
+static void nufs_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+                           const char *name) {
+  int inum = storage_lookup(to_inum(parent), name, strlen(name));
+  TRACE(TRACE_OPS, LOOKUP, to_inum(parent), 0, inum);
+
+  // Let the kernel remember misses too
+  if (inum == -ENOENT) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = NUFS_TIMEOUT;
+    fuse_reply_entry(req, &e);
+    return;
+  }
+  reply_entry(req, inum);
+}
+
+static void nufs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
+  struct stat st;
+  int rv = get_stat(to_inum(ino), &st);
+  TRACE(TRACE_OPS, GETATTR, to_inum(ino), st.st_size, rv);
+
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  }
+  else {
+    fuse_reply_attr(req, &st, NUFS_TIMEOUT);
+  }
+}
+
+// Handles truncate and utimens. Like nufs_chmod, changing the mode isn't
+// supported.
+static void nufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                            int to_set, struct fuse_file_info *fi) {
+  int inum = to_inum(ino);
+  int rv = 0;
+
+  if (to_set & FUSE_SET_ATTR_MODE) {
+    rv = -EPERM;
+  }
+  if (rv == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+    rv = storage_truncate_inum(inum, attr->st_size);
+  }
+  if (rv == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+    struct stat st;
+    rv = get_stat(inum, &st);
+
+    struct timespec ts[2] = {{st.st_atime, 0}, {st.st_mtime, 0}};
+    time_t now = time(NULL);
+    if (to_set & FUSE_SET_ATTR_ATIME) {
+      ts[0].tv_sec = to_set & FUSE_SET_ATTR_ATIME_NOW ? now : attr->st_atime;
+    }
+    if (to_set & FUSE_SET_ATTR_MTIME) {
+      ts[1].tv_sec = to_set & FUSE_SET_ATTR_MTIME_NOW ? now : attr->st_mtime;
+    }
+    if (rv == 0) {
+      rv = storage_set_time_inum(inum, ts);
+    }
+  }
+  TRACE(TRACE_OPS, SETATTR, to_inum(ino), to_set, rv);
+
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  struct stat st;
+  get_stat(inum, &st);
+  fuse_reply_attr(req, &st, NUFS_TIMEOUT);
+}
+
+static void nufs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode, dev_t rdev) {
+  int inum = storage_mknod_at(to_inum(parent), name, strlen(name), mode);
+  TRACE(TRACE_OPS, MKNOD, to_inum(parent), mode, inum);
+  reply_entry(req, inum);
+}
+
+static void nufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode) {
+  int inum =
+      storage_mknod_at(to_inum(parent), name, strlen(name), mode | S_IFDIR);
+  TRACE(TRACE_OPS, MKDIR, to_inum(parent), mode, inum);
+  reply_entry(req, inum);
+}
+
+static void nufs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           mode_t mode, struct fuse_file_info *fi) {
+  int inum = storage_mknod_at(to_inum(parent), name, strlen(name), mode);
+  TRACE(TRACE_OPS, CREATE, to_inum(parent), mode, inum);
+
+  struct fuse_entry_param e;
+  int err = get_entry(inum, &e);
+  if (err) {
+    fuse_reply_err(req, err);
+  }
+  else if (fuse_reply_create(req, &e, fi) == -ENOENT) {
+    storage_forget_inum(inum, 1);
+  }
+}
+
+// The kernel drops nlookup of the references it took to ino. An inode
+// unlinked while it was open is freed with the last of them.
+static void nufs_ll_forget(fuse_req_t req, fuse_ino_t ino,
+                           unsigned long nlookup) {
+  storage_forget_inum(to_inum(ino), nlookup);
+  TRACE(TRACE_OPS, FORGET, to_inum(ino), nlookup, 0);
+  fuse_reply_none(req);
+}
+
+static void nufs_ll_unlink(fuse_req_t req, fuse_ino_t parent,
+                           const char *name) {
+  int rv = storage_unlink_at(to_inum(parent), name, strlen(name));
+  TRACE(TRACE_OPS, UNLINK, to_inum(parent), 0, rv);
+  fuse_reply_err(req, -rv);
+}
+
+static void nufs_ll_rmdir(fuse_req_t req, fuse_ino_t parent,
+                          const char *name) {
+  int rv = storage_unlink_at(to_inum(parent), name, strlen(name));
+  TRACE(TRACE_OPS, RMDIR, to_inum(parent), 0, rv);
+  fuse_reply_err(req, -rv);
+}
+
+static void nufs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           fuse_ino_t newparent, const char *newname) {
+  int rv = storage_rename_at(to_inum(parent), name, strlen(name),
+                             to_inum(newparent), newname, strlen(newname));
+  TRACE(TRACE_OPS, RENAME, to_inum(parent), to_inum(newparent), rv);
+  fuse_reply_err(req, -rv);
+}
+
+static void nufs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                         const char *newname) {
+  int rv = storage_link_at(to_inum(ino), to_inum(newparent), newname,
+                           strlen(newname));
+  TRACE(TRACE_OPS, LINK, to_inum(ino), to_inum(newparent), rv);
+  reply_entry(req, rv < 0 ? rv : to_inum(ino));
+}
+
+static void nufs_ll_symlink(fuse_req_t req, const char *link,
+                            fuse_ino_t parent, const char *name) {
+  int inum = storage_symlink_at(to_inum(parent), name, strlen(name), link);
+  TRACE(TRACE_OPS, SYMLINK, to_inum(parent), 0, inum);
+  reply_entry(req, inum);
+}
+
+static void nufs_ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+  char buf[PATH_MAX];
+  int rv = storage_readlink_inum(to_inum(ino), buf, sizeof(buf));
+  TRACE(TRACE_OPS, READLINK, to_inum(ino), sizeof(buf), rv);
+
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  }
+  else {
+    fuse_reply_readlink(req, buf);
+  }
+}
+
+static void nufs_ll_open(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi) {
+  struct stat st;
+  int rv = get_stat(to_inum(ino), &st);
+  TRACE(TRACE_OPS, OPEN, to_inum(ino), 0, rv);
+
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  }
+  else {
+    fuse_reply_open(req, fi);
+  }
+}
+
+// Reply with the data spliced straight from the image file when it is all
+// in plain blocks, holding the inode's lock until it has been sent
+static void nufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                         off_t off, struct fuse_file_info *fi) {
+  int inum = to_inum(ino);
+  int max = size / BLOCK_SIZE + 2;
+  storage_span_t spans[max];
+  int rv = storage_read_spans(inum, off, size, spans, max);
+
+  if (rv >= 0) {
+    struct fuse_bufvec *bv =
+        calloc(1, sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf));
+    size_t total = 0;
+    for (int i = 0; i < rv; i++) {
+      bv->buf[i].size = spans[i].len;
+      bv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      bv->buf[i].fd = blocks_image_fd();
+      bv->buf[i].pos = spans[i].pos;
+      total += spans[i].len;
+    }
+    bv->count = rv;
+    fuse_reply_data(req, bv, FUSE_BUF_SPLICE_MOVE);
+    storage_spans_done(inum, 0, spans, rv);
+    free(bv);
+    TRACE(TRACE_OPS, READ, inum, size, total);
+    return;
+  }
+
+  char *buf = malloc(size);
+  rv = storage_read_inum(inum, buf, size, off);
+  TRACE(TRACE_OPS, READ, inum, size, rv);
+
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  }
+  else {
+    fuse_reply_buf(req, buf, rv);
+  }
+  free(buf);
+}
+
+static void nufs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                          size_t size, off_t off, struct fuse_file_info *fi) {
+  int rv = storage_write_inum(to_inum(ino), buf, size, off);
+  TRACE(TRACE_OPS, WRITE, to_inum(ino), size, rv);
+
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  }
+  else {
+    fuse_reply_write(req, rv);
+  }
+}
+
+// Move the data from the request into its blocks without a copy of our own,
+// spliced when the kernel passes it in a pipe
+static void nufs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+                              struct fuse_bufvec *bufv, off_t off,
+                              struct fuse_file_info *fi) {
+  int inum = to_inum(ino);
+  size_t size = fuse_buf_size(bufv);
+  int max = size / BLOCK_SIZE + 2;
+  storage_span_t spans[max];
+  ssize_t rv = storage_write_spans(inum, off, size, spans, max);
+
+  if (rv >= 0) {
+    int count = rv;
+    struct fuse_bufvec *dst =
+        calloc(1, sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf));
+    for (int i = 0; i < count; i++) {
+      dst->buf[i].size = spans[i].len;
+      dst->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      dst->buf[i].fd = blocks_image_fd();
+      dst->buf[i].pos = spans[i].pos;
+    }
+    dst->count = count;
+    rv = fuse_buf_copy(dst, bufv, 0);
+    storage_spans_done(inum, 1, spans, count);
+    free(dst);
+  }
+  else if (rv == -EAGAIN) {
+    // Inline, compressed and deduplicated files take it from memory
+    struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+    mem.buf[0].mem = malloc(size);
+    rv = fuse_buf_copy(&mem, bufv, 0);
+    if (rv >= 0) {
+      rv = storage_write_inum(inum, mem.buf[0].mem, rv, off);
+    }
+    free(mem.buf[0].mem);
+  }
+  TRACE(TRACE_OPS, WRITE, inum, size, rv);
+
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  }
+  else {
+    fuse_reply_write(req, rv);
+  }
+}
+
+// Add one entry to a readdir reply. Returns nonzero once it is full.
+static int dirbuf_add(void *arg, const char *name, int inum, off_t cookie) {
+  dirbuf_t *db = arg;
+  struct stat st;
+  if (get_stat(inum, &st) < 0) {
+    return 0;
+  }
+
+  size_t left = db->max - db->size;
+  size_t len = fuse_add_direntry(db->req, db->data + db->size, left, name,
+                                 &st, cookie);
+  if (len > left) {
+    return 1;
+  }
+  db->size += len;
+  return 0;
+}
+
+// Stream entries from the directory blocks, starting after off. "." and
+// ".." take offsets 1 and 2.
+static void nufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                            off_t off, struct fuse_file_info *fi) {
+  int inum = to_inum(ino);
+  dirbuf_t db = {req, malloc(size), 0, size};
+  int full = 0;
+  int rv = 0;
+
+  if (off < 1) {
+    full = dirbuf_add(&db, ".", inum, 1);
+  }
+  if (!full && off < 2) {
+    full = dirbuf_add(&db, "..", inum, 2);
+  }
+  if (!full) {
+    rv = storage_readdir(inum, off, dirbuf_add, &db);
+  }
+  TRACE(TRACE_OPS, READDIR, inum, db.size, rv);
+
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  }
+  else {
+    fuse_reply_buf(req, db.data, db.size);
+  }
+  free(db.data);
+}
+
+static void nufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                          struct fuse_file_info *fi) {
+  int rv = storage_fsync_inum(to_inum(ino));
+  TRACE(TRACE_OPS, FSYNC, to_inum(ino), datasync, rv);
+  fuse_reply_err(req, -rv);
+}
+
+static void nufs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+                             struct fuse_file_info *fi) {
+  int rv = storage_fsync_inum(to_inum(ino));
+  TRACE(TRACE_OPS, FSYNCDIR, to_inum(ino), datasync, rv);
+  fuse_reply_err(req, -rv);
+}
+
+// Runs in the process serving requests, after fuse_daemonize
+static void nufs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+  flush_start();
+
+  // Large writes, and splicing data in and out
+  const char *maxWrite = getenv("NUFS_MAX_WRITE");
+  conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES | FUSE_CAP_SPLICE_READ |
+                                 FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+  conn->max_write = maxWrite ? atoi(maxWrite) : NUFS_MAX_WRITE;
+}
+
+static void nufs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+  struct stat st;
+  int rv = get_stat(to_inum(ino), &st);
+  TRACE(TRACE_OPS, ACCESS, to_inum(ino), mask, rv);
+  fuse_reply_err(req, -rv);
+}
+
+void nufs_ll_init_ops(struct fuse_lowlevel_ops *ops) {
+  memset(ops, 0, sizeof(struct fuse_lowlevel_ops));
+  ops->init = nufs_ll_init;
+  ops->lookup = nufs_ll_lookup;
+  ops->forget = nufs_ll_forget;
+  ops->getattr = nufs_ll_getattr;
+  ops->setattr = nufs_ll_setattr;
+  ops->mknod = nufs_ll_mknod;
+  ops->mkdir = nufs_ll_mkdir;
+  ops->create = nufs_ll_create;
+  ops->unlink = nufs_ll_unlink;
+  ops->rmdir = nufs_ll_rmdir;
+  ops->rename = nufs_ll_rename;
+  ops->link = nufs_ll_link;
+  ops->symlink = nufs_ll_symlink;
+  ops->readlink = nufs_ll_readlink;
+  ops->open = nufs_ll_open;
+  ops->read = nufs_ll_read;
+  ops->write = nufs_ll_write;
+  ops->write_buf = nufs_ll_write_buf;
+  ops->fsync = nufs_ll_fsync;
+  ops->readdir = nufs_ll_readdir;
+  ops->fsyncdir = nufs_ll_fsyncdir;
+  ops->access = nufs_ll_access;
+}
+
+struct fuse_lowlevel_ops nufs_ll_ops;
+
+int main(int argc, char *argv[]) {
+  assert(argc > 2 && argc < 6);
+  trace_init();
+  storage_init(argv[--argc]);
+
+  // Nothing here resolves paths, so the path cache would only take memory
+  dcache_init(0);
+  nufs_ll_init_ops(&nufs_ll_ops);
+
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  char *mountpoint;
+  int multithreaded, foreground;
+  if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground)) {
+    return 1;
+  }
+
+  int rv = 1;
+  struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+  if (ch != NULL) {
+    struct fuse_session *se =
+        fuse_lowlevel_new(&args, &nufs_ll_ops, sizeof(nufs_ll_ops), NULL);
+    if (se != NULL) {
+      if (fuse_set_signal_handlers(se) == 0) {
+        fuse_session_add_chan(se, ch);
+        fuse_daemonize(foreground);
+        rv = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+  }
+  fuse_opt_free_args(&args);
+  trace_dump();
+
+  // Unmounted, the kernel refers to nothing, however much it didn't forget
+  storage_free_orphans();
+  blocks_free();
+
+  return rv ? 1 : 0;
+}
@@ -0,0 +1,120 @@
+// Decoder for the binary trace files written by a nufs run with NUFS_TRACE
+// set. Prints every record in time order, or with -s a per-operation
+// summary.
+//
+// Usage: nufs_trace [-s] [trace file]   (default nufs.trace)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+typedef struct op_summary {
+  long count;
+  long errors;
+  int64_t size;
+} op_summary_t;
+
+static int by_time(const void *a, const void *b) {
+  const trace_record_t *x = a;
+  const trace_record_t *y = b;
+  if (x->ns != y->ns) {
+    return x->ns < y->ns ? -1 : 1;
+  }
+  return (int) x->thread - (int) y->thread;
+}
+
+static void print_record(const trace_record_t *rec, uint64_t start) {
+  const char *name = trace_op_name(rec->op);
+  uint64_t ns = rec->ns - start;
+  printf("%6lu.%09lu [t%u] ", (unsigned long) (ns / 1000000000),
+         (unsigned long) (ns % 1000000000), rec->thread);
+  if (name) {
+    printf("%s", name);
+  } else {
+    printf("op%u", rec->op);
+  }
+  printf(" inum=%d size=%ld -> %d\n", rec->inum, (long) rec->size,
+         rec->result);
+}
+
+static void print_summary(const trace_record_t *recs, uint64_t count) {
+  op_summary_t ops[TRACE_OP_COUNT];
+  memset(ops, 0, sizeof(ops));
+  for (uint64_t i = 0; i < count; i++) {
+    if (recs[i].op >= TRACE_OP_COUNT) {
+      continue;
+    }
+    op_summary_t *op = &ops[recs[i].op];
+    op->count++;
+    op->errors += recs[i].result < 0;
+    op->size += recs[i].size;
+  }
+
+  printf("%-14s %10s %10s %14s\n", "op", "count", "errors", "size");
+  for (int i = 0; i < TRACE_OP_COUNT; i++) {
+    if (ops[i].count > 0) {
+      printf("%-14s %10ld %10ld %14ld\n", trace_op_name(i), ops[i].count,
+             ops[i].errors, (long) ops[i].size);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  int summary = 0;
+  const char *path = "nufs.trace";
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0) {
+      summary = 1;
+    } else {
+      path = argv[i];
+    }
+  }
+
+  FILE *in = fopen(path, "r");
+  if (in == NULL) {
+    perror(path);
+    return 1;
+  }
+
+  trace_file_header_t hdr;
+  if (fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != TRACE_MAGIC ||
+      hdr.record_size != sizeof(trace_record_t)) {
+    fprintf(stderr, "%s: not a nufs trace\n", path);
+    fclose(in);
+    return 1;
+  }
+
+  trace_record_t *recs = malloc(hdr.records * sizeof(trace_record_t) + 1);
+  if (recs == NULL) {
+    fprintf(stderr, "%s: %lu records do not fit in memory\n", path,
+            (unsigned long) hdr.records);
+    fclose(in);
+    return 1;
+  }
+  uint64_t count = fread(recs, sizeof(trace_record_t), hdr.records, in);
+  fclose(in);
+  if (count < hdr.records) {
+    fprintf(stderr, "%s: truncated, %lu of %lu records\n", path,
+            (unsigned long) count, (unsigned long) hdr.records);
+  }
+
+  // each thread's records are in order, but the threads interleave
+  qsort(recs, count, sizeof(trace_record_t), by_time);
+
+  if (summary) {
+    print_summary(recs, count);
+  } else {
+    for (uint64_t i = 0; i < count; i++) {
+      print_record(&recs[i], recs[0].ns);
+    }
+  }
+  if (hdr.dropped > 0) {
+    fprintf(stderr, "%lu older records were overwritten\n",
+            (unsigned long) hdr.dropped);
+  }
+
+  free(recs);
+  return 0;
+}
@@ -0,0 +1,54 @@
+#include <string.h>
+
+#include "path.h"
+
+// Start iterating over the components of path
+void path_iter_init(path_iter_t *it, const char *path, int len) {
+  it->pos = path;
+  it->end = path + len;
+  it->name = path;
+  it->len = 0;
+}
+
+// Move to the next non-empty component
+int path_iter_next(path_iter_t *it) {
+  while (it->pos < it->end && *it->pos == '/') {
+    it->pos++;
+  }
+  if (it->pos == it->end) {
+    return 0;
+  }
+
+  it->name = it->pos;
+  while (it->pos < it->end && *it->pos != '/') {
+    it->pos++;
+  }
+  it->len = it->pos - it->name;
+
+  return 1;
+}
+
+// Split a path into its parent and last component
+void path_split(const char *path, int *parent_len, const char **name,
+                int *name_len) {
+  int end = strlen(path);
+
+  // Ignore trailing slashes
+  while (end > 0 && path[end - 1] == '/') {
+    end--;
+  }
+
+  int start = end;
+  while (start > 0 && path[start - 1] != '/') {
+    start--;
+  }
+
+  *name = path + start;
+  *name_len = end - start;
+
+  // Drop the separator(s) between the parent and the name
+  while (start > 0 && path[start - 1] == '/') {
+    start--;
+  }
+  *parent_len = start;
+}
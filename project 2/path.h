@@ -0,0 +1,29 @@
+// In-place path parsing.
+//
+// Paths are walked as (pointer, length) spans into the original string, so
+// resolving a path never copies or allocates.
+
+#ifndef PATH_H
+#define PATH_H
+
+typedef struct path_iter {
+  const char *pos;  // next character to look at
+  const char *end;  // end of the path
+  const char *name; // current component (not NUL-terminated)
+  int len;          // length of the current component
+} path_iter_t;
+
+// Start iterating over the components of the first len bytes of path.
+void path_iter_init(path_iter_t *it, const char *path, int len);
+
+// Move to the next component, skipping empty ones. Returns 1 if there was
+// one and 0 at the end of the path.
+int path_iter_next(path_iter_t *it);
+
+// Split a path into its parent (the first parent_len bytes of path) and its
+// last component. "/a/b" gives parent "/a" and name "b"; "/a" gives an empty
+// parent, which resolves to the root.
+void path_split(const char *path, int *parent_len, const char **name,
+                int *name_len);
+
+#endif
@@ -0,0 +1,149 @@
+// Readahead for file data. See readahead.h.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "blocks.h"
+#include "readahead.h"
+#include "stats.h"
+
+#define DEFAULT_KB 2048 // largest window, unless NUFS_READAHEAD_KB says
+#define MIN_WINDOW 4    // blocks in the smallest window
+#define LOCKS 64        // the streams share this many locks
+#define SCORE_MAX 64    // reads one way it takes to switch the advice
+
+// A sequential stream, in file blocks. A window of 0 means the last read
+// wasn't part of one.
+typedef struct stream {
+  off_t end;       // where the last read ended
+  uint32_t ahead;  // prefetched up to here
+  uint32_t next;   // start a new window once reads get here
+  uint32_t window; // blocks in the last window
+} stream_t;
+
+static stream_t *streams;
+static int stream_count;
+static pthread_mutex_t locks[LOCKS];
+static uint32_t max_window; // in blocks, 0 with readahead off
+
+// Up for random reads, down for sequential ones. Past SCORE_MAX one way or
+// the other the data region's advice is switched.
+static int score;
+static int random_mode;
+static pthread_mutex_t mode_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void readahead_init(int inode_count) {
+  free(streams);
+  streams = calloc(inode_count, sizeof(stream_t));
+  stream_count = inode_count;
+  for (int i = 0; i < LOCKS; i++) {
+    pthread_mutex_init(&locks[i], NULL);
+  }
+
+  const char *kb = getenv("NUFS_READAHEAD_KB");
+  long bytes = (kb ? atol(kb) : DEFAULT_KB) * 1024;
+  max_window = bytes > 0 ? bytes / BLOCK_SIZE : 0;
+  if (max_window > 0 && max_window < MIN_WINDOW) {
+    max_window = MIN_WINDOW;
+  }
+  score = 0;
+  random_mode = 0;
+}
+
+// Count a read towards switching the advice
+static void count_read(int random) {
+  int s = __atomic_load_n(&score, __ATOMIC_RELAXED);
+  if (random ? s < SCORE_MAX : s > -SCORE_MAX) {
+    s = __atomic_add_fetch(&score, random ? 1 : -1, __ATOMIC_RELAXED);
+  }
+
+  int mode = __atomic_load_n(&random_mode, __ATOMIC_RELAXED);
+  if (mode ? s > -SCORE_MAX : s < SCORE_MAX) {
+    return;
+  }
+
+  pthread_mutex_lock(&mode_lock);
+  if (random_mode == mode) {
+    __atomic_store_n(&random_mode, !mode, __ATOMIC_RELAXED);
+    blocks_set_data_advice(mode ? MADV_NORMAL : MADV_RANDOM);
+    if (!mode) {
+      stats_count(STATS_RANDOM_SWITCHES, 1);
+    }
+  }
+  pthread_mutex_unlock(&mode_lock);
+}
+
+// Start reading file blocks [from, to) in, a run of contiguous blocks at
+// a time
+static void prefetch(inode_t *node, uint32_t from, uint32_t to) {
+  for (uint32_t lblk = from; lblk < to;) {
+    int pnum;
+    uint32_t run = inode_map_blocks(node, lblk, &pnum);
+    if (run > to - lblk) {
+      run = to - lblk;
+    }
+    // Holes read back as zeros without touching the image
+    if (pnum != 0) {
+      blocks_advise(pnum, run, MADV_WILLNEED);
+      stats_count(STATS_READAHEAD_BLOCKS, run);
+    }
+    lblk += run;
+  }
+}
+
+void readahead_note(int inum, inode_t *node, off_t offset, size_t size) {
+  if (max_window == 0 || size == 0 || inum >= stream_count) {
+    return;
+  }
+
+  uint32_t first = offset / BLOCK_SIZE;
+  uint32_t last = (offset + size - 1) / BLOCK_SIZE;
+  uint32_t fileBlocks = bytes_to_blocks(node->size);
+  stream_t *s = &streams[inum];
+  uint32_t from = 0, to = 0;
+
+  pthread_mutex_t *lock = &locks[inum % LOCKS];
+  pthread_mutex_lock(lock);
+  // Threads serving one stream may get their reads out of order, so a read
+  // anywhere in what was already prefetched stays in the stream
+  int inStream = s->window > 0 && first + s->window >= s->end / BLOCK_SIZE &&
+                 first <= s->ahead;
+  int sequential = offset == s->end || offset == 0 || inStream;
+
+  if (!sequential) {
+    s->window = 0;
+  }
+  else if (s->window == 0) {
+    // A new stream: read ahead a few times what this read wanted
+    s->window = 4 * (last - first + 1);
+    s->window = s->window < MIN_WINDOW ? MIN_WINDOW : s->window;
+    s->window = s->window > max_window ? max_window : s->window;
+    from = last + 1;
+    to = from + s->window;
+  }
+  else if (last >= s->next) {
+    // Halfway into the last window: the next one, twice as big
+    s->window = s->window * 2 > max_window ? max_window : s->window * 2;
+    from = s->ahead > last + 1 ? s->ahead : last + 1;
+    to = from + s->window;
+  }
+
+  if (to > fileBlocks) {
+    to = fileBlocks;
+  }
+  if (from < to) {
+    s->ahead = to;
+    s->next = from + (to - from) / 2;
+  }
+  if (!sequential || offset + (off_t) size > s->end) {
+    s->end = offset + size;
+  }
+  pthread_mutex_unlock(lock);
+
+  count_read(!sequential);
+  if (from < to) {
+    prefetch(node, from, to);
+  }
+}
@@ -0,0 +1,41 @@
+// Readahead for file data read through the image mapping.
+//
+// Reading a file touches its blocks in the mapping one page at a time, and
+// each page not in the page cache yet is a fault that waits for the disk.
+// The kernel's own readahead only sees the faults, in image order, and
+// knows nothing about where a file's next extent is.
+//
+// So every read of a regular file is noted here, by inode. A read starting
+// where the last one ended continues a sequential stream: the blocks after
+// it, following the file's extents, get madvise(MADV_WILLNEED) so the
+// kernel starts reading them before they are wanted. The window starts at
+// a few times the read size and doubles with every read that stays in the
+// stream, up to NUFS_READAHEAD_KB (2 MB by default; 0 turns readahead off).
+// A new window is started once the reads get halfway into the last one, so
+// the disk stays busy while the file is copied out.
+//
+// A read anywhere else ends the stream. Once most recent reads are random
+// the data region is switched to MADV_RANDOM, so faults read only the pages
+// they need rather than the neighbours the kernel would guess at; enough
+// sequential reads switch it back.
+//
+// Streams are kept per inode, not per open file: FUSE file handles here are
+// inode numbers. Two readers of one file at different offsets look random.
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <sys/types.h>
+
+#include "inode.h"
+
+// Set up the streams for inode_count inodes and read NUFS_READAHEAD_KB.
+// Called at mount.
+void readahead_init(int inode_count);
+
+// Note a read of [offset, offset + size) of a file kept in blocks, and
+// prefetch what its stream needs next. The caller holds at least the
+// inode's read lock.
+void readahead_note(int inum, inode_t *node, off_t offset, size_t size);
+
+#endif
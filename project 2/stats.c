@@ -0,0 +1,167 @@
+// Runtime statistics. See stats.h.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dcache.h"
+#include "dedup.h"
+#include "stats.h"
+
+typedef struct op_stats {
+  uint64_t count;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t max_ns;
+  uint64_t buckets[STATS_BUCKETS];
+} op_stats_t;
+
+static op_stats_t ops[TRACE_OP_COUNT];
+static uint64_t counters[STATS_COUNTER_COUNT];
+static dcache_stats_t dcache_base; // dcache counters at the last reset
+static uint64_t reset_ns;
+
+static const char *counter_names[] = {
+  "block_allocs", "blocks_allocated", "block_frees", "blocks_freed",
+  "image_grows", "inode_allocs", "inode_frees", "alloc_failures",
+  "chunk_bytes", "chunk_stored", "chunk_cache_hits", "chunk_cache_misses",
+  "dedup_lookups", "dedup_hits", "dedup_copies", "readahead_blocks",
+  "random_switches",
+};
+
+uint64_t stats_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Histogram bucket for a value: values below STATS_SUB_BUCKETS get a bucket
+// each, after that every power of two gets STATS_SUB_BUCKETS of them.
+static int bucket_of(uint64_t v) {
+  if (v < STATS_SUB_BUCKETS) {
+    return v;
+  }
+  int exp = 63 - __builtin_clzll(v);
+  int shift = exp - STATS_SUB_BITS;
+  int b = (shift + 1) * STATS_SUB_BUCKETS + ((v >> shift) & (STATS_SUB_BUCKETS - 1));
+  return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+// Largest value that falls in a bucket
+static uint64_t bucket_top(int b) {
+  if (b < STATS_SUB_BUCKETS) {
+    return b;
+  }
+  int shift = b / STATS_SUB_BUCKETS - 1;
+  uint64_t low = (uint64_t) (STATS_SUB_BUCKETS + b % STATS_SUB_BUCKETS) << shift;
+  return low + ((uint64_t) 1 << shift) - 1;
+}
+
+void stats_op(trace_op_t op, uint64_t start, int64_t bytes, long rv) {
+  uint64_t ns = stats_now() - start;
+  op_stats_t *s = &ops[op];
+
+  __atomic_add_fetch(&s->count, 1, __ATOMIC_RELAXED);
+  if (rv < 0) {
+    __atomic_add_fetch(&s->errors, 1, __ATOMIC_RELAXED);
+  }
+  if (bytes > 0) {
+    __atomic_add_fetch(&s->bytes, bytes, __ATOMIC_RELAXED);
+  }
+  __atomic_add_fetch(&s->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+
+  uint64_t max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+  while (ns > max &&
+         !__atomic_compare_exchange_n(&s->max_ns, &max, ns, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+void stats_count(stats_counter_t counter, long n) {
+  __atomic_add_fetch(&counters[counter], n, __ATOMIC_RELAXED);
+}
+
+// Operations that finish during a reset may be half counted; that is fine
+// for statistics.
+void stats_reset() {
+  memset(ops, 0, sizeof(ops));
+  memset(counters, 0, sizeof(counters));
+  dcache_get_stats(&dcache_base);
+  reset_ns = stats_now();
+}
+
+// Latency at the given quantile (0..1) from a histogram, in ns
+static uint64_t percentile(const op_stats_t *s, uint64_t total, double q) {
+  uint64_t want = (uint64_t) (q * total);
+  if (want >= total) {
+    want = total - 1;
+  }
+  uint64_t seen = 0;
+  for (int b = 0; b < STATS_BUCKETS; b++) {
+    seen += s->buckets[b];
+    if (seen > want) {
+      uint64_t top = bucket_top(b);
+      return top < s->max_ns ? top : s->max_ns;
+    }
+  }
+  return s->max_ns;
+}
+
+char *stats_report(size_t *len) {
+  char *buf = NULL;
+  FILE *out = open_memstream(&buf, len);
+  if (out == NULL) {
+    return NULL;
+  }
+
+  fprintf(out, "since_reset_s %.3f\n\n", (stats_now() - reset_ns) / 1e9);
+  fprintf(out, "%-12s %10s %8s %14s %10s %10s %10s %10s %10s\n", "op",
+          "count", "errors", "bytes", "p50_us", "p90_us", "p99_us",
+          "p999_us", "max_us");
+  for (int i = 0; i < TRACE_OP_COUNT; i++) {
+    // copy so the row is consistent with itself while others keep counting
+    op_stats_t s;
+    memcpy(&s, &ops[i], sizeof(s));
+    uint64_t total = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+      total += s.buckets[b];
+    }
+    if (total == 0) {
+      continue;
+    }
+    fprintf(out, "%-12s %10lu %8lu %14lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            trace_op_name(i), s.count, s.errors, s.bytes,
+            percentile(&s, total, 0.5) / 1e3, percentile(&s, total, 0.9) / 1e3,
+            percentile(&s, total, 0.99) / 1e3,
+            percentile(&s, total, 0.999) / 1e3, s.max_ns / 1e3);
+  }
+
+  fprintf(out, "\n");
+  for (int i = 0; i < STATS_COUNTER_COUNT; i++) {
+    fprintf(out, "%-18s %lu\n", counter_names[i],
+            __atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+  }
+
+  dcache_stats_t dc;
+  dcache_get_stats(&dc);
+  long hits = dc.hits - dcache_base.hits;
+  long misses = dc.misses - dcache_base.misses;
+  fprintf(out, "\n");
+  fprintf(out, "%-18s %ld\n", "dcache_hits", hits);
+  fprintf(out, "%-18s %ld\n", "dcache_misses", misses);
+  fprintf(out, "%-18s %ld\n", "dcache_neg_hits",
+          dc.negative_hits - dcache_base.negative_hits);
+  fprintf(out, "%-18s %ld\n", "dcache_invalidated",
+          dc.invalidations - dcache_base.invalidations);
+  fprintf(out, "%-18s %.1f%%\n", "dcache_hit_rate",
+          hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0);
+  fprintf(out, "%-18s %ld\n", "dedup_saved", dedup_saved());
+
+  if (fclose(out) != 0) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
@@ -0,0 +1,67 @@
+// Runtime statistics: per-operation counts, bytes and latency histograms,
+// allocator counters and dentry cache hit rates.
+//
+// Latencies go into HDR-style log-linear histograms: each power of two is
+// split into STATS_SUB_BUCKETS equal buckets, so a percentile is accurate
+// to within 1/STATS_SUB_BUCKETS of its value whatever the scale, in a
+// fixed amount of memory. Everything is updated with relaxed atomic adds,
+// so recording is safe from any thread and never blocks.
+//
+// nufs serves the report as the file /.nufs-stats; writing to it resets
+// the statistics.
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "trace.h"
+
+#define STATS_PATH "/.nufs-stats"
+
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_EXP 36 // latencies from 2^36ns (about a minute) up share a bucket
+#define STATS_BUCKETS ((STATS_MAX_EXP - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+// Allocator counters
+typedef enum stats_counter {
+  STATS_BLOCK_ALLOCS,     // alloc_blocks calls that succeeded
+  STATS_BLOCKS_ALLOCATED,
+  STATS_BLOCK_FREES,      // free_blocks calls
+  STATS_BLOCKS_FREED,
+  STATS_IMAGE_GROWS,      // times the image file was extended
+  STATS_INODE_ALLOCS,
+  STATS_INODE_FREES,
+  STATS_ALLOC_FAILURES,   // out of blocks or inodes
+  STATS_CHUNK_BYTES,      // file data written to compressed chunks
+  STATS_CHUNK_STORED,     // bytes that data took once compressed
+  STATS_CHUNK_HITS,       // compressed chunks found in the chunk cache
+  STATS_CHUNK_MISSES,     // and decompressed
+  STATS_DEDUP_LOOKUPS,    // full blocks looked up in the dedup index
+  STATS_DEDUP_HITS,       // and shared with an identical block
+  STATS_DEDUP_COPIES,     // shared blocks copied before being changed
+  STATS_READAHEAD_BLOCKS, // file blocks prefetched for sequential reads
+  STATS_RANDOM_SWITCHES,  // times the data region was switched to MADV_RANDOM
+  STATS_COUNTER_COUNT
+} stats_counter_t;
+
+// The current time in nanoseconds, to pass to stats_op when done.
+uint64_t stats_now();
+
+// Record that operation op (a trace op code) started at start has finished,
+// having moved bytes bytes, with result rv (negative on error).
+void stats_op(trace_op_t op, uint64_t start, int64_t bytes, long rv);
+
+// Add n to a counter.
+void stats_count(stats_counter_t counter, long n);
+
+// Start counting from zero again.
+void stats_reset();
+
+// Render the statistics as text into a malloc'd buffer, setting len to its
+// length. Returns NULL if out of memory.
+char *stats_report(size_t *len);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // SEEK_DATA, SEEK_HOLE
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -5,7 +6,9 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "storage.h"
 #include "slist.h"
@@ -13,18 +16,84 @@
 #include "inode.h"
 #include "directory.h"
 #include "bitmap.h"
+#include "chunk.h"
+#include "dcache.h"
+#include "dedup.h"
+#include "flush.h"
+#include "journal.h"
+#include "path.h"
+#include "readahead.h"
+
+// Renames are done one at a time so two of them can't interleave their link
+// and unlink steps
+static pthread_mutex_t renameLock = PTHREAD_MUTEX_INITIALIZER;
 
 // Initializes the root directory
 void storage_init(const char *path) {
   // Initializes the blocks
   blocks_init(path);
-
-  void *block = get_blocks_bitmap();
+  inode_locks_init(blocks_get_superblock()->inode_count);
+  readahead_init(blocks_get_superblock()->inode_count);
+  dcache_init(DCACHE_ENTRIES);
+  chunk_init();
+  dedup_init();
 
   // Initializes the root directory if it's not allocated
-  if (!bitmap_get(block, 4)) {
+  if (!bitmap_get(get_inode_bitmap(), 0)) {
+    journal_begin();
     directory_init();
+    journal_end();
+  }
+
+  // Files that were still open without names at the last unmount, or crash
+  storage_free_orphans();
+}
+
+// Resolve a path once for a file about to be opened. Returns its inum, for
+// the *_inum functions, or -ENOENT.
+int storage_open(const char *path) {
+  int inum = tree_lookup(path);
+
+  return inum < 0 ? -ENOENT : inum;
+}
+
+// Look up a name in the directory with the given inum. Returns the inum it
+// names or -ENOENT.
+int storage_lookup(int parent, const char *name, int len) {
+  inode_t *dd = get_inode(parent);
+  if (!S_ISDIR(dd->mode)) {
+    return -ENOTDIR;
+  }
+
+  inode_read_lock(parent);
+  int inum = directory_lookup(dd, name, len);
+  inode_unlock(parent);
+
+  return inum < 0 ? -ENOENT : inum;
+}
+
+// Populate the given out param with the inode's attributes. Returns 0 on
+// success and -ENOENT if the inode isn't in use.
+int storage_stat_inum(int inum, struct stat *st) {
+  inode_t* node = get_inode(inum);
+  inode_read_lock(inum);
+  if (!inode_in_use(inum)) {
+    inode_unlock(inum);
+    return -ENOENT;
   }
+
+  st->st_ino = inum;
+  st->st_nlink = node->refs;
+  st->st_size = node->size;
+  st->st_blksize = BLOCK_SIZE;
+  st->st_blocks = (blkcnt_t) inode_count_blocks(node) * (BLOCK_SIZE / 512);
+  st->st_mode = node->mode;
+  st->st_atime = node->access_time;
+  st->st_ctime = node->create_time;
+  st->st_mtime = node->modification_time;
+  inode_unlock(inum);
+
+  return 0;
 }
 
 // Populate the given out param with the correct data, return -1 if error
@@ -34,212 +103,760 @@ int storage_stat(const char *path, struct stat *st) {
   int inum = tree_lookup(path);
 
   // If valid inum, populate st
-  if (inum > 0) {
-    inode_t* node = get_inode(inum);
-    st->st_nlink = node->refs;
-    st->st_size = node->size;
-    st->st_mode = node->mode;
-    st->st_atime = node->access_time;
-    st->st_ctime = node->create_time;
-    st->st_mtime = node->modification_time;
-
+  if (inum > 0 && storage_stat_inum(inum, st) == 0) {
     return 0;
-  }	
+  }
 
   return -1;
 }
 
-// Read from file. Return the read size
-int storage_read(const char *path, char *buf, size_t size, off_t offset) {
-  // Get inode of path
-  int inum = tree_lookup(path);
+// Grow or shrink inode to given size
+static int truncate_inode(inode_t *node, off_t size) {
+  if (node->size < size) {
+    return grow_inode(node, size);
+  }
+  else {
+    return shrink_inode(node, size);
+  }
+}
+
+// Read from the file with the given inum. Return the read size
+int storage_read_inum(int inum, char *buf, size_t size, off_t offset) {
   inode_t *node = get_inode(inum);
 
+  inode_read_lock(inum);
+
+  // Nothing past the end of the file
+  if (offset >= node->size) {
+    inode_unlock(inum);
+    return 0;
+  }
+  if (offset + size > node->size) {
+    size = node->size - offset;
+  }
+
+  if (node->flags & INODE_INLINE) {
+    memcpy(buf, node->inline_data + offset, size);
+    inode_unlock(inum);
+    return size;
+  }
+  if (node->flags & INODE_COMPRESSED) {
+    int rv = chunk_read(node, buf, size, offset);
+    inode_unlock(inum);
+    return rv;
+  }
+
+  readahead_note(inum, node, offset, size);
+
   int sizeCpy = size, offsetCpy = offset;
 
   int i = 0;
   while (sizeCpy > 0) {
-    int pnum = inode_get_bnum(node, offsetCpy);
-    char *block = blocks_get_block(pnum);
-
-    block += offsetCpy % BLOCK_SIZE;
+    // Copy a whole run of contiguous blocks at once
+    int pnum;
+    int run = inode_map_blocks(node, offsetCpy / BLOCK_SIZE, &pnum);
 
-    int min = BLOCK_SIZE - (offsetCpy % BLOCK_SIZE);
+    int min = run * BLOCK_SIZE - (offsetCpy % BLOCK_SIZE);
 
     if (sizeCpy < min) {
       min = sizeCpy;
     }
 
-    memcpy(buf + i, block, min);
+    // Holes read back as zeros
+    if (pnum == 0) {
+      memset(buf + i, 0, min);
+    }
+    else {
+      char *block = blocks_get_block(pnum);
+      memcpy(buf + i, block + offsetCpy % BLOCK_SIZE, min);
+    }
 
     i += min;
     offsetCpy += min;
     sizeCpy -= min;
   }
+  inode_unlock(inum);
 
   return size;
 }
 
-// Write to file. Return the write size
-int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
+// Read from file. Return the read size
+int storage_read(const char *path, char *buf, size_t size, off_t offset) {
   // Get inode of path
   int inum = tree_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+
+  return storage_read_inum(inum, buf, size, offset);
+}
+
+// Write to the file with the given inum. Return the write size
+int storage_write_inum(int inum, const char *buf, size_t size, off_t offset) {
   inode_t *node = get_inode(inum);
 
+  journal_begin();
+  inode_write_lock(inum);
+
+  // The file may have been deleted since it was looked up
+  if (!inode_in_use(inum)) {
+    inode_unlock(inum);
+    journal_end();
+    return -ENOENT;
+  }
+
+  // Sizes are kept in an int
+  if (offset < 0 || offset + (off_t) size > INODE_MAX_SIZE) {
+    inode_unlock(inum);
+    journal_end();
+    return -EFBIG;
+  }
   int newSize = size + offset;
+
+  // Small files stay in the inode. Compared in off_t, so a large offset
+  // can't wrap around and look small.
+  if ((node->flags & INODE_INLINE) &&
+      offset + (off_t) size <= (off_t) INODE_INLINE_SIZE) {
+    journal_dirty(node, sizeof(inode_t));
+    memcpy(node->inline_data + offset, buf, size);
+    if (node->size < newSize) {
+      node->size = newSize;
+    }
+    inode_unlock(inum);
+    journal_end();
+    return size;
+  }
+  if (node->flags & INODE_COMPRESSED) {
+    int rv = chunk_write(node, buf, size, offset);
+    inode_unlock(inum);
+    journal_end();
+    return rv;
+  }
+  if (dedup_active()) {
+    int rv = dedup_write(node, buf, size, offset);
+    inode_unlock(inum);
+    journal_end();
+    return rv;
+  }
+
+  // Allocate only the blocks being written; anything skipped over stays a
+  // hole
+  if (size > 0) {
+    int rv = inode_alloc_range(node, offset / BLOCK_SIZE,
+                               bytes_to_blocks(offset + size));
+    if (rv < 0) {
+      inode_unlock(inum);
+      journal_end();
+      return rv;
+    }
+  }
+
   if (node->size < newSize) {
-    storage_truncate(path, newSize);
+    int rv = grow_inode(node, newSize);
+    if (rv < 0) {
+      inode_unlock(inum);
+      journal_end();
+      return rv;
+    }
   }
 
+  readahead_note(inum, node, offset, size);
+
   int sizeCpy = size, offsetCpy = offset;
 
   int i = 0;
 
   while (sizeCpy > 0) {
-    int pnum = inode_get_bnum(node, offsetCpy);
+    int pnum;
+    int run = inode_map_blocks(node, offsetCpy / BLOCK_SIZE, &pnum);
     char *block = blocks_get_block(pnum);
 
     block += offsetCpy % BLOCK_SIZE;
 
-    int min = BLOCK_SIZE - (offsetCpy % BLOCK_SIZE);
+    int min = run * BLOCK_SIZE - (offsetCpy % BLOCK_SIZE);
 
     if (sizeCpy < min) {
       min = sizeCpy;
     }
 
     memcpy(block, buf + i, min);
+    flush_mark(pnum, bytes_to_blocks(offsetCpy % BLOCK_SIZE + min));
     i += min;
     offsetCpy += min;
-    sizeCpy -= min;	
+    sizeCpy -= min;
   }
+  inode_unlock(inum);
+  journal_end();
 
   return size;
 }
 
-// Truncate the file by the given size. Return 0 for success.
-int storage_truncate(const char *path, off_t size) {
-  // Get inode of path of path
-  int inum = tree_lookup(path);
+// Describe [offset, offset + size) of a file, all of it in blocks, as runs
+// of bytes in the image. Returns the number of runs, or -EAGAIN at a hole.
+static int map_spans(inode_t *node, off_t offset, size_t size,
+                     storage_span_t *spans) {
+  int count = 0;
+  off_t end = offset + size;
+
+  for (off_t pos = offset; pos < end;) {
+    int pnum;
+    int run = inode_map_blocks(node, pos / BLOCK_SIZE, &pnum);
+    if (pnum == 0) {
+      return -EAGAIN;
+    }
+
+    off_t from = pos % BLOCK_SIZE;
+    off_t len = (off_t) run * BLOCK_SIZE - from;
+    if (len > end - pos) {
+      len = end - pos;
+    }
+    spans[count].pos = (off_t) pnum * BLOCK_SIZE + from;
+    spans[count].len = len;
+    count++;
+    pos += len;
+  }
+
+  return count;
+}
+
+int storage_read_spans(int inum, off_t offset, size_t size,
+                       storage_span_t *spans, int max) {
   inode_t *node = get_inode(inum);
+  if (max < (int) (size / BLOCK_SIZE) + 2) {
+    return -EAGAIN;
+  }
 
-  // Grow or shrink inode to given size
-  if (node->size < size) {
-    grow_inode(node, size);
+  inode_read_lock(inum);
+  if (node->flags & (INODE_INLINE | INODE_COMPRESSED)) {
+    inode_unlock(inum);
+    return -EAGAIN;
+  }
+
+  // Nothing past the end of the file
+  if (offset >= node->size) {
+    return 0;
+  }
+  if (offset + size > node->size) {
+    size = node->size - offset;
+  }
+
+  int rv = map_spans(node, offset, size, spans);
+  if (rv < 0) {
+    inode_unlock(inum);
   }
   else {
-    shrink_inode(node, size);
+    readahead_note(inum, node, offset, size);
   }
+  return rv;
+}
 
-  return 0;
+int storage_write_spans(int inum, off_t offset, size_t size,
+                        storage_span_t *spans, int max) {
+  inode_t *node = get_inode(inum);
+  if (max < (int) (size / BLOCK_SIZE) + 2) {
+    return -EAGAIN;
+  }
+  // Sizes are kept in an int
+  if (offset < 0 || offset + (off_t) size > INODE_MAX_SIZE) {
+    return -EFBIG;
+  }
+
+  journal_begin();
+  inode_write_lock(inum);
+
+  int rv = inode_in_use(inum) ? 0 : -ENOENT;
+  if (rv == 0 &&
+      ((node->flags & (INODE_INLINE | INODE_COMPRESSED)) || dedup_active())) {
+    rv = -EAGAIN;
+  }
+  if (rv == 0 && size > 0) {
+    rv = inode_alloc_range(node, offset / BLOCK_SIZE,
+                           bytes_to_blocks(offset + size));
+  }
+  if (rv == 0 && node->size < (off_t) (offset + size)) {
+    rv = grow_inode(node, offset + size);
+  }
+  if (rv == 0) {
+    rv = map_spans(node, offset, size, spans);
+  }
+
+  if (rv < 0) {
+    inode_unlock(inum);
+    journal_end();
+  }
+  return rv;
 }
 
-// Helper function that splits the given path into the parent path and current
-// directory
-void split_path(const char *path, char *parent, char *curr) {
-  slist_t *pathList = s_explode(path, '/');
-  slist_t *dir = pathList;
-  parent[0] = 0;
+void storage_spans_done(int inum, int write, storage_span_t *spans,
+                        int count) {
+  for (int i = 0; write && i < count; i++) {
+    int from = spans[i].pos % BLOCK_SIZE;
+    flush_mark(spans[i].pos / BLOCK_SIZE, bytes_to_blocks(from + spans[i].len));
+  }
 
-  while (dir->next) {
-    strcat(parent, "/");
-    strcat(parent, dir->data);
-    dir = dir->next;
+  inode_unlock(inum);
+  if (write) {
+    journal_end();
   }
+}
 
-  memcpy(curr, dir->data, strlen(dir->data));
-  curr[strlen(dir->data)] = 0;
-  s_free(pathList);		
+// Write to file. Return the write size
+int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
+  // Get inode of path
+  int inum = tree_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+
+  return storage_write_inum(inum, buf, size, offset);
 }
 
-// Creates a new inode with the given path name & attributes specified
-// by mode. Return 0 on success, EEXIST on file already exists, and ENOENT on
-// any other error
-int storage_mknod(const char *path, int mode) {
-  // If file already exists, throw file already exists error
-  if (tree_lookup(path) != -1) {
-    return -EEXIST;
-  }	
+// Do the work for storage_lseek
+static off_t seek_data_or_hole(inode_t *node, off_t offset, int whence) {
+  if (offset < 0 || offset >= node->size) {
+    return -ENXIO;
+  }
+  // Inline and compressed files are all data, as far as we tell
+  if (node->flags & (INODE_INLINE | INODE_COMPRESSED)) {
+    return whence == SEEK_DATA ? offset : node->size;
+  }
 
-  char *curr = malloc(50);
-  char *parent = malloc(strlen(path));
-  split_path(path, parent, curr);
+  // Walk the mapping one run at a time until the kind of run we want shows
+  // up. The end of the file counts as a hole.
+  int end = bytes_to_blocks(node->size);
+  int lblk = offset / BLOCK_SIZE;
+  while (lblk < end) {
+    int pnum;
+    int run = inode_map_blocks(node, lblk, &pnum);
+    if ((pnum != 0) == (whence == SEEK_DATA)) {
+      off_t found = (off_t) lblk * BLOCK_SIZE;
+      if (found < offset) {
+        found = offset;
+      }
+      return found < node->size ? found : node->size;
+    }
+    lblk += run;
+  }
 
-  // Check that parent inode exists
-  int parentInum = tree_lookup(parent);
-  if (parentInum < 0) {
-    free(curr);
-    free(parent);
+  return whence == SEEK_HOLE ? node->size : -ENXIO;
+}
+
+// Find the next data or hole at or after offset in the file with the given
+// inum
+off_t storage_lseek_inum(int inum, off_t offset, int whence) {
+  if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+    return -EINVAL;
+  }
+
+  inode_read_lock(inum);
+  off_t rv = seek_data_or_hole(get_inode(inum), offset, whence);
+  inode_unlock(inum);
+
+  return rv;
+}
+
+// Find the next data or hole at or after offset (SEEK_DATA / SEEK_HOLE).
+// Returns the new offset, or -ENXIO if offset is at or past the end of the
+// file or there is no more data.
+off_t storage_lseek(const char *path, off_t offset, int whence) {
+  int inum = tree_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+
+  return storage_lseek_inum(inum, offset, whence);
+}
+
+// Truncate the file with the given inum. Return 0 for success.
+int storage_truncate_inum(int inum, off_t size) {
+  inode_t *node = get_inode(inum);
+  if (size < 0) {
+    return -EINVAL;
+  }
+  if (size > INODE_MAX_SIZE) {
+    return -EFBIG;
+  }
+  journal_begin();
+  inode_write_lock(inum);
+  int rv = inode_in_use(inum) ? truncate_inode(node, size) : -ENOENT;
+  inode_unlock(inum);
+  journal_end();
+
+  return rv;
+}
+
+// Truncate the file by the given size. Return 0 for success.
+int storage_truncate(const char *path, off_t size) {
+  // Get inode of path of path
+  int inum = tree_lookup(path);
+  if (inum < 0) {
     return -ENOENT;
   }
 
+  return storage_truncate_inum(inum, size);
+}
+
+// Creates a new inode named name in the directory parent with the given
+// mode, holding the first dataLen bytes of data. The data is written before
+// the name appears, so nobody sees the inode empty.
+static int make_node(int parent, const char *name, int len, int mode,
+                     const char *data, int dataLen) {
+  inode_t *parentDir = get_inode(parent);
+
+  // Hold the parent so nobody else creates the same name meanwhile
+  journal_begin();
+  inode_write_lock(parent);
+
+  // If file already exists, throw file already exists error
+  if (parentDir->refs < 1) {
+    inode_unlock(parent);
+    journal_end();
+    return -ENOENT;
+  }
+  if (directory_lookup(parentDir, name, len) >= 0) {
+    inode_unlock(parent);
+    journal_end();
+    return -EEXIST;
+  }
+
   // Initialize new inode
-  int newInode = alloc_inode();
+  int newInode = alloc_inode(mode);
+  if (newInode < 0) {
+    inode_unlock(parent);
+    journal_end();
+    return -ENOSPC;
+  }
   inode_t *node = get_inode(newInode);
+  journal_dirty(node, sizeof(inode_t));
   node->mode = mode;
   node->size = 0;
   node->refs = 1;
-  inode_t *parentDir = get_inode(parentInum);
+  if (S_ISREG(mode) && chunk_enabled()) {
+    node->flags |= INODE_COMPRESSED;
+  }
+  node->create_time = time(NULL);
+  node->access_time = node->create_time;
+  node->modification_time = node->create_time;
+
+  int rv = 0;
+  if (dataLen > 0) {
+    rv = storage_write_inum(newInode, data, dataLen, 0);
+  }
 
   // Put new inode in parent directory
-  directory_put(parentDir, curr, newInode);
+  if (rv >= 0) {
+    rv = directory_put(parentDir, name, len, newInode);
+  }
+  if (rv < 0) {
+    free_inode(newInode);
+  }
+  inode_unlock(parent);
+  journal_end();
 
-  free(curr);
-  free(parent);
+  return rv < 0 ? rv : newInode;
+}
+
+// Creates a new inode named name in the directory parent with the given
+// mode. Returns the new inum, -EEXIST if the name is taken, or another
+// negative errno.
+int storage_mknod_at(int parent, const char *name, int len, int mode) {
+  return make_node(parent, name, len, mode, NULL, 0);
+}
+
+// Creates a new inode with the given path name & attributes specified
+// by mode. Return 0 on success, EEXIST on file already exists, and ENOENT on
+// any other error
+int storage_mknod(const char *path, int mode) {
+  int parentLen, nameLen;
+  const char *name;
+  path_split(path, &parentLen, &name, &nameLen);
+
+  // Check that parent inode exists
+  int parentInum = tree_lookup_n(path, parentLen);
+  if (parentInum < 0) {
+    return -ENOENT;
+  }
+
+  int rv = storage_mknod_at(parentInum, name, nameLen, mode);
+  if (rv < 0) {
+    return rv;
+  }
+  dcache_invalidate(path);
 
   return 0;
 }
 
+// Creates a symbolic link named name in the directory parent, pointing at
+// target. Returns the new inum or a negative errno.
+int storage_symlink_at(int parent, const char *name, int len,
+                       const char *target) {
+  int targetLen = strlen(target);
+  if (targetLen == 0) {
+    return -ENOENT;
+  }
+  if (targetLen >= PATH_MAX) {
+    return -ENAMETOOLONG;
+  }
+
+  return make_node(parent, name, len, S_IFLNK | 0777, target, targetLen);
+}
+
+// Creates a symbolic link at path 'to' pointing at 'from'
+int storage_sym_link(const char *from, const char *to) {
+  int parentLen, nameLen;
+  const char *name;
+  path_split(to, &parentLen, &name, &nameLen);
+
+  int parentInum = tree_lookup_n(to, parentLen);
+  if (parentInum < 0) {
+    return -ENOENT;
+  }
+
+  int rv = storage_symlink_at(parentInum, name, nameLen, from);
+  if (rv < 0) {
+    return rv;
+  }
+  dcache_invalidate(to);
+
+  return 0;
+}
+
+// Copies the target of the symbolic link inum into buf, cut short to fit
+// and NUL-terminated. Returns 0, or -EINVAL if inum isn't a link.
+int storage_readlink_inum(int inum, char *buf, size_t size) {
+  if (size == 0) {
+    return -EINVAL;
+  }
+  if (!S_ISLNK(get_inode(inum)->mode)) {
+    return -EINVAL;
+  }
+
+  int rv = storage_read_inum(inum, buf, size - 1, 0);
+  if (rv < 0) {
+    return rv;
+  }
+  buf[rv] = 0;
+
+  return 0;
+}
+
+// Reads the target of the symbolic link at path
+int storage_readlink(const char *path, char *buf, size_t size) {
+  int inum = tree_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+
+  return storage_readlink_inum(inum, buf, size);
+}
+
+// Remove name from the directory parent, setting isDir if it named a
+// directory
+static int unlink_at(int parent, const char *name, int len, int *isDir) {
+  inode_t *parentNode = get_inode(parent);
+
+  // Delete inode
+  journal_begin();
+  inode_write_lock(parent);
+  int target = directory_lookup(parentNode, name, len);
+  if (isDir) {
+    *isDir = target >= 0 && S_ISDIR(get_inode(target)->mode);
+  }
+  int rv = directory_delete(parentNode, name, len);
+  inode_unlock(parent);
+  journal_end();
+
+  return rv;
+}
+
+// Remove name from the directory parent
+int storage_unlink_at(int parent, const char *name, int len) {
+  return unlink_at(parent, name, len, NULL);
+}
+
 // Deletes the given path from the filesystem
 // Unlink path from filesystem
 int storage_unlink(const char *path) {
-  char *curr = malloc(50);
-  char *parent = malloc(strlen(path));
-  split_path(path, parent, curr);
+  int parentLen, nameLen;
+  const char *name;
+  path_split(path, &parentLen, &name, &nameLen);
 
-  int inum = tree_lookup(parent);
-  inode_t *parentNode = get_inode(inum);
+  int inum = tree_lookup_n(path, parentLen);
+  if (inum < 0) {
+    return -ENOENT;
+  }
 
-  // Delete inode
-  int rv = directory_delete(parentNode, curr);
+  int isDir;
+  int rv = unlink_at(inum, name, nameLen, &isDir);
 
-  free(curr);
-  free(parent);
+  // Cached paths below a directory go away with it
+  if (isDir) {
+    dcache_invalidate_tree(path);
+  }
+  else {
+    dcache_invalidate(path);
+  }
 
   return rv;
 }
 
+// Creates a new link name in the directory parent to the inode inum.
+// Returns 0 on success and a negative errno on error.
+int storage_link_at(int inum, int parent, const char *name, int len) {
+  if (parent == inum) {
+    return -EINVAL;
+  }
+  inode_t *parentNode = get_inode(parent);
+  inode_t *node = get_inode(inum);
+
+  // Lock the directory, then the file, like directory_delete does
+  journal_begin();
+  inode_write_lock(parent);
+  int rv;
+  if (directory_lookup(parentNode, name, len) >= 0) {
+    rv = -EEXIST;
+  }
+  else {
+    inode_write_lock(inum);
+    rv = node->refs < 1 ? -ENOENT
+                        : directory_put(parentNode, name, len, inum);
+    // Increases references at inode
+    if (rv == 0) {
+      journal_dirty(node, sizeof(inode_t));
+      node->refs += 1;
+    }
+    inode_unlock(inum);
+  }
+  inode_unlock(parent);
+  journal_end();
+
+  return rv;
+}
 
-// Creates a new link to the given file. Returns 0 on success and -1 on error.
+// Creates a new link 'to' to the existing file 'from'. Returns 0 on success
+// and a negative errno on error.
 int storage_link(const char *from, const char *to) {
-  // Check that 'to' inode exists
-  int inum = tree_lookup(to);
+  // Check that 'from' inode exists
+  int inum = tree_lookup(from);
   if (inum < 0) {
     return -ENOENT;
   }
 
-  char *curr = malloc(50);
-  char *parent = malloc(strlen(from));
-  split_path(from, parent, curr);
+  int parentLen, nameLen;
+  const char *name;
+  path_split(to, &parentLen, &name, &nameLen);
 
   // Get parent inode
-  int parentInum = tree_lookup(parent);
-  inode_t *parentNode = get_inode(parentInum);
+  int parentInum = tree_lookup_n(to, parentLen);
+  if (parentInum < 0) {
+    return -ENOENT;
+  }
 
-  // Increases references at inode
-  directory_put(parentNode, curr, inum);
-  get_inode(inum)->refs += 1;
+  int rv = storage_link_at(inum, parentInum, name, nameLen);
 
-  free(curr);
-  free(parent);
+  // A directory linked here (by rename) may have cached misses below it
+  if (rv == 0) {
+    if (S_ISDIR(get_inode(inum)->mode)) {
+      dcache_invalidate_tree(to);
+    }
+    else {
+      dcache_invalidate(to);
+    }
+  }
 
-  return 0;
+  return rv;
 }
 
+// Do the work for storage_rename_at; the caller holds renameLock
+static int rename_at(int parent, const char *name, int len, int newParent,
+                     const char *newName, int newLen) {
+  int inum = storage_lookup(parent, name, len);
+  if (inum < 0) {
+    return inum;
+  }
+
+  // Renaming something onto itself changes nothing
+  if (parent == newParent && len == newLen &&
+      memcmp(name, newName, len) == 0) {
+    return 0;
+  }
 
-// Renames the given file. Return 0 on success, ENOENT on error.
+  if (storage_lookup(newParent, newName, newLen) >= 0) {
+    unlink_at(newParent, newName, newLen, NULL);
+  }
+
+  int rv = storage_link_at(inum, newParent, newName, newLen);
+  if (rv < 0) {
+    return rv;
+  }
+
+  return unlink_at(parent, name, len, NULL);
+}
+
+// Renames name in the directory parent to newName in newParent, replacing
+// newName if it exists. Return 0 on success or a negative errno.
+int storage_rename_at(int parent, const char *name, int len, int newParent,
+                      const char *newName, int newLen) {
+  // One handle covers both steps, so a crash can't leave just one of them
+  journal_begin();
+  pthread_mutex_lock(&renameLock);
+  int rv = rename_at(parent, name, len, newParent, newName, newLen);
+  pthread_mutex_unlock(&renameLock);
+  journal_end();
+
+  return rv;
+}
+
+// Renames the given file, replacing 'to' if it exists. Return 0 on success,
+// ENOENT on error.
 int storage_rename(const char *from, const char *to) {
-  storage_link(from, to);
-  storage_unlink(from);
+  int fromParentLen, fromLen, toParentLen, toLen;
+  const char *fromName, *toName;
+  path_split(from, &fromParentLen, &fromName, &fromLen);
+  path_split(to, &toParentLen, &toName, &toLen);
+
+  int fromParent = tree_lookup_n(from, fromParentLen);
+  int toParent = tree_lookup_n(to, toParentLen);
+  if (fromParent < 0 || toParent < 0) {
+    return -ENOENT;
+  }
+
+  journal_begin();
+  pthread_mutex_lock(&renameLock);
+
+  // Cached paths below either name go away if it is a directory
+  int moved = tree_lookup(from);
+  int replaced = tree_lookup(to);
+  int isDir = (moved >= 0 && S_ISDIR(get_inode(moved)->mode)) ||
+              (replaced >= 0 && S_ISDIR(get_inode(replaced)->mode));
+
+  int rv = rename_at(fromParent, fromName, fromLen, toParent, toName, toLen);
+  if (isDir) {
+    dcache_invalidate_tree(from);
+    dcache_invalidate_tree(to);
+  }
+  else {
+    dcache_invalidate(from);
+    dcache_invalidate(to);
+  }
+  pthread_mutex_unlock(&renameLock);
+  journal_end();
+
+  return rv;
+}
+
+// Sets the timespec for the file with the given inum
+int storage_set_time_inum(int inum, const struct timespec ts[2]) {
+  inode_t *node = get_inode(inum);
+
+  // Modify time stats
+  journal_begin();
+  inode_write_lock(inum);
+  journal_dirty(node, sizeof(inode_t));
+  node->access_time = ts[0].tv_sec;
+  node->modification_time = ts[1].tv_sec;
+  inode_unlock(inum);
+  journal_end();
 
   return 0;
 }
@@ -251,13 +868,42 @@ int storage_set_time(const char *path, const struct timespec ts[2]) {
   if (inum < 0) {
     return -ENOENT;
   }
+
+  return storage_set_time_inum(inum, ts);
+}
+
+// Write the file with the given inum to disk: its dirty blocks, then the
+// metadata, which includes its size and block mapping. Returns 0 on success
+// or a negative errno.
+int storage_fsync_inum(int inum) {
   inode_t *node = get_inode(inum);
+  int rv = 0;
 
-  // Modify time stats
-  node->access_time = ts[0].tv_sec;
-  node->modification_time = ts[1].tv_sec;
+  inode_read_lock(inum);
+  if (!inode_in_use(inum)) {
+    inode_unlock(inum);
+    return -ENOENT;
+  }
 
-  return 0;
+  // Without a journal, directory blocks are written in place and aren't
+  // marked dirty, so they all go
+  int whole = S_ISDIR(node->mode) &&
+              blocks_get_superblock()->journal_blocks == 0;
+  int end = inode_end_lblk(node);
+  for (int lblk = 0; lblk < end && rv == 0;) {
+    int pnum;
+    int run = inode_map_blocks(node, lblk, &pnum);
+    if (run > end - lblk) {
+      run = end - lblk;
+    }
+    if (pnum != 0) {
+      rv = whole ? flush_blocks(pnum, run) : flush_range(pnum, run);
+    }
+    lblk += run;
+  }
+  inode_unlock(inum);
+
+  return rv < 0 ? rv : blocks_sync_metadata();
 }
 
 // Returns a list of the contents pointed to by the given path
@@ -265,16 +911,55 @@ slist_t *storage_list(const char *path) {
   return directory_list(path);
 }
 
+// Returns a list of the names in the directory with the given inum
+slist_t *storage_list_inum(int inum) {
+  return directory_list_inum(inum);
+}
+
+int storage_readdir(int inum, off_t offset, storage_dir_fn fn, void *arg) {
+  return directory_iterate(inum, offset, fn, arg);
+}
+
 // Access the given path. Return 0 on success and ENOENT on error
 int storage_access(const char *path) {
   int inum = tree_lookup(path);
   if (inum >= 0) {
     inode_t *node = get_inode(inum);
     time_t currTime = time(NULL);
+    journal_begin();
+    inode_write_lock(inum);
+    journal_dirty(node, sizeof(inode_t));
     node->access_time = currTime;
+    inode_unlock(inum);
+    journal_end();
 
     return 0;
   }
 
   return -ENOENT;
 }
+
+// Count a reference the kernel takes to inum
+int storage_hold_inum(int inum) {
+  return inode_hold(inum);
+}
+
+// Drop count references the kernel held to inum, freeing it if that was
+// all that kept it
+void storage_forget_inum(int inum, uint64_t count) {
+  journal_begin();
+  inode_forget(inum, count);
+  journal_end();
+}
+
+// Free the inodes kept only because the kernel referred to them
+void storage_free_orphans() {
+  journal_begin();
+  inode_free_orphans();
+  journal_end();
+}
+
+// The generation of inum, for FUSE to tell reuses of it apart
+uint32_t storage_generation(int inum) {
+  return inode_generation(inum);
+}
@@ -7,6 +7,7 @@
 #ifndef NUFS_STORAGE_H
 #define NUFS_STORAGE_H
 
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
@@ -14,11 +15,16 @@
 
 #include "slist.h"
 
+// Largest write the frontends ask FUSE for, unless NUFS_MAX_WRITE in the
+// environment says otherwise. FUSE 2 can't go past 128 KB.
+#define NUFS_MAX_WRITE (128 * 1024)
+
 void storage_init(const char *path);
 int storage_stat(const char *path, struct stat *st);
 int storage_read(const char *path, char *buf, size_t size, off_t offset);
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
 int storage_truncate(const char *path, off_t size);
+off_t storage_lseek(const char *path, off_t offset, int whence);
 int storage_mknod(const char *path, int mode);
 int storage_unlink(const char *path);
 int storage_link(const char *from, const char *to);
@@ -26,6 +32,76 @@ int storage_rename(const char *from, const char *to);
 int storage_set_time(const char *path, const struct timespec ts[2]);
 int storage_access(const char *path);
 int storage_sym_link(const char *from, const char *to);
+int storage_readlink(const char *path, char *buf, size_t size);
 slist_t *storage_list(const char *path);
 
+// The same operations on inode numbers, for callers that already know them.
+// Names are (pointer, length) pairs within a directory inode; none of these
+// resolve paths or touch the dentry cache, so they return negative errnos
+// and leave cached paths alone. storage_open resolves a path to start with.
+int storage_open(const char *path);
+int storage_lookup(int parent, const char *name, int len);
+int storage_stat_inum(int inum, struct stat *st);
+int storage_read_inum(int inum, char *buf, size_t size, off_t offset);
+int storage_write_inum(int inum, const char *buf, size_t size, off_t offset);
+int storage_truncate_inum(int inum, off_t size);
+off_t storage_lseek_inum(int inum, off_t offset, int whence);
+int storage_mknod_at(int parent, const char *name, int len, int mode);
+int storage_unlink_at(int parent, const char *name, int len);
+int storage_link_at(int inum, int parent, const char *name, int len);
+int storage_symlink_at(int parent, const char *name, int len,
+                       const char *target);
+int storage_readlink_inum(int inum, char *buf, size_t size);
+int storage_rename_at(int parent, const char *name, int len, int newParent,
+                      const char *newName, int newLen);
+int storage_set_time_inum(int inum, const struct timespec ts[2]);
+int storage_fsync_inum(int inum);
+slist_t *storage_list_inum(int inum);
+
+// The low-level frontend counts the kernel's references to each inode
+// (FUSE's lookup count), so that one losing its last name while open stays
+// until the kernel forgets it; see inode_hold in inode.h. storage_hold_inum
+// returns -ENOENT if the inode has no names left. storage_free_orphans frees
+// the orphans once the kernel can't refer to them, at unmount.
+int storage_hold_inum(int inum);
+void storage_forget_inum(int inum, uint64_t count);
+void storage_free_orphans();
+uint32_t storage_generation(int inum);
+
+// File data can also be moved straight between the image file (see
+// blocks_image_fd) and another descriptor, e.g. with splice. These find
+// where [offset, offset + size) of a plain file lies in the image, as runs
+// of bytes. spans must have room for size / BLOCK_SIZE + 2 of them.
+typedef struct storage_span {
+  off_t pos;  // byte offset in the image file
+  size_t len;
+} storage_span_t;
+
+// Map a range for reading, clipped to the end of the file, and take the
+// inode's read lock. Returns the number of spans (0 past the end), or
+// -EAGAIN if the data isn't all in blocks (inline, compressed or sparse),
+// in which case nothing is locked and storage_read_inum has to be used.
+int storage_read_spans(int inum, off_t offset, size_t size,
+                       storage_span_t *spans, int max);
+
+// Map a range for writing: allocate its blocks, grow the file, and take the
+// inode's write lock and a journal handle. Returns the number of spans,
+// -EAGAIN if the write has to go through storage_write_inum (inline,
+// compressed or deduplicated data), or another negative errno.
+int storage_write_spans(int inum, off_t offset, size_t size,
+                        storage_span_t *spans, int max);
+
+// Drop what storage_read_spans or storage_write_spans took, once the data
+// has been moved, after every call of theirs that didn't fail. Written
+// spans are marked dirty for fsync.
+void storage_spans_done(int inum, int write, storage_span_t *spans,
+                        int count);
+
+// Stream the entries of directory inum past offset to fn, see
+// directory_iterate. Their cookies are all above 2, leaving offsets 1 and 2
+// for "." and "..". Returns 0 or a negative errno.
+typedef int (*storage_dir_fn)(void *arg, const char *name, int inum,
+                              off_t cookie);
+int storage_readdir(int inum, off_t offset, storage_dir_fn fn, void *arg);
+
 #endif
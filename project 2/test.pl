@@ -2,7 +2,7 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 56;
 use IO::Handle;
 
 sub mount {
@@ -14,6 +14,11 @@ sub unmount {
     system("(make unmount 2>&1) >> test.log");
 }
 
+sub mount_ll {
+    system("(make mount_ll 2>&1) >> test.log &");
+    sleep 1;
+}
+
 sub write_text {
     my ($name, $data) = @_;
     open my $fh, ">", "mnt/$name" or return;
@@ -132,6 +137,30 @@ ok(-e "mnt/foo/file.txt", "Move a file to another directory");
 my $msg6 = read_text("foo/file.txt");
 ok($msg4 eq $msg6, "Read data back correctly");
 
+say "# Large directory";
+mkdir("mnt/many");
+for my $ii (1..500) {
+    write_text("many/file$ii.txt", "$ii");
+}
+my $count = `ls mnt/many | wc -l`;
+ok($count == 500 && read_text("many/file321.txt") eq "321",
+   "Directory with 500 entries");
+my @long = `ls -l mnt/many`;
+ok(@long == 501 && (grep { /^-.* 3 .* file321\.txt$/ } @long) == 1,
+   "Long listing of a large directory");
+
+# Deleting entries already returned mustn't make the listing skip any
+opendir(my $dh, "mnt/many");
+my %seen;
+while (my $name = readdir($dh)) {
+    next if $name eq "." || $name eq "..";
+    $seen{$name}++;
+    unlink("mnt/many/$name");
+}
+closedir($dh);
+ok(keys(%seen) == 500 && !grep({ $_ != 1 } values(%seen)),
+   "Listing while deleting returns every entry once");
+
 unmount();
 
 system("rm -f data.nufs test.log");
@@ -171,5 +200,114 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+say "# Sparse files";
+system("dd if=/dev/zero of=mnt/sparse.bin bs=1 count=1 seek=100M 2>/dev/null");
+my @st = stat("mnt/sparse.bin");
+say "# Size: $st[7], blocks: $st[12]";
+ok($st[7] == 100 * 1024 * 1024 + 1 && $st[12] <= 16,
+   "Writing past the end leaves a hole");
+ok(read_text_slice("sparse.bin", 4, 50 * 1024 * 1024) eq "\0\0\0\0",
+   "Holes read back as zeros");
+# Sizes are kept in an int, so files can't grow past 2G
+open my $big, "+<", "mnt/sparse.bin" or die;
+sysseek $big, 3 * 1024 ** 3, 0;
+my $wrote = syswrite $big, "x";
+my $write_efbig = $!{EFBIG};
+my $grown = truncate $big, 3 * 1024 ** 3;
+my $truncate_efbig = $!{EFBIG};
+close $big;
+ok(!defined $wrote && $write_efbig && !$grown && $truncate_efbig &&
+   -s "mnt/sparse.bin" == 100 * 1024 * 1024 + 1,
+   "Writes and truncates past 2G fail with EFBIG");
+
+say "# Inline data";
+write_text("tiny.txt", "tiny");
+@st = stat("mnt/tiny.txt");
+ok($st[7] == 5 && $st[12] == 0, "Small files take no data blocks");
+symlink("tiny.txt", "mnt/tiny.lnk");
+ok(readlink("mnt/tiny.lnk") eq "tiny.txt", "Symlinks read back their target");
+ok(read_text("tiny.lnk") eq "tiny\n", "Symlinks can be followed");
+
+say "# Concurrency";
+ok(system("tests/stress mnt 8 >> test.log 2>&1") == 0,
+   "Concurrent writers, readers and renames");
+
+say "# Durability";
+{
+    open my $fh, ">", "mnt/synced.txt" or die;
+    $fh->print("on disk");
+    ok($fh->flush && $fh->sync, "fsync writes a file back");
+    close $fh;
+}
+
+say "# Statistics";
+my $stats = read_text(".nufs-stats");
+ok($stats =~ /^write\s+[1-9]/m && $stats =~ /^blocks_allocated\s+[1-9]/m,
+   "Stats file reports operations and allocations");
+write_text(".nufs-stats", "reset");
+$stats = read_text(".nufs-stats");
+ok($stats !~ /^read\s/m, "Writing to the stats file resets it");
+
+unmount();
 
+say "# Extents";
+ok(system("tests/extent_test >> test.log 2>&1") == 0,
+   "Extent trees map what was inserted, through splits and truncates");
+
+say "# Journal";
+ok(system("tests/journal_test >> test.log 2>&1") == 0,
+   "Metadata is consistent after crashes");
+ok(system("NUFS_COMPRESS=1 tests/journal_test 3 >> test.log 2>&1") == 0,
+   "Compressed files are consistent after crashes");
+ok(system("NUFS_DEDUP=1 tests/journal_test 3 >> test.log 2>&1") == 0,
+   "Deduplicated files are consistent after crashes");
+
+
+say "# mkfs.nufs";
+system("rm -f data.nufs");
+my $start = time();
+ok(system("./mkfs.nufs -s 10G -j 8M -r 5 data.nufs >> test.log 2>&1") == 0 &&
+   time() - $start < 2 && (stat "data.nufs")[7] == 10 * 1024 ** 3 &&
+   (stat "data.nufs")[12] * 512 < 64 * 1024 ** 2,
+   "mkfs.nufs makes a sparse 10G image quickly");
+mount();
+write_text("fresh.txt", "formatted");
+ok(read_text("fresh.txt") eq "formatted", "An image from mkfs.nufs mounts");
+unmount();
+ok(system("./mkfs.nufs data.nufs >> test.log 2>&1") != 0,
+   "mkfs.nufs won't overwrite an image without -f");
+
+say "# fsck.nufs";
+ok(system("./fsck.nufs data.nufs >> test.log 2>&1") == 0,
+   "fsck.nufs passes a cleanly unmounted image");
+# Mark the last block used, though nothing uses it
+open my $img, "+<", "data.nufs" or die;
+binmode $img;
+read $img, my $super, 76;
+my ($bsize, $bcount, $bitmap) = (unpack "V19", $super)[2, 3, 6];
+my $byte = $bitmap * $bsize + int(($bcount - 1) / 8);
+seek $img, $byte, 0;
+read $img, my $bits, 1;
+seek $img, $byte, 0;
+print $img chr(ord($bits) | 1 << (($bcount - 1) % 8));
+close $img;
+ok(system("./fsck.nufs data.nufs >> test.log 2>&1") >> 8 == 4,
+   "fsck.nufs reports a leaked block");
+ok(system("./fsck.nufs -y data.nufs >> test.log 2>&1") >> 8 == 1 &&
+   system("./fsck.nufs data.nufs >> test.log 2>&1") == 0,
+   "fsck.nufs -y frees it");
+
+say "# Low-level frontend";
+mount_ll();
+write_text("open.txt", "still open");
+open my $open, "<", "mnt/open.txt" or die;
+unlink("mnt/open.txt");
+# Likely to take the unlinked file's inode if it were freed
+write_text("new.txt", "created after");
+my $kept = do { local $/ = undef; <$open> };
+close $open;
+ok($kept eq "still open\n" && read_text("new.txt") eq "created after",
+   "A file unlinked while open keeps its inode until closed");
+unmount();
+ok(system("./fsck.nufs data.nufs >> test.log 2>&1") == 0,
+   "Its inode is freed by the unmount at the latest");
@@ -26,5 +26,14 @@ int main(int argc, char **argv) {
   bitmap_put(bm, 255, 1);
   bitmap_print(bm, SIZE);
 
+  printf("\nFirst zero from 0: %d\n", bitmap_find_zero(bm, 0, SIZE));
+  printf("First one from 3: %d\n", bitmap_find_one(bm, 3, SIZE));
+
+  printf("\nSetting bits 100-199: %d changed\n",
+         bitmap_put_range(bm, 100, 100, 1));
+  printf("First zero from 100: %d\n", bitmap_find_zero(bm, 100, SIZE));
+  printf("Run of 40 zeros from 0: %d\n", bitmap_find_zero_run(bm, 0, SIZE, 40));
+  printf("Bits set: %d\n", bitmap_count(bm, SIZE));
+
   return 0;
 }
@@ -0,0 +1,175 @@
+// Block device benchmark: reads and writes an image a block at a time,
+// sequentially and in random order, through each blockdev backend. The
+// buffer cache is kept smaller than the image so it has to evict. Reads
+// are prefetched a batch ahead, which is where io_uring gets to submit many
+// reads at once. Prints the speed of each pass, and checks the blocks hold
+// what was last written to them.
+//
+// With -d the cache backends open the image with O_DIRECT, so every miss
+// really goes to the disk instead of the page cache.
+//
+// Usage: tests/blockdev_bench [-d] [image megabytes] [cache megabytes]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blockdev.h"
+
+#define TEST_NAME "blockdev_bench.img"
+#define BS 4096
+#define AHEAD 64 // blocks prefetched at a time
+
+static uint32_t count;
+static uint32_t *order;    // random block order, the same for every backend
+static uint32_t *expected; // what the second word of each block should be
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Blocks hold their own number in the first word and a generation in the
+// second
+static void make_image(long size) {
+  unlink(TEST_NAME);
+  int fd = open(TEST_NAME, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  uint32_t *block = calloc(BS / 4, 4);
+  count = size / BS;
+  for (uint32_t b = 0; b < count; b++) {
+    for (int i = 2; i < BS / 4; i++) {
+      block[i] = b * 31 + i;
+    }
+    block[0] = b;
+    block[1] = expected[b] = 1;
+    if (pwrite(fd, block, BS, (off_t) b * BS) != BS) {
+      printf("can't write %s\n", TEST_NAME);
+      exit(1);
+    }
+  }
+  fsync(fd);
+  close(fd);
+  free(block);
+}
+
+// One pass over the blocks in the given order, reading or stamping each
+static double pass(blockdev_t *dev, const uint32_t *bnums, int write,
+                   uint32_t gen) {
+  double start = now();
+  for (uint32_t i = 0; i < count; i++) {
+    if (!write && i % AHEAD == 0) {
+      int n = count - i < AHEAD ? count - i : AHEAD;
+      blockdev_prefetch(dev, bnums + i, n);
+    }
+
+    uint32_t b = bnums[i];
+    uint32_t *block = blockdev_get(dev, b);
+    if (!block) {
+      printf("can't get block %u: %s\n", b, strerror(errno));
+      exit(1);
+    }
+    if (block[0] != b || (!write && block[1] != expected[b])) {
+      printf("block %u holds the wrong data\n", b);
+      exit(1);
+    }
+    if (write) {
+      block[1] = expected[b] = gen;
+      blockdev_dirty(dev, b);
+    }
+    blockdev_put(dev, b);
+  }
+  if (write && blockdev_sync(dev) != 0) {
+    printf("sync failed\n");
+    exit(1);
+  }
+  return now() - start;
+}
+
+static void bench(blockdev_kind_t kind, int direct, long cacheSize,
+                  uint32_t *seq) {
+  static uint32_t gen = 1;
+  blockdev_options_t opts;
+  blockdev_default_options(&opts);
+  opts.kind = kind;
+  opts.direct = direct;
+  opts.cache_blocks = cacheSize / BS;
+
+  blockdev_t *dev = blockdev_open(TEST_NAME, &opts);
+  if (!dev) {
+    printf("%-6s unavailable: %s\n", blockdev_kind_name(kind), strerror(errno));
+    return;
+  }
+
+  double seqRead = pass(dev, seq, 0, 0);
+  double randRead = pass(dev, order, 0, 0);
+  double seqWrite = pass(dev, seq, 1, ++gen);
+  double randWrite = pass(dev, order, 1, ++gen);
+
+  blockdev_stats_t st;
+  blockdev_get_stats(dev, &st);
+  blockdev_close(dev);
+
+  // What was written must have reached the file
+  int fd = open(TEST_NAME, O_RDONLY);
+  uint32_t block[2];
+  for (uint32_t b = 0; b < count; b++) {
+    if (pread(fd, block, sizeof(block), (off_t) b * BS) != sizeof(block) ||
+        block[0] != b || block[1] != expected[b]) {
+      printf("block %u wasn't written back\n", b);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  double mb = (double) count * BS / (1024.0 * 1024.0);
+  printf("%-6s %8.1f MB/s seq read %8.1f MB/s rand read %8.1f MB/s seq write "
+         "%8.1f MB/s rand write",
+         blockdev_kind_name(kind), mb / seqRead, mb / randRead, mb / seqWrite,
+         mb / randWrite);
+  if (st.hits + st.misses > 0) {
+    printf("  hit rate %.2f %8lu evictions",
+           (double) st.hits / (st.hits + st.misses),
+           (unsigned long) st.evictions);
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  int direct = argc > 1 && strcmp(argv[1], "-d") == 0;
+  argv += direct;
+  argc -= direct;
+  long size = (argc > 1 ? atol(argv[1]) : 256) * 1024 * 1024;
+  long cacheSize = (argc > 2 ? atol(argv[2]) : 16) * 1024 * 1024;
+
+  expected = malloc(size / BS * sizeof(uint32_t));
+  make_image(size);
+
+  uint32_t *seq = malloc(count * sizeof(uint32_t));
+  order = malloc(count * sizeof(uint32_t));
+  for (uint32_t i = 0; i < count; i++) {
+    seq[i] = order[i] = i;
+  }
+  srand(1);
+  for (uint32_t i = count - 1; i > 0; i--) {
+    uint32_t j = rand() % (i + 1);
+    uint32_t t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+
+  bench(BLOCKDEV_MMAP, 0, cacheSize, seq);
+  bench(BLOCKDEV_CACHE, direct, cacheSize, seq);
+  bench(BLOCKDEV_URING, direct, cacheSize, seq);
+
+  unlink(TEST_NAME);
+  free(order);
+  free(seq);
+  free(expected);
+  return 0;
+}
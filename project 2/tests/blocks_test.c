@@ -30,6 +30,11 @@ int main(int argc, char **argv) {
   }
   putchar('\n');
 
+  int got;
+  int run = alloc_blocks(8, block_num + 1, &got);
+  printf("Allocated %d blocks at %d (wanted 8 at %d)\n", got, run,
+         block_num + 1);
+
   blocks_free();
 
   return 0;
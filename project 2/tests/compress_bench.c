@@ -0,0 +1,124 @@
+// Compression benchmark: writes a file of generated log text, and one of
+// random bytes, through the storage layer with and without NUFS_COMPRESS,
+// then reads them back after remounting. Prints the write and read speed
+// and how many blocks each file took.
+//
+// Usage: tests/compress_bench [megabytes]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "storage.h"
+
+#define TEST_NAME "compress_bench.img"
+#define WRITE_SIZE (128 * 1024)
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fill buf with lines like a service log
+static void make_log(char *buf, long size) {
+  static const char *levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN"};
+  static const char *events[] = {
+    "request served", "cache miss", "connection opened",
+    "connection closed", "retrying upstream", "slow query",
+  };
+  long pos = 0;
+  long t = 1700000000;
+
+  while (pos < size) {
+    char line[160];
+    t += rand() % 3;
+    int len = snprintf(line, sizeof(line),
+                       "%ld.%03d %s [worker-%d] %s id=%08x latency=%dms\n",
+                       t, rand() % 1000, levels[rand() % 5], rand() % 16,
+                       events[rand() % 6], rand(), rand() % 500);
+    if (len > size - pos) {
+      len = size - pos;
+    }
+    memcpy(buf + pos, line, len);
+    pos += len;
+  }
+}
+
+static void make_random(char *buf, long size) {
+  for (long i = 0; i < size; i++) {
+    buf[i] = rand();
+  }
+}
+
+static void bench(const char *label, const char *data, long size,
+                  int compress) {
+  char *back = malloc(size);
+  setenv("NUFS_COMPRESS", compress ? "1" : "0", 1);
+  unlink(TEST_NAME);
+  storage_init(TEST_NAME);
+  storage_mknod("/file", 0100644);
+
+  double start = now();
+  for (long off = 0; off < size; off += WRITE_SIZE) {
+    long n = size - off < WRITE_SIZE ? size - off : WRITE_SIZE;
+    int rv = storage_write("/file", data + off, n, off);
+    if (rv != n) {
+      printf("write failed: %d at %ld\n", rv, off);
+      exit(1);
+    }
+  }
+  double writeSecs = now() - start;
+
+  struct stat st;
+  storage_stat("/file", &st);
+
+  // Remount so nothing is cached
+  blocks_free();
+  storage_init(TEST_NAME);
+  start = now();
+  for (long off = 0; off < size; off += WRITE_SIZE) {
+    long n = size - off < WRITE_SIZE ? size - off : WRITE_SIZE;
+    if (storage_read("/file", back + off, n, off) != n) {
+      printf("read failed\n");
+      exit(1);
+    }
+  }
+  double readSecs = now() - start;
+  if (memcmp(data, back, size) != 0) {
+    printf("read back the wrong data\n");
+    exit(1);
+  }
+
+  double mb = size / (1024.0 * 1024.0);
+  double stored = st.st_blocks * 512.0;
+  printf("%-8s %-12s %8.1f MB/s write %8.1f MB/s read %9.0f KB stored  "
+         "ratio %.2f\n",
+         label, compress ? "compressed" : "plain", mb / writeSecs,
+         mb / readSecs, stored / 1024, size / stored);
+
+  blocks_free();
+  unlink(TEST_NAME);
+  free(back);
+}
+
+int main(int argc, char **argv) {
+  long size = (argc > 1 ? atol(argv[1]) : 64) * 1024 * 1024;
+  char *data = malloc(size);
+  srand(1);
+
+  make_log(data, size);
+  bench("log", data, size, 0);
+  bench("log", data, size, 1);
+
+  make_random(data, size);
+  bench("random", data, size, 0);
+  bench("random", data, size, 1);
+
+  free(data);
+  return 0;
+}
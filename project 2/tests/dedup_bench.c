@@ -0,0 +1,119 @@
+// Deduplication benchmark: writes a set of files through the storage layer
+// with and without NUFS_DEDUP, first with most of them copies of a few
+// originals, then with every one different. Prints the write speed, the
+// time per block written, and how many blocks the files took against how
+// many they hold. The second set has nothing to share, so it shows what
+// hashing and looking up every block costs.
+//
+// Usage: tests/dedup_bench [files] [kilobytes per file]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "dedup.h"
+#include "storage.h"
+
+#define TEST_NAME "dedup_bench.img"
+#define ORIGINALS 4 // files the copies are made of
+#define WRITE_SIZE (128 * 1024)
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_random(char *buf, long size) {
+  for (long i = 0; i < size; i++) {
+    buf[i] = rand();
+  }
+}
+
+static void bench(int files, long size, int copies, int dedup) {
+  char *data = malloc(size);
+  char *back = malloc(size);
+  char **originals = malloc(ORIGINALS * sizeof(char *));
+
+  srand(1);
+  for (int i = 0; i < ORIGINALS; i++) {
+    originals[i] = malloc(size);
+    make_random(originals[i], size);
+  }
+
+  setenv("NUFS_DEDUP", dedup ? "1" : "0", 1);
+  unlink(TEST_NAME);
+  storage_init(TEST_NAME);
+  superblock_t *sb = blocks_get_superblock();
+  // The image grows as it fills, so count the blocks in use
+  long usedBefore = (long) sb->block_count - sb->free_blocks;
+
+  double start = now();
+  for (int f = 0; f < files; f++) {
+    // Copies of the originals, with every fourth file one of its own. Those
+    // differ from the originals in the first bytes of every block.
+    const char *src = originals[f % ORIGINALS];
+    if (f >= ORIGINALS && (f % 4 == 3 || !copies)) {
+      memcpy(data, src, size);
+      for (long b = 0; b < size; b += BLOCK_SIZE) {
+        memcpy(data + b, &f, sizeof(f));
+      }
+      src = data;
+    }
+
+    char path[32];
+    snprintf(path, sizeof(path), "/f%d", f);
+    storage_mknod(path, 0100644);
+    for (long off = 0; off < size; off += WRITE_SIZE) {
+      long n = size - off < WRITE_SIZE ? size - off : WRITE_SIZE;
+      int rv = storage_write(path, src + off, n, off);
+      if (rv != n) {
+        printf("write failed: %d at %ld\n", rv, off);
+        exit(1);
+      }
+    }
+  }
+  double secs = now() - start;
+  long used = (long) sb->block_count - sb->free_blocks - usedBefore;
+
+  // The copies must still read back as they were written
+  for (int f = 0; f < ORIGINALS; f++) {
+    char path[32];
+    snprintf(path, sizeof(path), "/f%d", f);
+    if (storage_read(path, back, size, 0) != size ||
+        memcmp(back, originals[f], size) != 0) {
+      printf("read back the wrong data\n");
+      exit(1);
+    }
+  }
+
+  double mb = (double) files * size / (1024.0 * 1024.0);
+  long logical = (long) files * (size / BLOCK_SIZE);
+  printf("%-7s %-6s %8.1f MB/s write %7.0f ns/block %8ld blocks written "
+         "%8ld used %6ld shared  ratio %.2f\n",
+         copies ? "copies" : "unique", dedup ? "dedup" : "plain", mb / secs, secs * 1e9 / logical, logical,
+         used, dedup_saved(), (double) logical / used);
+
+  blocks_free();
+  unlink(TEST_NAME);
+  for (int i = 0; i < ORIGINALS; i++) {
+    free(originals[i]);
+  }
+  free(originals);
+  free(back);
+  free(data);
+}
+
+int main(int argc, char **argv) {
+  int files = argc > 1 ? atoi(argv[1]) : 64;
+  long size = (argc > 2 ? atol(argv[2]) : 1024) * 1024;
+
+  bench(files, size, 1, 0);
+  bench(files, size, 1, 1);
+  bench(files, size, 0, 0);
+  bench(files, size, 0, 1);
+  return 0;
+}
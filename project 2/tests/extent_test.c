@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "extent.h"
+
+#define TEST_NAME "extent_test.img"
+#define FILE_BLOCKS 20000
+
+// Reference mapping, 0 for holes
+static uint32_t expected[FILE_BLOCKS];
+
+// Check every block of the tree against the reference mapping
+int check(extent_root_t *root) {
+  uint32_t lblk = 0;
+  while (lblk < FILE_BLOCKS) {
+    uint32_t pblk;
+    uint32_t run = extent_lookup(root, lblk, &pblk);
+    if (run == 0) {
+      printf("empty run at %u\n", lblk);
+      return 0;
+    }
+    for (uint32_t i = 0; i < run && lblk + i < FILE_BLOCKS; i++) {
+      uint32_t want = expected[lblk + i];
+      uint32_t got = pblk ? pblk + i : 0;
+      if (want != got) {
+        printf("block %u: expected %u, got %u\n", lblk + i, want, got);
+        return 0;
+      }
+    }
+    lblk += run;
+  }
+
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  unlink(TEST_NAME);
+  blocks_init(TEST_NAME);
+  srand(3650);
+
+  extent_root_t root;
+  extent_init(&root);
+
+  // Map single blocks in random order so extents merge and nodes split
+  int mapped = 0;
+  while (mapped < FILE_BLOCKS / 2) {
+    uint32_t lblk = rand() % FILE_BLOCKS;
+    if (expected[lblk]) {
+      continue;
+    }
+    uint32_t pblk = 100000 + lblk * ((rand() % 4) ? 1 : 3);
+    extent_insert(&root, lblk, pblk, 1);
+    expected[lblk] = pblk;
+    mapped++;
+  }
+  int ok = check(&root);
+  printf("Random inserts: depth %d, %s\n", root.hdr.depth,
+         ok ? "ok" : "FAILED");
+  if (!ok) {
+    return 1;
+  }
+
+  // Cut the file down in a few steps. The physical blocks were never
+  // allocated, so freeing them only clears bits that are already clear.
+  for (uint32_t cut = FILE_BLOCKS; cut > 0; cut = cut * 2 / 3) {
+    extent_truncate(&root, cut);
+    for (uint32_t i = cut; i < FILE_BLOCKS; i++) {
+      expected[i] = 0;
+    }
+    if (!check(&root)) {
+      printf("Truncate to %u: FAILED\n", cut);
+      return 1;
+    }
+  }
+  extent_truncate(&root, 0);
+  printf("Truncates: depth %d, entries %d\n", root.hdr.depth,
+         root.hdr.entries);
+
+  blocks_free();
+  unlink(TEST_NAME);
+
+  return 0;
+}
@@ -0,0 +1,208 @@
+// Crash test for the metadata journal.
+//
+// A child process mounts a fresh image through the storage layer and
+// creates, writes, truncates, renames and deletes files at random until it
+// is killed at a random moment. The image is then mounted again, which
+// replays the journal, and checked: every inode and block reachable from
+// the root must be allocated exactly once, nothing else may be allocated,
+// and every link count must match the directory entries naming the inode.
+// With NUFS_DEDUP set, file data blocks may be reached more than once.
+//
+// Usage: tests/journal_test [rounds]
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "directory.h"
+#include "extent.h"
+#include "inode.h"
+#include "storage.h"
+
+#define TEST_NAME "journal_test.img"
+#define FILES 400
+
+static uint8_t *seen;  // blocks reached from the root
+static int *links;     // directory entries naming each inode
+static long reached;
+static int errors = 0;
+static int shared_ok = 0; // data blocks may be shared
+
+static void fail(const char *what, long n) {
+  printf("%s: %ld\n", what, n);
+  errors++;
+}
+
+// Count a block as reached, once
+static void reach_block(uint32_t bnum, int data) {
+  if (bnum >= (uint32_t) BLOCK_COUNT) {
+    fail("block out of range", bnum);
+  }
+  else if (bitmap_get(seen, bnum) && data && shared_ok) {
+    return;
+  }
+  else if (bitmap_get(seen, bnum)) {
+    fail("block used twice", bnum);
+  }
+  else if (!bitmap_get(get_blocks_bitmap(), bnum)) {
+    fail("block in use but free", bnum);
+  }
+  else {
+    bitmap_put(seen, bnum, 1);
+    reached++;
+  }
+}
+
+static void reach_extents(extent_header_t *hdr) {
+  extent_t *ext = (extent_t *) (hdr + 1);
+  if (hdr->magic != EXTENT_MAGIC) {
+    fail("bad extent node", hdr->magic);
+    return;
+  }
+
+  for (int i = 0; i < hdr->entries; i++) {
+    if (hdr->depth > 0) {
+      reach_block(ext[i].pblk, 0);
+      reach_extents(blocks_get_block(ext[i].pblk));
+    }
+    else {
+      for (uint32_t b = 0; b < ext[i].len; b++) {
+        reach_block(ext[i].pblk + b, 1);
+      }
+    }
+  }
+}
+
+// Visit an inode and, for a directory, everything below it
+static void reach_inode(const char *path, int inum) {
+  if (links[inum]++ > 0) {
+    return;
+  }
+  if (!bitmap_get(get_inode_bitmap(), inum)) {
+    fail("inode in use but free", inum);
+  }
+
+  inode_t *node = get_inode(inum);
+  if (!(node->flags & INODE_INLINE)) {
+    reach_extents(&node->extents.hdr);
+  }
+  if (!S_ISDIR(node->mode)) {
+    return;
+  }
+
+  slist_t *names = storage_list(path);
+  for (slist_t *item = names; item != NULL; item = item->next) {
+    char child[256];
+    snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") ? path : "",
+             item->data);
+    reach_inode(child, tree_lookup(child));
+  }
+  s_free(names);
+}
+
+// Change the filesystem at random until killed
+static void churn(int seed) {
+  static char buf[70000];
+  char name[64], to[64];
+  memset(buf, 'j', sizeof(buf));
+  srand(seed);
+
+  storage_init(TEST_NAME);
+  storage_mknod("/a", 040755);
+  storage_mknod("/b", 040755);
+  while (1) {
+    int k = rand() % FILES;
+    int m = rand() % FILES;
+    sprintf(name, "/%c/f%d", k % 2 ? 'a' : 'b', k);
+    sprintf(to, "/%c/f%d", m % 2 ? 'a' : 'b', m);
+    switch (rand() % 6) {
+    case 0:
+    case 1:
+      storage_mknod(name, 0100644);
+      break;
+    case 2:
+      storage_write(name, buf, rand() % sizeof(buf), rand() % 200000);
+      break;
+    case 3:
+      storage_unlink(name);
+      break;
+    case 4:
+      storage_truncate(name, rand() % 100000);
+      break;
+    case 5:
+      storage_rename(name, to);
+      break;
+    }
+  }
+}
+
+// Mount the image after a crash and check it
+static void check() {
+  storage_init(TEST_NAME);
+  superblock_t *sb = blocks_get_superblock();
+  seen = calloc(sb->max_blocks / 8, 1);
+  links = calloc(sb->inode_count, sizeof(int));
+  reached = 0;
+
+  reach_inode("/", 0);
+
+  // The regions before the data blocks are always marked in use
+  long used = bitmap_count(get_blocks_bitmap(), BLOCK_COUNT);
+  if (used != reached + sb->data_start) {
+    fail("blocks leaked", used - reached - sb->data_start);
+  }
+  for (int i = 1; i < (int) sb->inode_count; i++) {
+    int inUse = bitmap_get(get_inode_bitmap(), i);
+    if (inUse && links[i] == 0) {
+      fail("inode leaked", i);
+    }
+    if (inUse && get_inode(i)->refs != links[i]) {
+      fail("wrong link count", i);
+    }
+  }
+  printf("%ld blocks in use, %u free\n", used, sb->free_blocks);
+
+  free(seen);
+  free(links);
+  blocks_free();
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 5;
+  const char *dedup = getenv("NUFS_DEDUP");
+  shared_ok = dedup && atoi(dedup) > 0;
+
+  unlink(TEST_NAME);
+  int fd = open(TEST_NAME, O_CREAT | O_RDWR, 0644);
+  nufs_geometry_t geo;
+  blocks_default_geometry(&geo);
+  if (fd < 0 || blocks_format(fd, &geo) != 0) {
+    perror(TEST_NAME);
+    return 1;
+  }
+  close(fd);
+
+  for (int i = 0; i < rounds && errors == 0; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      churn(i);
+    }
+    usleep(200000 + rand() % 1500000);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+    printf("round %d: ", i);
+    check();
+  }
+  unlink(TEST_NAME);
+
+  printf(errors ? "FAILED\n" : "OK\n");
+  return errors != 0;
+}
@@ -0,0 +1,486 @@
+// Storage-layer benchmark suite: runs workloads straight against the
+// storage layer on a scratch image, with no FUSE in the way, and prints one
+// CSV row per measurement, so results can be kept and compared run to run.
+//
+// Workloads (-w, comma separated; all of them by default):
+//
+//  meta     create, stat and unlink -n empty files in one directory
+//  lookup   stat a file -d directories deep, and a missing name beside it
+//  seq      write a -m MB file sequentially in each I/O size (then fsync),
+//           and read it back after remounting with the page cache dropped
+//  rand     the same amount of reads and writes at random aligned offsets
+//  readdir  list a directory of -n entries, resuming from cookies 128
+//           entries at a time the way getdents does, and as one slist
+//  mixed    a file server: a pool of files each delete/create/write whole,
+//           append, read whole and stat, picked at random
+//
+// Each workload starts on a freshly formatted image, with room for -n
+// inodes. The image is a temporary file unless -i names one, e.g. on the
+// disk to measure; the NUFS_* settings in the environment apply as usual.
+//
+// Columns: label (-l, to tell runs apart once their CSVs are concatenated),
+// workload, op, io_size (bytes, 0 for metadata), count (operations),
+// seconds, ops_per_sec, mb_per_sec (empty for metadata). -H leaves out the
+// header, for appending to an existing file.
+//
+// Usage: nufs-bench [-w workloads] [-n files] [-d depth] [-m megabytes]
+//                   [-s io sizes] [-i image] [-l label] [-H]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "slist.h"
+#include "storage.h"
+
+#define MAX_SIZES 16
+#define LOOKUPS 200000
+#define READDIR_BATCH 128 // entries per getdents-like call
+#define READDIR_PASSES 10
+#define POOL_FILES 1000 // largest file server pool
+#define MEAN_FILE (128 * 1024)
+#define APPEND_SIZE (16 * 1024)
+
+static const char *image;
+static const char *label = "default";
+static long files = 10000;
+static int depth = 16;
+static long megabytes = 64;
+static long sizes[MAX_SIZES] = {4096, 64 * 1024, 1024 * 1024};
+static int size_count = 3;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: nufs-bench [-w workloads] [-n files] [-d depth] "
+          "[-m megabytes]\n"
+          "                  [-s io sizes] [-i image] [-l label] [-H]\n"
+          "workloads: meta,lookup,seq,rand,readdir,mixed\n");
+  exit(2);
+}
+
+// Parse a size like 4096, 64K or 1M. Returns -1 if it isn't one.
+static long parse_size(const char *text) {
+  char *end;
+  long size = strtol(text, &end, 10);
+  if (end == text || size <= 0) {
+    return -1;
+  }
+  if (*end == 'K' || *end == 'M') {
+    size *= *end == 'K' ? 1024 : 1024 * 1024;
+    end++;
+  }
+  return *end == '\0' ? size : -1;
+}
+
+static void fail(const char *what, int rv) {
+  fprintf(stderr, "nufs-bench: %s: %s\n", what, strerror(-rv));
+  exit(1);
+}
+
+// One CSV row. bytes is 0 for metadata operations.
+static void report(const char *workload, const char *op, long ioSize,
+                   long count, double secs, double bytes) {
+  printf("%s,%s,%s,%ld,%ld,%.6f,%.1f,", label, workload, op, ioSize, count,
+         secs, count / secs);
+  if (bytes > 0) {
+    printf("%.1f", bytes / (1024.0 * 1024.0) / secs);
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+// Start a workload on a fresh image with an inode for every file it makes
+static void fresh_image() {
+  int fd = open(image, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  nufs_geometry_t geo;
+  blocks_default_geometry(&geo);
+  long inodes = (files + POOL_FILES + depth + 64) / 64 * 64;
+  if (inodes > geo.inode_count) {
+    geo.inode_count = inodes;
+  }
+  if (fd < 0 || blocks_format(fd, &geo) != 0) {
+    fail(image, -errno);
+  }
+  close(fd);
+  storage_init(image);
+}
+
+// Unmount, drop the image from the page cache and mount again, so reads go
+// to the disk
+static void cold_remount() {
+  blocks_free();
+  int fd = open(image, O_RDONLY);
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+  storage_init(image);
+}
+
+static void bench_meta() {
+  char path[64];
+  fresh_image();
+  storage_mknod("/meta", 040755);
+
+  double start = now();
+  for (long i = 0; i < files; i++) {
+    snprintf(path, sizeof(path), "/meta/f%ld", i);
+    int rv = storage_mknod(path, 0100644);
+    if (rv < 0) {
+      fail(path, rv);
+    }
+  }
+  report("meta", "create", 0, files, now() - start, 0);
+
+  // In a different order than they were made
+  struct stat st;
+  start = now();
+  for (long i = 0; i < files; i++) {
+    snprintf(path, sizeof(path), "/meta/f%ld", (i * 7919) % files);
+    int rv = storage_stat(path, &st);
+    if (rv < 0) {
+      fail(path, rv);
+    }
+  }
+  report("meta", "stat", 0, files, now() - start, 0);
+
+  start = now();
+  for (long i = 0; i < files; i++) {
+    snprintf(path, sizeof(path), "/meta/f%ld", i);
+    int rv = storage_unlink(path);
+    if (rv < 0) {
+      fail(path, rv);
+    }
+  }
+  report("meta", "unlink", 0, files, now() - start, 0);
+  blocks_free();
+}
+
+static void bench_lookup() {
+  char path[4096] = "";
+  fresh_image();
+  for (int i = 0; i < depth; i++) {
+    snprintf(path + strlen(path), sizeof(path) - strlen(path), "/dir%d", i);
+    storage_mknod(path, 040755);
+  }
+  size_t dirLen = strlen(path);
+  strcat(path, "/leaf");
+  storage_mknod(path, 0100644);
+
+  struct stat st;
+  double start = now();
+  for (int i = 0; i < LOOKUPS; i++) {
+    int rv = storage_stat(path, &st);
+    if (rv < 0) {
+      fail(path, rv);
+    }
+  }
+  report("lookup", "hit", 0, LOOKUPS, now() - start, 0);
+
+  strcpy(path + dirLen, "/missing");
+  start = now();
+  for (int i = 0; i < LOOKUPS; i++) {
+    storage_stat(path, &st);
+  }
+  report("lookup", "miss", 0, LOOKUPS, now() - start, 0);
+  blocks_free();
+}
+
+// Write or read a file in ioSize requests, in order or at random aligned
+// offsets. Returns the seconds taken.
+static double transfer(int inum, char *buf, long ioSize, long total,
+                       int write, int random) {
+  long requests = total / ioSize;
+  double start = now();
+  for (long i = 0; i < requests; i++) {
+    off_t off = (random ? rand() % requests : i) * ioSize;
+    int rv = write ? storage_write_inum(inum, buf, ioSize, off)
+                   : storage_read_inum(inum, buf, ioSize, off);
+    if (rv != ioSize) {
+      fail(write ? "write" : "read", rv < 0 ? rv : -EIO);
+    }
+  }
+  if (write) {
+    storage_fsync_inum(inum);
+  }
+  return now() - start;
+}
+
+static void bench_io(int random) {
+  const char *workload = random ? "rand" : "seq";
+  long total = megabytes * 1024 * 1024;
+
+  for (int s = 0; s < size_count; s++) {
+    long ioSize = sizes[s];
+    if (ioSize > total) {
+      continue;
+    }
+    long requests = total / ioSize;
+    char *buf = malloc(ioSize);
+    for (long i = 0; i < ioSize; i++) {
+      buf[i] = rand();
+    }
+
+    fresh_image();
+    storage_mknod("/io", 0100644);
+    int inum = storage_open("/io");
+    // Random writes go to a file that is all there already, like a database
+    if (random) {
+      transfer(inum, buf, ioSize, total, 1, 0);
+    }
+    srand(1);
+    double secs = transfer(inum, buf, ioSize, total, 1, random);
+    report(workload, "write", ioSize, requests, secs,
+           (double) requests * ioSize);
+
+    cold_remount();
+    inum = storage_open("/io");
+    secs = transfer(inum, buf, ioSize, total, 0, random);
+    report(workload, "read", ioSize, requests, secs,
+           (double) requests * ioSize);
+
+    blocks_free();
+    free(buf);
+  }
+}
+
+// Counts the entries of one getdents-like batch, remembering where it
+// stopped
+typedef struct listing {
+  long entries;
+  int batch;
+  off_t cookie;
+} listing_t;
+
+static int list_entry(void *arg, const char *name, int inum, off_t cookie) {
+  listing_t *l = arg;
+  l->entries++;
+  l->cookie = cookie;
+  return ++l->batch == READDIR_BATCH;
+}
+
+static void bench_readdir() {
+  char path[64];
+  fresh_image();
+  storage_mknod("/big", 040755);
+  for (long i = 0; i < files; i++) {
+    snprintf(path, sizeof(path), "/big/entry-%ld", i);
+    int rv = storage_mknod(path, 0100644);
+    if (rv < 0) {
+      fail(path, rv);
+    }
+  }
+  int inum = storage_open("/big");
+
+  listing_t l = {0, 0, 0};
+  double start = now();
+  for (int pass = 0; pass < READDIR_PASSES; pass++) {
+    l.cookie = 0;
+    long before;
+    do {
+      before = l.entries;
+      l.batch = 0;
+      storage_readdir(inum, l.cookie, list_entry, &l);
+    } while (l.entries > before);
+  }
+  if (l.entries != files * READDIR_PASSES) {
+    fprintf(stderr, "nufs-bench: listed %ld entries, not %ld\n",
+            l.entries / READDIR_PASSES, files);
+    exit(1);
+  }
+  report("readdir", "cookies", 0, l.entries, now() - start, 0);
+
+  long count = 0;
+  start = now();
+  for (int pass = 0; pass < READDIR_PASSES; pass++) {
+    slist_t *names = storage_list("/big");
+    for (slist_t *n = names; n; n = n->next) {
+      count++;
+    }
+    s_free(names);
+  }
+  report("readdir", "slist", 0, count, now() - start, 0);
+  blocks_free();
+}
+
+// Size of a file server file: 4K to twice the mean, in 4K steps
+static long file_size() {
+  return (1 + rand() % (2 * MEAN_FILE / 4096)) * 4096;
+}
+
+static void bench_mixed() {
+  long pool = files < POOL_FILES ? files : POOL_FILES;
+  char *buf = malloc(2 * MEAN_FILE + APPEND_SIZE);
+  memset(buf, 'x', 2 * MEAN_FILE + APPEND_SIZE);
+  char path[64];
+
+  fresh_image();
+  storage_mknod("/srv", 040755);
+  srand(1);
+  for (long i = 0; i < pool; i++) {
+    snprintf(path, sizeof(path), "/srv/file%ld", i);
+    storage_mknod(path, 0100644);
+    storage_write(path, buf, file_size(), 0);
+  }
+
+  // Six operations a round, on one file picked at random
+  long rounds = files, ops = 0;
+  double bytes = 0;
+  struct stat st;
+  double start = now();
+  for (long r = 0; r < rounds; r++) {
+    snprintf(path, sizeof(path), "/srv/file%ld", rand() % pool);
+    long size = file_size();
+    storage_unlink(path);
+    storage_mknod(path, 0100644);
+    int rv = storage_write(path, buf, size, 0);
+    if (rv != size) {
+      fail(path, rv < 0 ? rv : -EIO);
+    }
+    storage_write(path, buf, APPEND_SIZE, size);
+    rv = storage_read(path, buf, size + APPEND_SIZE, 0);
+    if (rv != size + APPEND_SIZE) {
+      fail(path, rv < 0 ? rv : -EIO);
+    }
+    storage_stat(path, &st);
+    ops += 6;
+    bytes += 2.0 * (size + APPEND_SIZE);
+  }
+  report("mixed", "fileserver", 0, ops, now() - start, bytes);
+  blocks_free();
+  free(buf);
+}
+
+static const char *all_workloads[] = {"meta", "lookup", "seq", "rand",
+                                      "readdir", "mixed"};
+
+// Whether every name in a comma separated list is a workload
+static int known(const char *list) {
+  char *copy = strdup(list);
+  int ok = 1;
+  for (char *tok = strtok(copy, ","); tok && ok; tok = strtok(NULL, ",")) {
+    ok = 0;
+    for (size_t i = 0; i < sizeof(all_workloads) / sizeof(char *); i++) {
+      ok |= strcmp(tok, all_workloads[i]) == 0;
+    }
+  }
+  free(copy);
+  return ok;
+}
+
+static int wanted(const char *list, const char *workload) {
+  if (list == NULL) {
+    return 1;
+  }
+  size_t len = strlen(workload);
+  for (const char *p = list; (p = strstr(p, workload)) != NULL; p += len) {
+    if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0')) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  const char *workloads = NULL;
+  int header = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "w:n:d:m:s:i:l:H")) != -1) {
+    switch (opt) {
+    case 'w':
+      workloads = optarg;
+      break;
+    case 'n':
+      files = atol(optarg);
+      break;
+    case 'd':
+      depth = atoi(optarg);
+      break;
+    case 'm':
+      megabytes = atol(optarg);
+      break;
+    case 's':
+      size_count = 0;
+      for (char *tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) {
+        if (size_count == MAX_SIZES) {
+          usage();
+        }
+        sizes[size_count] = parse_size(tok);
+        if (sizes[size_count++] < 0) {
+          usage();
+        }
+      }
+      break;
+    case 'i':
+      image = optarg;
+      break;
+    case 'l':
+      label = optarg;
+      break;
+    case 'H':
+      header = 0;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc || files < 1 || depth < 1 || depth > 200 ||
+      megabytes < 1 || (workloads && !known(workloads))) {
+    usage();
+  }
+
+  // A temporary image goes once the run is over; one named with -i stays,
+  // for a look with fsck.nufs say
+  char temp[4096];
+  int keep = image != NULL;
+  if (!keep) {
+    const char *dir = getenv("TMPDIR");
+    snprintf(temp, sizeof(temp), "%s/nufs-bench-XXXXXX", dir ? dir : "/tmp");
+    int fd = mkstemp(temp);
+    if (fd < 0) {
+      fail("mkstemp", -errno);
+    }
+    close(fd);
+    image = temp;
+  }
+
+  if (header) {
+    printf("label,workload,op,io_size,count,seconds,ops_per_sec,"
+           "mb_per_sec\n");
+  }
+  if (wanted(workloads, "meta")) {
+    bench_meta();
+  }
+  if (wanted(workloads, "lookup")) {
+    bench_lookup();
+  }
+  if (wanted(workloads, "seq")) {
+    bench_io(0);
+  }
+  if (wanted(workloads, "rand")) {
+    bench_io(1);
+  }
+  if (wanted(workloads, "readdir")) {
+    bench_readdir();
+  }
+  if (wanted(workloads, "mixed")) {
+    bench_mixed();
+  }
+
+  if (!keep) {
+    unlink(image);
+  }
+  return 0;
+}
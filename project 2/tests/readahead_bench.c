@@ -0,0 +1,101 @@
+// Readahead benchmark: writes two files through the storage layer a chunk
+// of each at a time, so their extents alternate in the image, then drops
+// the image from the page cache and reads one file back sequentially, and
+// then random blocks of the other. Runs once with NUFS_READAHEAD_KB=0 and
+// once with the default window, and prints the read speeds.
+//
+// Usage: tests/readahead_bench [megabytes per file]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "storage.h"
+
+#define TEST_NAME "readahead_bench.img"
+#define CHUNK (1024 * 1024) // written to each file in turn
+#define READ_SIZE (128 * 1024)
+#define RANDOM_READS 2000
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Remount with nothing of the image in the page cache
+static void cold_mount() {
+  blocks_free();
+  int fd = open(TEST_NAME, O_RDONLY);
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+  storage_init(TEST_NAME);
+}
+
+static void bench(const char *readahead, long size) {
+  char *data = malloc(CHUNK);
+  char *back = malloc(READ_SIZE);
+
+  setenv("NUFS_READAHEAD_KB", readahead, 1);
+  unlink(TEST_NAME);
+  storage_init(TEST_NAME);
+  storage_mknod("/seq", 0100644);
+  storage_mknod("/rand", 0100644);
+  for (long off = 0; off < size; off += CHUNK) {
+    for (int i = 0; i < CHUNK; i++) {
+      data[i] = (off + i) * 7;
+    }
+    if (storage_write("/seq", data, CHUNK, off) != CHUNK ||
+        storage_write("/rand", data, CHUNK, off) != CHUNK) {
+      printf("write failed\n");
+      exit(1);
+    }
+  }
+
+  cold_mount();
+  double start = now();
+  for (long off = 0; off < size; off += READ_SIZE) {
+    if (storage_read("/seq", back, READ_SIZE, off) != READ_SIZE ||
+        back[READ_SIZE - 1] != (char) ((off + READ_SIZE - 1) * 7)) {
+      printf("read back the wrong data\n");
+      exit(1);
+    }
+  }
+  double seqSecs = now() - start;
+
+  cold_mount();
+  srand(1);
+  start = now();
+  for (int i = 0; i < RANDOM_READS; i++) {
+    long off = (rand() % (size / BLOCK_SIZE)) * BLOCK_SIZE;
+    if (storage_read("/rand", back, BLOCK_SIZE, off) != BLOCK_SIZE ||
+        back[0] != (char) (off * 7)) {
+      printf("read back the wrong data\n");
+      exit(1);
+    }
+  }
+  double randSecs = now() - start;
+
+  printf("readahead %5s KB %8.1f MB/s cold sequential read %8.0f us per "
+         "cold random read\n",
+         readahead, size / (1024.0 * 1024.0) / seqSecs,
+         randSecs * 1e6 / RANDOM_READS);
+
+  blocks_free();
+  unlink(TEST_NAME);
+  free(back);
+  free(data);
+}
+
+int main(int argc, char **argv) {
+  long size = (argc > 1 ? atol(argv[1]) : 256) * 1024 * 1024;
+
+  bench("0", size);
+  bench("2048", size);
+  return 0;
+}
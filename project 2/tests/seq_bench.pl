@@ -0,0 +1,48 @@
+#!/usr/bin/perl
+# Sequential I/O benchmark through FUSE: writes a file with dd in 1 MB
+# requests, remounts, and reads it back, once with data copied through
+# read/write (NUFS_SPLICE=0) and once through read_buf/write_buf.
+#
+# Usage: perl tests/seq_bench.pl [megabytes]
+
+use 5.16.0;
+use warnings FATAL => 'all';
+use Time::HiRes qw(time);
+
+my $mb = $ARGV[0] || 512;
+
+sub mount {
+    my ($splice) = @_;
+    system("mkdir -p mnt");
+    system("NUFS_SPLICE=$splice ./nufs -f mnt bench.nufs >> bench.log 2>&1 &");
+    sleep 1;
+}
+
+sub unmount {
+    system("fusermount -u mnt");
+    sleep 1;
+}
+
+sub timed_dd {
+    my ($args) = @_;
+    my $start = time;
+    system("dd $args bs=1M status=none") == 0 or die "dd $args failed\n";
+    return time - $start;
+}
+
+for my $splice (0, 1) {
+    system("rm -f bench.nufs");
+    mount($splice);
+    my $write = timed_dd("if=/dev/zero of=mnt/seq count=$mb conv=fsync");
+
+    # Remount so the reads aren't served from the kernel's page cache
+    unmount();
+    mount($splice);
+    my $read = timed_dd("if=mnt/seq of=/dev/null");
+    unmount();
+
+    printf("%-7s %8.1f MB/s write %8.1f MB/s read\n",
+           $splice ? "splice" : "copy", $mb / $write, $mb / $read);
+}
+
+system("rm -f bench.nufs");
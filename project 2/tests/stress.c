@@ -0,0 +1,226 @@
+// Concurrency stress test for a mounted nufs.
+//
+// Runs N writer threads, each filling its own file block by block in random
+// order, N reader threads checking random blocks of those files while they
+// are written, and N threads creating, renaming and deleting small files in
+// a shared directory. A block must read back either as all zeros (not
+// written yet) or as exactly what its writer put there.
+//
+// Usage: tests/stress <mount dir> [threads]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCK 4096
+#define FILE_BLOCKS 256
+#define READS 4000
+#define NS_OPS 300
+
+static const char *root;
+static int threads = 4;
+static volatile int failures = 0;
+
+static void fail(const char *what, const char *path) {
+  fprintf(stderr, "FAIL: %s %s (%s)\n", what, path, strerror(errno));
+  __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+}
+
+// Byte every block of a writer's file is filled with; never zero
+static int fill(int writer, int block) {
+  return 1 + (writer * 31 + block) % 255;
+}
+
+static void writer_path(char *path, int writer) {
+  sprintf(path, "%s/stress-w%d", root, writer);
+}
+
+// Write every block of one file once, in random order
+static void *writer(void *arg) {
+  int id = (long) arg;
+  char path[256];
+  writer_path(path, id);
+
+  int fd = open(path, O_WRONLY);
+  if (fd < 0) {
+    fail("open", path);
+    return NULL;
+  }
+
+  int order[FILE_BLOCKS];
+  for (int i = 0; i < FILE_BLOCKS; i++) {
+    order[i] = i;
+  }
+  unsigned seed = id;
+  for (int i = FILE_BLOCKS - 1; i > 0; i--) {
+    int j = rand_r(&seed) % (i + 1);
+    int tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+
+  char buf[BLOCK];
+  for (int i = 0; i < FILE_BLOCKS; i++) {
+    memset(buf, fill(id, order[i]), BLOCK);
+    if (pwrite(fd, buf, BLOCK, (off_t) order[i] * BLOCK) != BLOCK) {
+      fail("pwrite", path);
+    }
+  }
+  close(fd);
+
+  return NULL;
+}
+
+// Check that a block is either unwritten or complete
+static int check_block(const char *buf, int len, int expected) {
+  int first = buf[0] & 0xff;
+  if (first != 0 && first != expected) {
+    return 0;
+  }
+  for (int i = 1; i < len; i++) {
+    if ((buf[i] & 0xff) != first) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Read random blocks of the writers' files
+static void *reader(void *arg) {
+  unsigned seed = (long) arg + 1000;
+  char path[256];
+  char buf[BLOCK];
+
+  for (int i = 0; i < READS; i++) {
+    int id = rand_r(&seed) % threads;
+    int block = rand_r(&seed) % FILE_BLOCKS;
+    writer_path(path, id);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      fail("open", path);
+      continue;
+    }
+    // past the end of the file reads nothing, which counts as unwritten
+    memset(buf, 0, BLOCK);
+    int n = pread(fd, buf, BLOCK, (off_t) block * BLOCK);
+    if (n < 0) {
+      fail("pread", path);
+    }
+    else if (!check_block(buf, BLOCK, fill(id, block))) {
+      fprintf(stderr, "FAIL: torn or wrong block %d of %s\n", block, path);
+      __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+    }
+    close(fd);
+  }
+
+  return NULL;
+}
+
+// Create, rename, stat and delete small files in a shared directory
+static void *churn(void *arg) {
+  int id = (long) arg;
+  char a[256], b[256];
+  struct stat st;
+
+  for (int i = 0; i < NS_OPS; i++) {
+    sprintf(a, "%s/stress-ns/a%d-%d", root, id, i);
+    sprintf(b, "%s/stress-ns/b%d-%d", root, id, i);
+
+    int fd = open(a, O_CREAT | O_WRONLY, 0644);
+    if (fd < 0) {
+      fail("create", a);
+      continue;
+    }
+    if (write(fd, a, strlen(a)) != (ssize_t) strlen(a)) {
+      fail("write", a);
+    }
+    close(fd);
+
+    if (rename(a, b) != 0) {
+      fail("rename", a);
+    }
+    if (stat(a, &st) == 0) {
+      fail("still exists", a);
+    }
+    if (stat(b, &st) != 0 || st.st_size != (off_t) strlen(a)) {
+      fail("stat", b);
+    }
+    // keep every other file so the directory keeps growing
+    if (i % 2 == 0 && unlink(b) != 0) {
+      fail("unlink", b);
+    }
+  }
+
+  return NULL;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <mount dir> [threads]\n", argv[0]);
+    return 2;
+  }
+  root = argv[1];
+  if (argc > 2) {
+    threads = atoi(argv[2]);
+  }
+
+  char path[256];
+  for (int i = 0; i < threads; i++) {
+    writer_path(path, i);
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) {
+      fail("create", path);
+      return 1;
+    }
+    close(fd);
+  }
+  sprintf(path, "%s/stress-ns", root);
+  mkdir(path, 0755);
+
+  pthread_t tids[3 * threads];
+  double start = now();
+  for (long i = 0; i < threads; i++) {
+    pthread_create(&tids[3 * i], NULL, writer, (void *) i);
+    pthread_create(&tids[3 * i + 1], NULL, reader, (void *) i);
+    pthread_create(&tids[3 * i + 2], NULL, churn, (void *) i);
+  }
+  for (int i = 0; i < 3 * threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  double secs = now() - start;
+
+  // Every block must be there now
+  char buf[BLOCK];
+  for (int i = 0; i < threads; i++) {
+    writer_path(path, i);
+    int fd = open(path, O_RDONLY);
+    for (int b = 0; fd >= 0 && b < FILE_BLOCKS; b++) {
+      if (pread(fd, buf, BLOCK, (off_t) b * BLOCK) != BLOCK ||
+          (buf[0] & 0xff) != fill(i, b) || !check_block(buf, BLOCK, fill(i, b))) {
+        fprintf(stderr, "FAIL: block %d of %s after the run\n", b, path);
+        failures++;
+        break;
+      }
+    }
+    close(fd);
+    unlink(path);
+  }
+
+  printf("%d threads x (writer, reader, churn): %.2fs, %d failures\n",
+         threads, secs, failures);
+
+  return failures == 0 ? 0 : 1;
+}
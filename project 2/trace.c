@@ -0,0 +1,128 @@
+// Per-thread trace rings and the dump to file. See trace.h.
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+typedef struct trace_ring {
+  uint64_t head;             // records ever written; only the owner writes
+  uint32_t thread;
+  struct trace_ring *next;   // all rings, newest first
+  trace_record_t records[TRACE_RING_RECORDS];
+} trace_ring_t;
+
+int trace_level = 0;
+
+static char trace_path[PATH_MAX] = "nufs.trace";
+static trace_ring_t *rings = NULL;
+static uint32_t thread_count = 0;
+static __thread trace_ring_t *my_ring = NULL;
+
+#define TRACE_OP_NAME(op, name) name,
+static const char *op_names[] = { TRACE_OP_LIST(TRACE_OP_NAME) };
+#undef TRACE_OP_NAME
+
+void trace_init() {
+  const char *level = getenv("NUFS_TRACE");
+  const char *path = getenv("NUFS_TRACE_FILE");
+  trace_level = level ? atoi(level) : 0;
+  if (path == NULL || *path == 0) {
+    path = "nufs.trace";
+  }
+
+  // FUSE changes to / when it goes into the background
+  char cwd[PATH_MAX];
+  if (path[0] != '/' && getcwd(cwd, sizeof(cwd))) {
+    snprintf(trace_path, sizeof(trace_path), "%s/%s", cwd, path);
+  } else {
+    snprintf(trace_path, sizeof(trace_path), "%s", path);
+  }
+}
+
+// Give the calling thread a ring and link it in where trace_dump finds it
+static trace_ring_t *ring_new() {
+  trace_ring_t *ring = calloc(1, sizeof(trace_ring_t));
+  if (ring == NULL) {
+    return NULL;
+  }
+  ring->thread = __atomic_fetch_add(&thread_count, 1, __ATOMIC_RELAXED);
+  ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+  my_ring = ring;
+  return ring;
+}
+
+void trace_emit(trace_op_t op, int inum, int64_t size, int result) {
+  trace_ring_t *ring = my_ring;
+  if (ring == NULL && (ring = ring_new()) == NULL) {
+    return;
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  uint64_t head = ring->head;
+  trace_record_t *rec = &ring->records[head & (TRACE_RING_RECORDS - 1)];
+  rec->ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  rec->thread = ring->thread;
+  rec->op = op;
+  rec->pad = 0;
+  rec->inum = inum;
+  rec->result = result;
+  rec->size = size;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+long trace_dump() {
+  trace_ring_t *first = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+  if (first == NULL) {
+    return 0;
+  }
+
+  FILE *out = fopen(trace_path, "w");
+  if (out == NULL) {
+    perror(trace_path);
+    return -1;
+  }
+
+  trace_file_header_t hdr = { TRACE_MAGIC, sizeof(trace_record_t), 0, 0 };
+  fwrite(&hdr, sizeof(hdr), 1, out);
+
+  for (trace_ring_t *ring = first; ring; ring = ring->next) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t start = 0;
+    if (head > TRACE_RING_RECORDS) {
+      start = head - TRACE_RING_RECORDS;
+      hdr.dropped += start;
+    }
+    // the oldest records wrap around the end of the array
+    uint64_t from = start & (TRACE_RING_RECORDS - 1);
+    uint64_t count = head - start;
+    uint64_t tail = TRACE_RING_RECORDS - from < count
+                    ? TRACE_RING_RECORDS - from : count;
+    fwrite(&ring->records[from], sizeof(trace_record_t), tail, out);
+    fwrite(ring->records, sizeof(trace_record_t), count - tail, out);
+    hdr.records += count;
+  }
+
+  rewind(out);
+  fwrite(&hdr, sizeof(hdr), 1, out);
+  if (fclose(out) != 0) {
+    perror(trace_path);
+    return -1;
+  }
+  return hdr.records;
+}
+
+const char *trace_op_name(int op) {
+  if (op < 0 || op >= TRACE_OP_COUNT) {
+    return NULL;
+  }
+  return op_names[op];
+}
@@ -0,0 +1,94 @@
+// Low-overhead operation tracing.
+//
+// Every thread that emits a trace record gets its own ring buffer of
+// fixed-size binary records, so tracing never takes a lock or calls into
+// stdio on the hot path; old records are overwritten once a ring is full.
+// The rings are written to a file by trace_dump (at unmount) and turned back
+// into text by the nufs_trace tool.
+//
+// Tracing is levelled twice over: NUFS_TRACE_MAX picks the highest level
+// compiled in (make TRACE_MAX=0 removes every call site), and trace_level,
+// set from the NUFS_TRACE environment variable, the level recorded at run
+// time. With tracing off a call site costs one well-predicted branch.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x4352544e // "NTRC" in little-endian
+#define TRACE_RING_RECORDS 65536 // per thread, a power of two
+
+// Trace levels
+#define TRACE_OPS 1   // filesystem operations
+#define TRACE_ALLOC 2 // block and inode allocation
+
+#ifndef NUFS_TRACE_MAX
+#define NUFS_TRACE_MAX TRACE_ALLOC
+#endif
+
+// Operation codes. The names are what nufs_trace prints.
+#define TRACE_OP_LIST(X)                                                      \
+  X(ACCESS, "access") X(GETATTR, "getattr") X(FGETATTR, "fgetattr")          \
+  X(READDIR, "readdir") X(MKNOD, "mknod") X(MKDIR, "mkdir")                  \
+  X(CREATE, "create") X(UNLINK, "unlink") X(RMDIR, "rmdir")                  \
+  X(LINK, "link") X(RENAME, "rename") X(CHMOD, "chmod")                      \
+  X(TRUNCATE, "truncate") X(FTRUNCATE, "ftruncate") X(OPEN, "open")          \
+  X(READ, "read") X(WRITE, "write") X(LSEEK, "lseek") X(UTIMENS, "utimens")  \
+  X(IOCTL, "ioctl") X(SYMLINK, "symlink") X(READLINK, "readlink")            \
+  X(LOOKUP, "lookup") X(SETATTR, "setattr") X(OPENDIR, "opendir")            \
+  X(FSYNC, "fsync") X(FSYNCDIR, "fsyncdir") X(FORGET, "forget")              \
+  X(ALLOC_BLOCKS, "alloc_blocks") X(FREE_BLOCKS, "free_blocks")              \
+  X(ALLOC_INODE, "alloc_inode") X(FREE_INODE, "free_inode")
+
+#define TRACE_OP_ENUM(op, name) TRACE_##op,
+typedef enum trace_op { TRACE_OP_LIST(TRACE_OP_ENUM) TRACE_OP_COUNT } trace_op_t;
+#undef TRACE_OP_ENUM
+
+// One traced event, 32 bytes
+typedef struct trace_record {
+  uint64_t ns;     // CLOCK_MONOTONIC time the event finished
+  uint32_t thread; // small per-process thread number, from 0
+  uint16_t op;     // trace_op_t
+  uint16_t pad;
+  int32_t inum;    // inode involved, -1 if unknown
+  int32_t result;  // return value, a negative errno on failure
+  int64_t size;    // bytes, block count or offset, depending on op
+} trace_record_t;
+
+// Header of a trace file; the records of every thread follow, each
+// thread's oldest first.
+typedef struct trace_file_header {
+  uint32_t magic;
+  uint32_t record_size; // sizeof(trace_record_t)
+  uint64_t records;
+  uint64_t dropped;     // overwritten before they could be dumped
+} trace_file_header_t;
+
+// The level being recorded, 0 when tracing is off.
+extern int trace_level;
+
+// Record an event if level is being traced.
+#define TRACE(level, op, inum, size, result)                                  \
+  do {                                                                        \
+    if (NUFS_TRACE_MAX >= (level) &&                                          \
+        __builtin_expect(trace_level >= (level), 0)) {                        \
+      trace_emit(TRACE_##op, (inum), (size), (result));                       \
+    }                                                                         \
+  } while (0)
+
+// Read the level from NUFS_TRACE and the dump file from NUFS_TRACE_FILE
+// (default nufs.trace).
+void trace_init();
+
+// Append a record to the calling thread's ring. Use TRACE instead.
+void trace_emit(trace_op_t op, int inum, int64_t size, int result);
+
+// Write every ring to the file given to trace_init. Call once the traced
+// threads are done. Returns the number of records written, or -1.
+long trace_dump();
+
+// Name of an operation code, or NULL if there is no such code.
+const char *trace_op_name(int op);
+
+#endif